@@ -0,0 +1,129 @@
+#ifndef ALLOCATION_TRACKER_H
+#define ALLOCATION_TRACKER_H
+
+#include "utility.h"
+#include <cstdlib>
+#include <cstring>
+
+// Number of operator new calls made so far by the calling thread, counted by
+// the replacement operators of allocationTracker.cpp. Only built with
+// -DALLOCATION_TRACKING=ON, the count stays at zero otherwise.
+size_t threadAllocationCount();
+
+// Heap allocations made by one stage while processing a scan, between
+// beginScan() and endScan() on the stage thread. Past the first
+// allocationWarmupScans, every scan that still allocates is accounted for and
+// a summary is logged every allocationReportScans scans.
+// The allocations of third party code that allocates on every call are
+// expected: each such call is wrapped in an Allowance, which lists them
+// separately. A stage built to run without allocating (zeroSteadyState)
+// aborts at the report when anything else allocated, so that an
+// ALLOCATION_TRACKING build fed with a bag or a dataset fails on a
+// regression.
+class AllocationMonitor {
+ public:
+  // Scope of expected allocations, what is a string literal naming them.
+  // Allowances do not nest.
+  class Allowance {
+   public:
+    Allowance(AllocationMonitor &monitor, const char *what)
+        : _monitor(monitor), _what(what), _start(threadAllocationCount()) {}
+    ~Allowance() { _monitor.allow(_what, threadAllocationCount() - _start); }
+
+   private:
+    AllocationMonitor &_monitor;
+    const char *_what;
+    size_t _start;
+  };
+
+  AllocationMonitor(const char *stage, bool zeroSteadyState)
+      : _stage(stage),
+        _zero_steady_state(zeroSteadyState),
+        _start(0),
+        _scan_allowed(0),
+        _scans(0),
+        _steady_scans(0),
+        _allocating_scans(0),
+        _steady_allocations(0),
+        _max_allocations(0),
+        _allowance_count(0) {}
+
+  void beginScan() {
+    _start = threadAllocationCount();
+    _scan_allowed = 0;
+  }
+
+  void endScan() {
+#ifdef ALLOCATION_TRACKING
+    const size_t count = threadAllocationCount() - _start - _scan_allowed;
+    if (++_scans <= allocationWarmupScans) return;
+
+    _steady_scans++;
+    if (count > 0) {
+      _allocating_scans++;
+      _steady_allocations += count;
+      _max_allocations = std::max(_max_allocations, count);
+    }
+    if (_steady_scans % allocationReportScans == 0) {
+      report();
+      if (_zero_steady_state && _steady_allocations > 0) {
+        ROS_FATAL("%s must not allocate after warm-up: %lu allocations outside "
+                  "the allowances", _stage, _steady_allocations);
+        std::abort();
+      }
+    }
+#endif
+  }
+
+  void report() const {
+    ROS_INFO("%s heap allocations after warm-up: %lu of %lu scans allocated, "
+             "%lu allocations, at most %lu in one scan",
+             _stage, _allocating_scans, _steady_scans, _steady_allocations,
+             _max_allocations);
+    for (size_t i = 0; i < _allowance_count; i++) {
+      ROS_INFO("%s expected allocations after warm-up: %lu in %s", _stage,
+               _allowances[i].count, _allowances[i].what);
+    }
+  }
+
+  size_t steadyStateAllocations() const { return _steady_allocations; }
+
+ private:
+  enum { MAX_ALLOWANCES = 8 };
+
+  struct AllowanceCount {
+    const char *what;
+    size_t count;
+  };
+
+  void allow(const char *what, size_t count) {
+    _scan_allowed += count;
+    if (_scans < allocationWarmupScans) return;
+    // a fixed table, counting must not allocate
+    size_t i = 0;
+    while (i < _allowance_count && std::strcmp(_allowances[i].what, what) != 0) {
+      i++;
+    }
+    if (i == MAX_ALLOWANCES) i--;  // more scopes than entries: merged in the last one
+    if (i == _allowance_count) {
+      _allowances[i].what = what;
+      _allowances[i].count = 0;
+      _allowance_count++;
+    }
+    _allowances[i].count += count;
+  }
+
+  const char *_stage;
+  const bool _zero_steady_state;
+  size_t _start;
+  size_t _scan_allowed;
+  size_t _scans;
+  size_t _steady_scans;
+  size_t _allocating_scans;
+  size_t _steady_allocations;
+  size_t _max_allocations;
+  AllowanceCount _allowances[MAX_ALLOWANCES];
+  size_t _allowance_count;
+};
+
+#endif  // ALLOCATION_TRACKER_H
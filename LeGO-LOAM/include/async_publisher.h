@@ -0,0 +1,240 @@
+#ifndef ASYNC_PUBLISHER_H
+#define ASYNC_PUBLISHER_H
+
+#include "utility.h"
+#include "cloud_codec.h"
+#include "cloud_msgs/CompressedCloud.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+
+// Serializes and publishes the visualization clouds on its own thread, so that
+// the processing stages never pay for pcl::toROSMsg and the transport.
+// The stages hand over clouds that nobody modifies anymore. The queue is
+// bounded: under load the oldest message of the same topic is dropped first,
+// since a newer one supersedes it, otherwise the oldest message overall.
+// With compression enabled, each cloud topic also gets a <topic>/compressed
+// twin (cloud_msgs/CompressedCloud, see cloud_codec.h), encoded on the same
+// thread when it has subscribers. The encode time of every topic is reported.
+// The copies of publishCopy() are recycled per topic once published, so that
+// the stages do not allocate for them after the first scans.
+class AsyncPublisher {
+ public:
+  typedef pcl::PointCloud<PointType> Cloud;
+
+  enum Output { RAW = 1, COMPRESSED = 2 };
+
+  explicit AsyncPublisher(size_t capacity = 16)
+      : _capacity(capacity), _nh(nullptr), _resolution(0), _stop(false),
+        _dropped(0) {
+    _queue.reserve(_capacity + 1);
+    _thread = std::thread(&AsyncPublisher::run, this);
+  }
+
+  ~AsyncPublisher() {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stop = true;
+    }
+    _cv.notify_all();
+    _thread.join();
+  }
+
+  // Before the first publication: x, y, z are quantized to resolution (m)
+  void enableCompression(ros::NodeHandle &nh, float resolution) {
+    _nh = &nh;
+    _resolution = resolution;
+  }
+
+  // The cloud must not be modified afterwards
+  void publish(const ros::Publisher &pub, const Cloud::ConstPtr &cloud,
+               const ros::Time &stamp, const std::string &frame_id,
+               int outputs = RAW | COMPRESSED) {
+    Job job;
+    if (!route(pub, outputs, job)) return;
+    job.cloud = cloud;
+    job.stamp = stamp;
+    job.frame_id = frame_id;
+    push(std::move(job));
+  }
+
+  // For buffers the stage keeps reusing: only the points are copied here
+  void publishCopy(const ros::Publisher &pub, const Cloud &cloud,
+                   const ros::Time &stamp, const std::string &frame_id,
+                   int outputs = RAW | COMPRESSED) {
+    Job job;
+    if (!route(pub, outputs, job)) return;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::vector<Cloud::Ptr> &spare = _topics[pub].spare;
+      if (!spare.empty()) {
+        job.copy = std::move(spare.back());
+        spare.pop_back();
+      }
+    }
+    if (!job.copy) job.copy.reset(new Cloud());
+    *job.copy = cloud;
+    job.cloud = job.copy;
+    job.stamp = stamp;
+    job.frame_id = frame_id;
+    push(std::move(job));
+  }
+
+  size_t dropped() const { return _dropped.load(); }
+
+  // Encode time and size of the compressed clouds, per topic
+  void report() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const auto &entry : _stats) {
+      const EncodeStats &stats = entry.second;
+      ROS_INFO("Compressed %s: %lu clouds, encode %.2f ms mean, %.2f ms max, "
+               "%.0f points and %.1f kB per cloud, %.1fx smaller%s",
+               entry.first.c_str(), stats.clouds,
+               stats.seconds * 1000 / stats.clouds, stats.maxSeconds * 1000,
+               double(stats.points) / stats.clouds,
+               stats.bytes / 1024.0 / stats.clouds,
+               double(stats.points * sizeof(PointType)) /
+                   std::max<size_t>(1, stats.bytes),
+               stats.roundTripFailed ? ", ROUND TRIP FAILED" : "");
+    }
+  }
+
+ private:
+  struct Job {
+    ros::Publisher pub;
+    Cloud::ConstPtr cloud;
+    ros::Time stamp;
+    std::string frame_id;
+    bool raw = false;
+    ros::Publisher compressed;  // invalid when not wanted
+    Cloud::Ptr copy;            // publishCopy() only, recycled
+  };
+
+  struct Topic {
+    ros::Publisher compressed;  // advertised on first use
+    std::vector<Cloud::Ptr> spare;
+  };
+
+  struct EncodeStats {
+    size_t clouds = 0;
+    size_t points = 0;
+    size_t bytes = 0;
+    double seconds = 0;
+    double maxSeconds = 0;
+    bool roundTripFailed = false;
+  };
+
+  // Which outputs have subscribers, false if none
+  bool route(const ros::Publisher &pub, int outputs, Job &job) {
+    job.pub = pub;
+    job.raw = (outputs & RAW) && pub.getNumSubscribers() > 0;
+    if ((outputs & COMPRESSED) && _resolution > 0) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      ros::Publisher &twin = _topics[pub].compressed;
+      if (!twin) {
+        twin = _nh->advertise<cloud_msgs::CompressedCloud>(
+            pub.getTopic() + "/compressed", 2);
+      }
+      if (twin.getNumSubscribers() > 0) job.compressed = twin;
+    }
+    return job.raw || job.compressed;
+  }
+
+  // _mutex held
+  void recycle(Job &job) {
+    if (!job.copy) return;
+    job.cloud.reset();
+    _topics[job.pub].spare.push_back(std::move(job.copy));
+  }
+
+  void push(Job &&job) {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_queue.size() >= _capacity) {
+        auto stale = std::find_if(_queue.begin(), _queue.end(),
+                                  [&](const Job &queued) {
+                                    return queued.pub == job.pub;
+                                  });
+        auto victim = stale != _queue.end() ? stale : _queue.begin();
+        recycle(*victim);
+        _queue.erase(victim);
+        const size_t dropped = ++_dropped;
+        ROS_WARN_THROTTLE(10, "Visualization lagging, %lu messages dropped",
+                          dropped);
+      }
+      _queue.push_back(std::move(job));
+    }
+    _cv.notify_one();
+  }
+
+  void run() {
+    sensor_msgs::PointCloud2 msg;
+    cloud_msgs::CompressedCloud compressedMsg;
+    CloudCodec codec;
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]() { return _stop || !_queue.empty(); });
+        if (_stop) break;
+        job = std::move(_queue.front());
+        _queue.erase(_queue.begin());
+      }
+      if (job.raw) {
+        pcl::toROSMsg(*job.cloud, msg);
+        msg.header.stamp = job.stamp;
+        msg.header.frame_id = job.frame_id;
+        job.pub.publish(msg);
+      }
+      if (job.compressed) {
+        // map clouds have no meaningful order, scan clouds go ring by ring
+        const CloudCodec::Order order = (job.frame_id == "/camera_init")
+                                            ? CloudCodec::OCTREE
+                                            : CloudCodec::ORDERED;
+        const auto start = std::chrono::steady_clock::now();
+        if (!codec.encode(*job.cloud, _resolution, order, compressedMsg.data)) {
+          std::lock_guard<std::mutex> lock(_mutex);
+          recycle(job);
+          continue;
+        }
+        const double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+        compressedMsg.header.stamp = job.stamp;
+        compressedMsg.header.frame_id = job.frame_id;
+        job.compressed.publish(compressedMsg);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        EncodeStats &stats = _stats[job.pub.getTopic()];
+        // the first cloud of each topic is decoded back
+        if (stats.clouds == 0 &&
+            !codec.roundTrip(*job.cloud, _resolution, compressedMsg.data)) {
+          stats.roundTripFailed = true;
+          ROS_ERROR("%s/compressed does not decode back to the cloud",
+                    job.pub.getTopic().c_str());
+        }
+        stats.clouds++;
+        stats.points += job.cloud->points.size();
+        stats.bytes += compressedMsg.data.size();
+        stats.seconds += seconds;
+        stats.maxSeconds = std::max(stats.maxSeconds, seconds);
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      recycle(job);
+    }
+  }
+
+  const size_t _capacity;
+  ros::NodeHandle *_nh;
+  float _resolution;  // 0: no compressed twins
+  std::map<ros::Publisher, Topic> _topics;    // by raw publisher
+  std::map<std::string, EncodeStats> _stats;  // by raw topic
+  std::thread _thread;
+  mutable std::mutex _mutex;
+  std::condition_variable _cv;
+  std::vector<Job> _queue;  // at most _capacity, never reallocated
+  bool _stop;
+  std::atomic<size_t> _dropped;
+};
+
+#endif  // ASYNC_PUBLISHER_H
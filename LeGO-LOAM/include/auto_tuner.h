@@ -0,0 +1,234 @@
+#ifndef AUTO_TUNER_H
+#define AUTO_TUNER_H
+
+#include "utility.h"
+
+// Knobs trading accuracy for latency. Defaults are the original hard-coded values.
+struct TuningProfile {
+  // feature association
+  float odometryLeafSize;
+  int sharpFeatureNum;      // per sub-region
+  int lessSharpFeatureNum;  // per sub-region
+  int flatFeatureNum;       // per sub-region
+  // map optimization
+  float mappingCornerLeafSize;
+  float mappingSurfLeafSize;
+  float surroundingKeyframeSearchRadius;
+
+  TuningProfile()
+      : odometryLeafSize(0.2),
+        sharpFeatureNum(2),
+        lessSharpFeatureNum(20),
+        flatFeatureNum(4),
+        mappingCornerLeafSize(0.2),
+        mappingSurfLeafSize(0.4),
+        surroundingKeyframeSearchRadius(::surroundingKeyframeSearchRadius) {}
+
+  // Override the defaults with the parameters found in the "tuning" namespace
+  void load(ros::NodeHandle &nh) {
+    nh.param("tuning/odometry_leaf_size", odometryLeafSize, odometryLeafSize);
+    nh.param("tuning/sharp_feature_num", sharpFeatureNum, sharpFeatureNum);
+    nh.param("tuning/less_sharp_feature_num", lessSharpFeatureNum, lessSharpFeatureNum);
+    nh.param("tuning/flat_feature_num", flatFeatureNum, flatFeatureNum);
+    nh.param("tuning/mapping_corner_leaf_size", mappingCornerLeafSize, mappingCornerLeafSize);
+    nh.param("tuning/mapping_surf_leaf_size", mappingSurfLeafSize, mappingSurfLeafSize);
+    nh.param("tuning/surrounding_keyframe_search_radius",
+             surroundingKeyframeSearchRadius, surroundingKeyframeSearchRadius);
+  }
+
+  // Write the profile as a rosparam file that load() understands
+  bool save(const std::string &path, const std::string &node_name) const {
+    std::ofstream out(path.c_str());
+    if (!out) return false;
+    out << "# LeGO-LOAM tuned profile, load it with <rosparam file=\"...\" command=\"load\"/>\n"
+        << node_name << ":\n"
+        << "    tuning:\n"
+        << "        odometry_leaf_size: " << odometryLeafSize << "\n"
+        << "        sharp_feature_num: " << sharpFeatureNum << "\n"
+        << "        less_sharp_feature_num: " << lessSharpFeatureNum << "\n"
+        << "        flat_feature_num: " << flatFeatureNum << "\n"
+        << "        mapping_corner_leaf_size: " << mappingCornerLeafSize << "\n"
+        << "        mapping_surf_leaf_size: " << mappingSurfLeafSize << "\n"
+        << "        surrounding_keyframe_search_radius: "
+        << surroundingKeyframeSearchRadius << "\n";
+    return out.good();
+  }
+};
+
+// Watches the latency and the number of correspondences of each stage and moves
+// the knobs of the profile, one step at a time and within fixed bounds, to hold
+// a target latency.
+// Latency too high: the next knob is moved towards cheaper processing.
+// Latency well below the target, or too few correspondences: the last move is
+// undone. Moves are undone in the reverse order they were made, so the profile
+// never gets more expensive than the configured one.
+class AutoTuner {
+ public:
+  enum Stage { ODOMETRY = 0, MAPPING = 1 };
+
+  AutoTuner() : _enabled(false) {
+    _target[ODOMETRY] = 0.05;
+    _target[MAPPING] = 0.3;
+    _window[ODOMETRY] = 50;
+    _window[MAPPING] = 10;
+    _minCorrespondences[ODOMETRY] = 100;
+    _minCorrespondences[MAPPING] = 500;
+
+    // knobs in the order they are degraded
+    _knobs[ODOMETRY].push_back(Knob("less_sharp_feature_num", &TuningProfile::lessSharpFeatureNum,
+                                    8, 20, 2, -1));
+    _knobs[ODOMETRY].push_back(Knob("flat_feature_num", &TuningProfile::flatFeatureNum,
+                                    2, 6, 1, -1));
+    _knobs[ODOMETRY].push_back(Knob("odometry_leaf_size", &TuningProfile::odometryLeafSize,
+                                    0.1, 0.4, 0.05, 1));
+    _knobs[ODOMETRY].push_back(Knob("sharp_feature_num", &TuningProfile::sharpFeatureNum,
+                                    1, 4, 1, -1));
+
+    _knobs[MAPPING].push_back(Knob("surrounding_keyframe_search_radius",
+                                   &TuningProfile::surroundingKeyframeSearchRadius,
+                                   20.0, 80.0, 5.0, -1));
+    _knobs[MAPPING].push_back(Knob("mapping_surf_leaf_size", &TuningProfile::mappingSurfLeafSize,
+                                   0.2, 0.8, 0.1, 1));
+    _knobs[MAPPING].push_back(Knob("mapping_corner_leaf_size", &TuningProfile::mappingCornerLeafSize,
+                                   0.1, 0.4, 0.05, 1));
+
+    resetWindow(ODOMETRY);
+    resetWindow(MAPPING);
+  }
+
+  void configure(bool enabled, double targetOdometryLatency,
+                 double targetMappingLatency) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _enabled = enabled;
+    _target[ODOMETRY] = targetOdometryLatency;
+    _target[MAPPING] = targetMappingLatency;
+  }
+
+  bool enabled() const { return _enabled; }
+
+  TuningProfile profile() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _profile;
+  }
+
+  void setProfile(const TuningProfile &profile) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _profile = profile;
+    _moves[ODOMETRY].clear();
+    _moves[MAPPING].clear();
+  }
+
+  // Called once per processed scan by each stage
+  void report(Stage stage, double latency, size_t correspondences) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_enabled) return;
+
+    _latencySum[stage] += latency;
+    _correspondenceSum[stage] += correspondences;
+    if (++_samples[stage] < _window[stage]) return;
+
+    const double meanLatency = _latencySum[stage] / _samples[stage];
+    const size_t meanCorrespondences = _correspondenceSum[stage] / _samples[stage];
+    resetWindow(stage);
+
+    const bool starving = meanCorrespondences < _minCorrespondences[stage];
+    if (meanLatency > 1.1 * _target[stage] && !starving) {
+      adjust(stage, true, meanLatency, meanCorrespondences);
+    } else if (meanLatency < 0.7 * _target[stage] || starving) {
+      adjust(stage, false, meanLatency, meanCorrespondences);
+    }
+  }
+
+ private:
+  struct Knob {
+    const char *name;
+    float TuningProfile::*floatValue;
+    int TuningProfile::*intValue;
+    float min, max, step;
+    int cheaper;  // direction of the cheaper setting, +1 or -1
+
+    Knob(const char *n, float TuningProfile::*value, float lo, float hi,
+         float s, int c)
+        : name(n), floatValue(value), intValue(nullptr), min(lo), max(hi),
+          step(s), cheaper(c) {}
+    Knob(const char *n, int TuningProfile::*value, float lo, float hi,
+         float s, int c)
+        : name(n), floatValue(nullptr), intValue(value), min(lo), max(hi),
+          step(s), cheaper(c) {}
+
+    float get(const TuningProfile &p) const {
+      return floatValue ? p.*floatValue : float(p.*intValue);
+    }
+    void set(TuningProfile &p, float v) const {
+      if (floatValue) p.*floatValue = v;
+      else p.*intValue = int(std::round(v));
+    }
+    // Move one step, returns false if the bound is already reached
+    bool move(TuningProfile &p, int direction) const {
+      const float current = get(p);
+      const float next = std::max(min, std::min(max, current + direction * step));
+      if (std::fabs(next - current) < 1e-4) return false;
+      set(p, next);
+      return true;
+    }
+  };
+
+  // A step made towards cheaper processing, undone as a whole
+  struct Move {
+    size_t knob;
+    float before;
+  };
+
+  void adjust(Stage stage, bool cheaper, double meanLatency,
+              size_t meanCorrespondences) {
+    const std::vector<Knob> &knobs = _knobs[stage];
+    std::vector<Move> &moves = _moves[stage];
+    const Knob *knob = nullptr;
+    float before = 0;
+    if (cheaper) {
+      // degrade in list order
+      for (size_t n = 0; n < knobs.size() && !knob; n++) {
+        before = knobs[n].get(_profile);
+        if (knobs[n].move(_profile, knobs[n].cheaper)) {
+          moves.push_back(Move{n, before});
+          knob = &knobs[n];
+        }
+      }
+    } else if (!moves.empty()) {
+      // back to the value before the last move, at most the configured one
+      knob = &knobs[moves.back().knob];
+      before = knob->get(_profile);
+      knob->set(_profile, moves.back().before);
+      moves.pop_back();
+    }
+    if (!knob) return;
+
+    ROS_INFO("Auto-tuner: %s latency %.1f ms (target %.1f ms), %lu "
+             "correspondences, %s %g -> %g",
+             stage == ODOMETRY ? "odometry" : "mapping",
+             meanLatency * 1000, _target[stage] * 1000, meanCorrespondences,
+             knob->name, before, knob->get(_profile));
+  }
+
+  void resetWindow(Stage stage) {
+    _samples[stage] = 0;
+    _latencySum[stage] = 0;
+    _correspondenceSum[stage] = 0;
+  }
+
+  mutable std::mutex _mutex;
+  bool _enabled;
+  TuningProfile _profile;
+  std::vector<Knob> _knobs[2];
+  std::vector<Move> _moves[2];  // made since the configured profile
+
+  double _target[2];
+  size_t _window[2];
+  size_t _minCorrespondences[2];
+
+  size_t _samples[2];
+  double _latencySum[2];
+  size_t _correspondenceSum[2];
+};
+
+#endif  // AUTO_TUNER_H
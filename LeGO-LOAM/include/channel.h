@@ -43,12 +43,27 @@ template<class T> class Channel {
     _cv.notify_all();
   }
 
-  // Move an item out of the channel.
+  // Swap an item into the channel: item gets back what the receiver left in
+  // the channel, so that buffers go round between the two threads instead of
+  // being allocated for every item.
+  // Block if not empty
+  void exchange(T &item) {
+    std::unique_lock<std::mutex> lock(_m);
+    if(_blocking_send){
+      _cv.wait(lock, [&](){ return _empty; });
+    }
+    std::swap(_item, item);
+    _empty = false;
+    _cv.notify_all();
+  }
+
+  // Swap an item out of the channel. The previous content of item is left
+  // for the sender, who gets it back with its next exchange().
   // Block if empty
   void receive(T &item) {
     std::unique_lock<std::mutex> lock(_m);
     _cv.wait(lock, [&](){ return !_empty; });
-    item = std::move(_item);
+    std::swap(item, _item);
     _empty = true;
     _cv.notify_all();
   }
@@ -0,0 +1,265 @@
+#ifndef CLOUD_CODEC_H
+#define CLOUD_CODEC_H
+
+#include "utility.h"
+#include <cstring>
+#include <zlib.h>
+
+// Compact encoding of the published clouds (cloud_msgs/CompressedCloud).
+// x, y, z are quantized to a multiple of the resolution and stored as the
+// difference to the previous point, zigzag varint coded; the intensity is kept
+// exactly, its 4 bytes split in planes. The payload is then deflated by zlib at
+// its fastest level.
+// Scan clouds keep their order, ring by ring, successive points being close.
+// Map clouds, whose order carries no meaning, are sorted along a Morton curve of
+// the quantized grid: the depth first order of an octree.
+// Points with a non finite coordinate are flagged in a bitmap and decoded as
+// NaN, so that organized clouds keep their layout. A cloud whose width and
+// height do not match its size is stored as size x 1, as pcl::toROSMsg does.
+//
+//   "LCC1", uint32 width, uint32 height, float32 resolution, uint8 order,
+//   3 bytes reserved, uint32 payload size, zlib stream of the payload:
+//   validity bitmap, varints of the valid points, intensity byte planes
+class CloudCodec {
+ public:
+  enum Order { ORDERED = 0, OCTREE = 1 };
+
+  // Reuses its buffers from one call to the next: one instance per thread
+  bool encode(const pcl::PointCloud<PointType> &cloud, float resolution,
+              Order order, std::vector<uint8_t> &out) {
+    const size_t count = cloud.points.size();
+    if (resolution <= 0) return false;
+
+    _indices.resize(count);
+    for (size_t i = 0; i < count; i++) _indices[i] = i;
+    if (order == OCTREE) sortMorton(cloud, resolution);
+
+    _payload.clear();
+    _payload.resize((count + 7) / 8, 0);
+    int32_t previous[3] = {0, 0, 0};
+    for (size_t i = 0; i < count; i++) {
+      const PointType &point = cloud.points[_indices[i]];
+      if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+          !std::isfinite(point.z)) {
+        continue;
+      }
+      _payload[i / 8] |= uint8_t(1 << (i % 8));
+      const float coordinates[3] = {point.x, point.y, point.z};
+      for (int c = 0; c < 3; c++) {
+        const int32_t q = quantize(coordinates[c], resolution);
+        putVarint(zigzag(q - previous[c]));
+        previous[c] = q;
+      }
+    }
+    const size_t planes = _payload.size();
+    _payload.resize(planes + 4 * count);
+    for (size_t i = 0; i < count; i++) {
+      uint32_t bits;
+      std::memcpy(&bits, &cloud.points[_indices[i]].intensity, sizeof(bits));
+      for (int b = 0; b < 4; b++) {
+        _payload[planes + b * count + i] = uint8_t(bits >> (8 * b));
+      }
+    }
+
+    uLongf compressedSize = compressBound(_payload.size());
+    out.resize(headerSize + compressedSize);
+    const bool organized = size_t(cloud.width) * cloud.height == count;
+    uint8_t *header = out.data();
+    std::memcpy(header, "LCC1", 4);
+    putU32(header + 4, organized ? cloud.width : count);
+    putU32(header + 8, organized ? cloud.height : 1);
+    std::memcpy(header + 12, &resolution, sizeof(resolution));
+    header[16] = uint8_t(order);
+    header[17] = header[18] = header[19] = 0;
+    putU32(header + 20, _payload.size());
+    if (compress2(out.data() + headerSize, &compressedSize, _payload.data(),
+                  _payload.size(), Z_BEST_SPEED) != Z_OK) {
+      return false;
+    }
+    out.resize(headerSize + compressedSize);
+    return true;
+  }
+
+  // Decodes data, the output of the last encode() of this instance, and checks
+  // it against the cloud that was encoded: same points in the encoded order,
+  // within half the resolution, and same intensities
+  bool roundTrip(const pcl::PointCloud<PointType> &cloud, float resolution,
+                 const std::vector<uint8_t> &data) {
+    if (!decode(data.data(), data.size(), _check) ||
+        _check.points.size() != cloud.points.size() ||
+        _indices.size() != cloud.points.size()) {
+      return false;
+    }
+    const float tolerance = 0.51f * resolution;
+    for (size_t i = 0; i < _check.points.size(); i++) {
+      const PointType &expected = cloud.points[_indices[i]];
+      const PointType &decoded = _check.points[i];
+      if (!std::isfinite(expected.x) || !std::isfinite(expected.y) ||
+          !std::isfinite(expected.z)) {
+        if (std::isfinite(decoded.x)) return false;
+        continue;
+      }
+      if (std::abs(decoded.x - expected.x) > tolerance ||
+          std::abs(decoded.y - expected.y) > tolerance ||
+          std::abs(decoded.z - expected.z) > tolerance ||
+          std::memcmp(&decoded.intensity, &expected.intensity,
+                      sizeof(float)) != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool decode(const uint8_t *data, size_t size,
+              pcl::PointCloud<PointType> &cloud) {
+    if (size < headerSize || std::memcmp(data, "LCC1", 4) != 0) return false;
+    const uint32_t width = getU32(data + 4);
+    const uint32_t height = getU32(data + 8);
+    float resolution;
+    std::memcpy(&resolution, data + 12, sizeof(resolution));
+    uLongf payloadSize = getU32(data + 20);
+    const size_t count = size_t(width) * height;
+    if (payloadSize < (count + 7) / 8 + 4 * count) return false;
+
+    _payload.resize(payloadSize);
+    if (uncompress(_payload.data(), &payloadSize, data + headerSize,
+                   size - headerSize) != Z_OK ||
+        payloadSize != _payload.size()) {
+      return false;
+    }
+
+    cloud.points.resize(count);
+    cloud.width = width;
+    cloud.height = height;
+    cloud.is_dense = true;
+
+    const uint8_t *in = _payload.data() + (count + 7) / 8;
+    const uint8_t *planes = _payload.data() + payloadSize - 4 * count;
+    int32_t previous[3] = {0, 0, 0};
+    for (size_t i = 0; i < count; i++) {
+      PointType &point = cloud.points[i];
+      if (_payload[i / 8] & (1 << (i % 8))) {
+        float coordinates[3];
+        for (int c = 0; c < 3; c++) {
+          uint32_t value;
+          if (!getVarint(in, planes, value)) return false;
+          previous[c] += unzigzag(value);
+          coordinates[c] = previous[c] * resolution;
+        }
+        point.x = coordinates[0];
+        point.y = coordinates[1];
+        point.z = coordinates[2];
+      } else {
+        point.x = point.y = point.z = std::numeric_limits<float>::quiet_NaN();
+        cloud.is_dense = false;
+      }
+      uint32_t bits = 0;
+      for (int b = 0; b < 4; b++) {
+        bits |= uint32_t(planes[b * count + i]) << (8 * b);
+      }
+      std::memcpy(&point.intensity, &bits, sizeof(bits));
+    }
+    return in == planes;
+  }
+
+ private:
+  static const size_t headerSize = 24;
+  static const int mortonBits = 21;  // per axis, 63 bits codes
+
+  static int32_t quantize(float value, float resolution) {
+    // bounded so that the differences of two values fit in 32 bits
+    const float limit = float(1 << 29);
+    return int32_t(
+        std::max(-limit, std::min(limit, std::round(value / resolution))));
+  }
+
+  static uint32_t zigzag(int32_t value) {
+    return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+  }
+
+  static int32_t unzigzag(uint32_t value) {
+    return int32_t(value >> 1) ^ -int32_t(value & 1);
+  }
+
+  static void putU32(uint8_t *out, uint32_t value) {
+    std::memcpy(out, &value, sizeof(value));
+  }
+
+  static uint32_t getU32(const uint8_t *in) {
+    uint32_t value;
+    std::memcpy(&value, in, sizeof(value));
+    return value;
+  }
+
+  void putVarint(uint32_t value) {
+    while (value >= 0x80) {
+      _payload.push_back(uint8_t(value) | 0x80);
+      value >>= 7;
+    }
+    _payload.push_back(uint8_t(value));
+  }
+
+  static bool getVarint(const uint8_t *&in, const uint8_t *end,
+                        uint32_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 35 && in < end; shift += 7) {
+      const uint8_t byte = *in++;
+      value |= uint32_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return true;
+    }
+    return false;
+  }
+
+  static uint64_t spreadBits(uint32_t value) {
+    uint64_t x = value & 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffULL;
+    x = (x | x << 16) & 0x1f0000ff0000ffULL;
+    x = (x | x << 8) & 0x100f00f00f00f00fULL;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+    x = (x | x << 2) & 0x1249249249249249ULL;
+    return x;
+  }
+
+  void sortMorton(const pcl::PointCloud<PointType> &cloud, float resolution) {
+    int32_t minimum[3] = {std::numeric_limits<int32_t>::max(),
+                          std::numeric_limits<int32_t>::max(),
+                          std::numeric_limits<int32_t>::max()};
+    for (const PointType &point : cloud.points) {
+      if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+          !std::isfinite(point.z)) {
+        continue;
+      }
+      minimum[0] = std::min(minimum[0], quantize(point.x, resolution));
+      minimum[1] = std::min(minimum[1], quantize(point.y, resolution));
+      minimum[2] = std::min(minimum[2], quantize(point.z, resolution));
+    }
+
+    // beyond 2^21 cells per axis the order is coarser, never wrong
+    const uint32_t cellMax = (1u << mortonBits) - 1;
+    _codes.resize(cloud.points.size());
+    for (size_t i = 0; i < cloud.points.size(); i++) {
+      const PointType &point = cloud.points[i];
+      if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+          !std::isfinite(point.z)) {
+        _codes[i] = 0;
+        continue;
+      }
+      const uint32_t cx = std::min<int64_t>(
+          cellMax, int64_t(quantize(point.x, resolution)) - minimum[0]);
+      const uint32_t cy = std::min<int64_t>(
+          cellMax, int64_t(quantize(point.y, resolution)) - minimum[1]);
+      const uint32_t cz = std::min<int64_t>(
+          cellMax, int64_t(quantize(point.z, resolution)) - minimum[2]);
+      _codes[i] = spreadBits(cx) | spreadBits(cy) << 1 | spreadBits(cz) << 2;
+    }
+    std::sort(_indices.begin(), _indices.end(),
+              [&](uint32_t a, uint32_t b) { return _codes[a] < _codes[b]; });
+  }
+
+  std::vector<uint32_t> _indices;
+  std::vector<uint64_t> _codes;
+  std::vector<uint8_t> _payload;
+  pcl::PointCloud<PointType> _check;  // roundTrip() only
+};
+
+#endif  // CLOUD_CODEC_H
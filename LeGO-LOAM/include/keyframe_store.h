@@ -0,0 +1,312 @@
+#ifndef KEYFRAME_STORE_H
+#define KEYFRAME_STORE_H
+
+#include "utility.h"
+#include <atomic>
+#include <list>
+#include <memory>
+#include <cstdio>
+#include <cerrno>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Append-only sequence for one writer and any number of readers.
+// Elements live in fixed size segments that are never moved nor freed before
+// the container itself, so their addresses are stable, and the number of
+// elements is published atomically after each append: a reader may access the
+// first size() elements without locking.
+template <typename T, size_t SegmentBits = 8, size_t MaxSegments = 4096>
+class SegmentedVector {
+ public:
+  static const size_t SegmentSize = size_t(1) << SegmentBits;
+
+  SegmentedVector() : _size(0) {
+    for (size_t i = 0; i < MaxSegments; i++) {
+      _segments[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  ~SegmentedVector() {
+    const size_t count = _size.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) element(i).~T();
+    for (size_t i = 0; i < MaxSegments; i++) {
+      ::operator delete(_segments[i].load(std::memory_order_relaxed));
+    }
+  }
+
+  SegmentedVector(const SegmentedVector &) = delete;
+  SegmentedVector &operator=(const SegmentedVector &) = delete;
+
+  size_t size() const { return _size.load(std::memory_order_acquire); }
+  bool empty() const { return size() == 0; }
+
+  const T &operator[](size_t i) const { return element(i); }
+  T &operator[](size_t i) { return element(i); }
+  const T &back() const { return element(size() - 1); }
+
+  // Single writer only
+  template <typename... Args>
+  void emplace_back(Args &&... args) {
+    const size_t index = _size.load(std::memory_order_relaxed);
+    const size_t segment = index >> SegmentBits;
+    if (segment >= MaxSegments) throw std::length_error("SegmentedVector full");
+
+    T *data = _segments[segment].load(std::memory_order_relaxed);
+    if (!data) {
+      data = static_cast<T *>(::operator new(SegmentSize * sizeof(T)));
+      _segments[segment].store(data, std::memory_order_release);
+    }
+    new (data + (index & (SegmentSize - 1))) T(std::forward<Args>(args)...);
+    _size.store(index + 1, std::memory_order_release);
+  }
+
+ private:
+  T &element(size_t i) const {
+    T *data = _segments[i >> SegmentBits].load(std::memory_order_acquire);
+    return data[i & (SegmentSize - 1)];
+  }
+
+  std::atomic<T *> _segments[MaxSegments];
+  std::atomic<size_t> _size;
+};
+
+class KeyFrame;
+
+// The spilledFrameCacheSize spilled key frames read back last, all their
+// clouds, so that loop closure and the map rebuilds that go over the same old
+// key frames again read each file once. Any thread.
+class SpilledFrameCache {
+ public:
+  typedef pcl::PointCloud<PointType>::Ptr CloudPtr;
+  enum { CLOUD_COUNT = 3 };
+
+  struct Entry {
+    const KeyFrame *frame;
+    CloudPtr clouds[CLOUD_COUNT];
+  };
+
+  bool find(const KeyFrame *frame, int which, CloudPtr &cloud) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+      if (it->frame != frame) continue;
+      cloud = it->clouds[which];
+      // most recently used first
+      _entries.splice(_entries.begin(), _entries, it);
+      return true;
+    }
+    return false;
+  }
+
+  void insert(const Entry &entry) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // another thread may have loaded the same key frame meanwhile
+    _entries.remove_if([&](const Entry &e) { return e.frame == entry.frame; });
+    _entries.push_front(entry);
+    while (_entries.size() > spilledFrameCacheSize) _entries.pop_back();
+  }
+
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    size_t bytes = 0;
+    for (const Entry &entry : _entries) {
+      for (int i = 0; i < CLOUD_COUNT; i++) {
+        bytes += entry.clouds[i]->points.capacity() * sizeof(PointType);
+      }
+    }
+    return bytes;
+  }
+
+ private:
+  mutable std::mutex _mutex;
+  std::list<Entry> _entries;
+};
+
+// Key frame clouds, in the key frame coordinates. They are never modified once
+// the key frame is stored, the poses are found in the trajectory snapshots.
+// Under memory pressure the mapping thread may spill a key frame: its clouds
+// are written to a file and released, then read back through the
+// SpilledFrameCache of the store.
+class KeyFrame {
+ public:
+  typedef pcl::PointCloud<PointType>::Ptr CloudPtr;
+
+  KeyFrame(const CloudPtr &cornerCloud, const CloudPtr &surfCloud,
+           const CloudPtr &outlierCloud, SpilledFrameCache &cache)
+      : _cache(cache), _spilled(false) {
+    _clouds[CORNER] = cornerCloud;
+    _clouds[SURF] = surfCloud;
+    _clouds[OUTLIER] = outlierCloud;
+  }
+
+  // Any thread
+  CloudPtr corner() const { return cloud(CORNER); }
+  CloudPtr surf() const { return cloud(SURF); }
+  CloudPtr outlier() const { return cloud(OUTLIER); }
+
+  // Mapping thread only
+  bool spilled() const { return _spilled; }
+
+  size_t bytes() const {
+    size_t sum = 0;
+    for (int i = 0; i < CLOUD_COUNT; i++) {
+      if (_clouds[i]) sum += _clouds[i]->points.capacity() * sizeof(PointType);
+    }
+    return sum;
+  }
+
+  // Mapping thread only: the readers that already hold the clouds keep them
+  bool spill(const std::string &path) {
+    std::ofstream out(path.c_str(), std::ios::binary);
+    for (int i = 0; i < CLOUD_COUNT; i++) {
+      const uint32_t count = _clouds[i]->points.size();
+      out.write(reinterpret_cast<const char *>(&count), sizeof(count));
+      out.write(reinterpret_cast<const char *>(_clouds[i]->points.data()),
+                count * sizeof(PointType));
+    }
+    if (!out.good()) return false;
+    out.close();
+
+    // the path is published along with the null clouds
+    _spill_path = path;
+    for (int i = 0; i < CLOUD_COUNT; i++) {
+      atomic_store(&_clouds[i], CloudPtr());
+    }
+    _spilled = true;
+    return true;
+  }
+
+  const std::string &spillPath() const { return _spill_path; }
+
+ private:
+  enum { CORNER = 0, SURF, OUTLIER, CLOUD_COUNT };
+
+  CloudPtr cloud(int which) const {
+    CloudPtr resident = atomic_load(&_clouds[which]);
+    if (resident) return resident;
+    CloudPtr cached;
+    if (_cache.find(this, which, cached)) return cached;
+
+    // all the clouds in a single read, the others are likely needed next
+    SpilledFrameCache::Entry entry;
+    entry.frame = this;
+    load(entry.clouds);
+    _cache.insert(entry);
+    return entry.clouds[which];
+  }
+
+  void load(CloudPtr (&clouds)[CLOUD_COUNT]) const {
+    std::ifstream in(_spill_path.c_str(), std::ios::binary);
+    for (int i = 0; i < CLOUD_COUNT; i++) {
+      clouds[i].reset(new pcl::PointCloud<PointType>());
+      uint32_t count = 0;
+      if (!in.read(reinterpret_cast<char *>(&count), sizeof(count))) continue;
+      clouds[i]->points.resize(count);
+      in.read(reinterpret_cast<char *>(clouds[i]->points.data()),
+              count * sizeof(PointType));
+      clouds[i]->width = count;
+      clouds[i]->height = 1;
+    }
+    if (!in.good()) {
+      ROS_ERROR("Unable to read the spilled key frame [%s]", _spill_path.c_str());
+      for (int i = 0; i < CLOUD_COUNT; i++) clouds[i]->clear();
+    }
+  }
+
+  CloudPtr _clouds[CLOUD_COUNT];  // std::atomic_load / atomic_store only
+  SpilledFrameCache &_cache;
+  std::string _spill_path;
+  bool _spilled;
+};
+
+// Immutable view of the trajectory, replaced as a whole by the mapping thread
+// each time a key frame is added or the poses are corrected (read-copy-update).
+// Readers load the current snapshot with std::atomic_load and keep using it for
+// as long as they need, every key frame it lists is in the KeyFrameStore.
+struct TrajectorySnapshot {
+  pcl::PointCloud<PointType>::Ptr poses3D;  // intensity: key frame index
+  pcl::PointCloud<PointTypePose>::Ptr poses6D;
+  uint64_t version;     // incremented at each publication
+  uint64_t correction;  // incremented when the poses of the key frames change
+
+  size_t size() const { return poses3D->points.size(); }
+};
+
+typedef std::shared_ptr<const TrajectorySnapshot> TrajectorySnapshotPtr;
+
+// Key frame clouds shared between the mapping thread (the only writer) and the
+// global map / loop closure threads, which read them without locking.
+class KeyFrameStore {
+ public:
+  KeyFrameStore() : _bytes(0), _spilled(0) {}
+
+  ~KeyFrameStore() {
+    for (size_t i = 0; i < _frames.size(); i++) {
+      if (_frames[i].spilled()) std::remove(_frames[i].spillPath().c_str());
+    }
+  }
+
+  size_t size() const { return _frames.size(); }
+  bool empty() const { return _frames.empty(); }
+  const KeyFrame &operator[](size_t i) const { return _frames[i]; }
+
+  // Mapping thread only
+  void append(const pcl::PointCloud<PointType>::Ptr &corner,
+              const pcl::PointCloud<PointType>::Ptr &surf,
+              const pcl::PointCloud<PointType>::Ptr &outlier) {
+    _frames.emplace_back(corner, surf, outlier, _cache);
+    _bytes += _frames.back().bytes();
+  }
+
+  // Mapping thread only: bytes of the clouds in memory, resident or read back
+  size_t bytes() const { return _bytes + _cache.bytes(); }
+  size_t spilledCount() const { return _spilled; }
+
+  // Mapping thread only: moves the clouds of key frame i to a file of directory
+  bool spill(size_t i, const std::string &directory) {
+    KeyFrame &frame = _frames[i];
+    if (frame.spilled()) return true;
+
+    std::ostringstream path;
+    path << directory << "/lego_loam_" << getpid() << "_keyframe_" << i << ".bin";
+    const size_t bytes = frame.bytes();
+    if (!frame.spill(path.str())) {
+      ROS_ERROR("Unable to spill key frame %lu to [%s]", i, path.str().c_str());
+      return false;
+    }
+    _bytes -= bytes;
+    _spilled++;
+    return true;
+  }
+
+  // Removes the spill files that a process no longer running left in
+  // directory, the files are only removed by the destructor of their store.
+  // Returns the number of files removed.
+  static size_t removeStaleSpills(const std::string &directory) {
+    DIR *dir = opendir(directory.c_str());
+    if (!dir) return 0;
+    size_t removed = 0;
+    while (const dirent *entry = readdir(dir)) {
+      int pid = 0;
+      size_t index = 0;
+      char suffix[8] = "";
+      if (sscanf(entry->d_name, "lego_loam_%d_keyframe_%lu.%7s", &pid, &index,
+                 suffix) != 3 ||
+          std::string(suffix) != "bin") {
+        continue;
+      }
+      if (pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH) continue;
+      if (std::remove((directory + "/" + entry->d_name).c_str()) == 0) removed++;
+    }
+    closedir(dir);
+    return removed;
+  }
+
+ private:
+  SpilledFrameCache _cache;  // before _frames, which refer to it
+  SegmentedVector<KeyFrame> _frames;
+  size_t _bytes;
+  size_t _spilled;
+};
+
+#endif  // KEYFRAME_STORE_H
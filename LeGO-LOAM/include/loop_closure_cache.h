@@ -0,0 +1,69 @@
+#ifndef LOOP_CLOSURE_CACHE_H
+#define LOOP_CLOSURE_CACHE_H
+
+#include "memory_accounting.h"
+#include <list>
+#include <memory>
+
+// Registration target of a loop closure candidate: the history key frames
+// around a center key frame, in the map frame, merged and downsampled, with
+// the kd-tree ICP searches it with. Built for the poses of one correction of
+// the trajectory (TrajectorySnapshot::correction), from key frames first to
+// last; it must not be modified afterwards.
+struct LoopClosureTarget {
+  int center;
+  uint64_t correction;
+  int first, last;
+  pcl::PointCloud<PointType>::Ptr cloud;
+  pcl::search::KdTree<PointType>::Ptr kdtree;
+};
+
+typedef std::shared_ptr<const LoopClosureTarget> LoopClosureTargetPtr;
+
+// The loopClosureCacheSize targets used last, so that a candidate tried again
+// costs the registration only. A pose correction makes all of them stale.
+// Loop closure thread only.
+class LoopClosureCache {
+ public:
+  // The target of this center for the current poses and key frames, or null
+  LoopClosureTargetPtr find(int center, uint64_t correction, int first,
+                            int last) {
+    for (auto it = _targets.begin(); it != _targets.end();) {
+      const LoopClosureTarget &target = **it;
+      if (target.correction != correction) {
+        it = _targets.erase(it);
+      } else if (target.center == center && target.first == first &&
+                 target.last == last) {
+        // most recently used first
+        _targets.splice(_targets.begin(), _targets, it);
+        return _targets.front();
+      } else {
+        ++it;
+      }
+    }
+    return LoopClosureTargetPtr();
+  }
+
+  void insert(const LoopClosureTargetPtr &target) {
+    // a window that grew replaces the one of the same center
+    _targets.remove_if([&](const LoopClosureTargetPtr &cached) {
+      return cached->center == target->center;
+    });
+    _targets.push_front(target);
+    while (_targets.size() > loopClosureCacheSize) _targets.pop_back();
+  }
+
+  void clear() { _targets.clear(); }
+
+  // the kd-tree indices are not counted
+  size_t bytes() const {
+    size_t bytes = 0;
+    for (const auto &target : _targets) bytes += cloudBytes(target->cloud);
+    return bytes;
+  }
+
+ private:
+  std::list<LoopClosureTargetPtr> _targets;
+};
+
+#endif  // LOOP_CLOSURE_CACHE_H
@@ -0,0 +1,94 @@
+#ifndef MAP_SNAPSHOT_H
+#define MAP_SNAPSHOT_H
+
+#include "memory_accounting.h"
+#include "nanoflann_pcl.h"
+#include <memory>
+
+// Immutable view of the map around the vehicle: the downsampled global map
+// cloud (map frame, globalMapVisualizationSearchRadius around the latest key
+// frame) with its kd-tree. The global map thread replaces it as a whole
+// (read-copy-update), readers load it with std::atomic_load and may query it
+// from any number of threads at once.
+// Queries append to the result cloud, closest points first, and stop after
+// maxPoints points (0 for no limit).
+class MapSnapshot {
+ public:
+  typedef pcl::PointCloud<PointType> Cloud;
+
+  // The cloud must not be modified afterwards
+  MapSnapshot(const Cloud::Ptr &cloud, double time)
+      : _cloud(cloud), _time(time) {
+    _kdtree.setInputCloud(_cloud);
+    _bytes = cloudBytes(*_cloud) + _kdtree.usedMemory();
+  }
+
+  double time() const { return _time; }
+  size_t size() const { return _cloud->points.size(); }
+  size_t bytes() const { return _bytes; }
+
+  size_t radiusSearch(const PointType &center, float radius, size_t maxPoints,
+                      Cloud &result) const {
+    std::vector<std::pair<int, float>> found;
+    _kdtree.radiusSearch(center, radius, found);
+    return append(found, maxPoints, result);
+  }
+
+  size_t boxSearch(const PointType &min, const PointType &max,
+                   size_t maxPoints, Cloud &result) const {
+    // the sphere around the box, then the points outside are dropped
+    PointType center;
+    center.x = 0.5f * (min.x + max.x);
+    center.y = 0.5f * (min.y + max.y);
+    center.z = 0.5f * (min.z + max.z);
+    const float dx = max.x - center.x, dy = max.y - center.y,
+                dz = max.z - center.z;
+    std::vector<std::pair<int, float>> found;
+    _kdtree.radiusSearch(center, std::sqrt(dx * dx + dy * dy + dz * dz), found);
+    found.erase(std::remove_if(found.begin(), found.end(),
+                               [&](const std::pair<int, float> &candidate) {
+                                 const PointType &p =
+                                     _cloud->points[candidate.first];
+                                 return p.x < min.x || p.x > max.x ||
+                                        p.y < min.y || p.y > max.y ||
+                                        p.z < min.z || p.z > max.z;
+                               }),
+                found.end());
+    return append(found, maxPoints, result);
+  }
+
+  size_t nearestKSearch(const PointType &point, size_t k, Cloud &result) const {
+    // the search sizes its results for k
+    k = std::min(k, size());
+    if (k == 0) return 0;
+    std::vector<int> indices;
+    std::vector<float> sqrDistances;
+    const int found =
+        _kdtree.nearestKSearch(point, int(k), indices, sqrDistances);
+    for (int i = 0; i < found; i++) {
+      result.push_back(_cloud->points[indices[i]]);
+    }
+    return found;
+  }
+
+ private:
+  size_t append(const std::vector<std::pair<int, float>> &found,
+                size_t maxPoints, Cloud &result) const {
+    const size_t count =
+        (maxPoints > 0) ? std::min(maxPoints, found.size()) : found.size();
+    result.points.reserve(result.points.size() + count);
+    for (size_t i = 0; i < count; i++) {
+      result.push_back(_cloud->points[found[i].first]);
+    }
+    return count;
+  }
+
+  const Cloud::Ptr _cloud;
+  nanoflann::KdTreeFLANN<PointType> _kdtree;
+  const double _time;
+  size_t _bytes;
+};
+
+typedef std::shared_ptr<const MapSnapshot> MapSnapshotPtr;
+
+#endif  // MAP_SNAPSHOT_H
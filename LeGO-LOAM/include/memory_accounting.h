@@ -0,0 +1,170 @@
+#ifndef MEMORY_ACCOUNTING_H
+#define MEMORY_ACCOUNTING_H
+
+#include "utility.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+// Bytes held by each subsystem, with their high-water marks, next to the
+// resident set size of the process so that the unaccounted part (allocator,
+// libraries, PCL internals) shows up as well.
+// Owners update their gauges from their own thread, the mapping thread calls
+// update() once per scan to refresh the resident size and the ceiling state,
+// and to log the report every memoryReportPeriod seconds.
+class MemoryAccounting {
+ public:
+  enum Owner {
+    KEY_FRAMES = 0,
+    LOCAL_MAP,
+    KD_TREES,
+    ISAM,
+    CHANNELS,
+    SCRATCH,
+    GLOBAL_MAP,
+    OWNER_COUNT
+  };
+
+  MemoryAccounting()
+      : _ceiling(0),
+        _resident(0),
+        _resident_high_water(0),
+        _over_ceiling(false),
+        _last_report(std::chrono::steady_clock::now()) {
+    for (int i = 0; i < OWNER_COUNT; i++) {
+      _bytes[i].store(0);
+      _high_water[i].store(0);
+    }
+  }
+
+  // Resident memory above which the owners release what they can, 0 for none
+  void configure(size_t ceiling) { _ceiling = ceiling; }
+  size_t ceiling() const { return _ceiling; }
+
+  void add(Owner owner, int64_t delta) {
+    const int64_t bytes = _bytes[owner].fetch_add(delta) + delta;
+    raise(_high_water[owner], bytes);
+  }
+
+  int64_t bytes(Owner owner) const { return _bytes[owner].load(); }
+  int64_t highWater(Owner owner) const { return _high_water[owner].load(); }
+
+  int64_t total() const {
+    int64_t sum = 0;
+    for (int i = 0; i < OWNER_COUNT; i++) sum += _bytes[i].load();
+    return sum;
+  }
+
+  bool overCeiling() const { return _over_ceiling.load(); }
+
+  // Mapping thread, once per scan
+  void update() {
+    const int64_t resident = residentBytes();
+    _resident.store(resident);
+    raise(_resident_high_water, resident);
+
+    const bool over = _ceiling > 0 && resident > int64_t(_ceiling);
+    if (over && !_over_ceiling.load()) {
+      ROS_WARN("Resident memory %.1f MB above the %.1f MB ceiling",
+               resident / 1048576.0, _ceiling / 1048576.0);
+    }
+    _over_ceiling.store(over);
+
+    const auto now = std::chrono::steady_clock::now();
+    if (now - _last_report > std::chrono::duration<double>(memoryReportPeriod)) {
+      _last_report = now;
+      report();
+    }
+  }
+
+  void report() const {
+    std::ostringstream out;
+    out.precision(1);
+    out << std::fixed << "Memory (MB, current / high-water):";
+    for (int i = 0; i < OWNER_COUNT; i++) {
+      out << " " << ownerName(i) << " " << _bytes[i].load() / 1048576.0 << " / "
+          << _high_water[i].load() / 1048576.0 << ",";
+    }
+    const int64_t resident = _resident.load();
+    out << " resident " << resident / 1048576.0 << " / "
+        << _resident_high_water.load() / 1048576.0 << ", unaccounted "
+        << (resident - total()) / 1048576.0;
+    ROS_INFO("%s", out.str().c_str());
+  }
+
+  static const char *ownerName(int owner) {
+    static const char *names[OWNER_COUNT] = {
+        "key frames", "local map", "kd-trees", "iSAM2",
+        "channels",   "scratch",   "global map"};
+    return names[owner];
+  }
+
+  static int64_t residentBytes() {
+    std::ifstream statm("/proc/self/statm");
+    int64_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+  }
+
+ private:
+  static void raise(std::atomic<int64_t> &highWater, int64_t value) {
+    int64_t current = highWater.load();
+    while (value > current && !highWater.compare_exchange_weak(current, value)) {
+    }
+  }
+
+  std::atomic<int64_t> _bytes[OWNER_COUNT];
+  std::atomic<int64_t> _high_water[OWNER_COUNT];
+  size_t _ceiling;
+  std::atomic<int64_t> _resident;
+  std::atomic<int64_t> _resident_high_water;
+  std::atomic<bool> _over_ceiling;
+  std::chrono::steady_clock::time_point _last_report;
+};
+
+// Share of one owner held by one stage: set() accounts for the difference with
+// the previous value, so that several stages can report to the same owner.
+class MemoryGauge {
+ public:
+  MemoryGauge(MemoryAccounting &accounting, MemoryAccounting::Owner owner)
+      : _accounting(accounting), _owner(owner), _bytes(0) {}
+
+  ~MemoryGauge() { set(0); }
+
+  void set(size_t bytes) {
+    _accounting.add(_owner, int64_t(bytes) - int64_t(_bytes));
+    _bytes = bytes;
+  }
+
+ private:
+  MemoryAccounting &_accounting;
+  const MemoryAccounting::Owner _owner;
+  size_t _bytes;
+};
+
+// Heap storage of a cloud, allocated capacity included
+template <typename PointT>
+inline size_t cloudBytes(const pcl::PointCloud<PointT> &cloud) {
+  return cloud.points.capacity() * sizeof(PointT);
+}
+
+template <typename PointT>
+inline size_t cloudBytes(const boost::shared_ptr<pcl::PointCloud<PointT>> &cloud) {
+  return cloud ? cloudBytes(*cloud) : 0;
+}
+
+template <typename T>
+inline size_t vectorBytes(const std::vector<T> &vector) {
+  return vector.capacity() * sizeof(T);
+}
+
+inline size_t cloudInfoBytes(const cloud_msgs::cloud_info &info) {
+  return vectorBytes(info.startRingIndex) + vectorBytes(info.endRingIndex) +
+         vectorBytes(info.segmentedCloudGroundFlag) +
+         vectorBytes(info.segmentedCloudColInd) +
+         vectorBytes(info.segmentedCloudRange);
+}
+
+#endif  // MEMORY_ACCOUNTING_H
@@ -54,8 +54,11 @@
 #include <cstdio>  // for fwrite()
 #include <cstdlib> // for abs()
 #include <functional>
+#include <future>
 #include <limits> // std::reference_wrapper
+#include <memory>
 #include <stdexcept>
+#include <system_error>
 #include <vector>
 
 /** Library version: 0xMmP (M=Major,m=minor,P=patch) */
@@ -554,14 +557,19 @@ struct KDTreeSingleIndexAdaptorParams {
 struct SearchParams {
   /** Note: The first argument (checks_IGNORED_) is ignored, but kept for
    * compatibility with the FLANN interface */
-  SearchParams(int checks_IGNORED_ = 32, float eps_ = 0, bool sorted_ = true)
-      : checks(checks_IGNORED_), eps(eps_), sorted(sorted_) {}
+  SearchParams(int checks_IGNORED_ = 32, float eps_ = 0, bool sorted_ = true,
+               size_t max_leaves_ = 0)
+      : checks(checks_IGNORED_), eps(eps_), sorted(sorted_),
+        max_leaves(max_leaves_) {}
 
   int checks;  //!< Ignored parameter (Kept for compatibility with the FLANN
       //!< interface).
   float eps;   //!< search for eps-approximate neighbours (default: 0)
   bool sorted; //!< only for radius search, require neighbours sorted by
       //!< distance (default: true)
+  size_t max_leaves; //!< KDTreeSingleIndexAdaptor only: the search stops
+      //!< after checking this many leaves, the first being the leaf of the
+      //!< query (default: 0, no limit)
 };
 /** @} */
 
@@ -608,6 +616,10 @@ class PooledAllocator {
   size_t remaining; /* Number of bytes left in current block of storage. */
   void *base;       /* Pointer to base of current block of storage. */
   void *loc;        /* Current location in block to next allocate memory. */
+  void *spare;      /* Chain of BLOCKSIZE blocks kept by recycle(). */
+
+  /* Each block starts with the pointer to the previous block and its size. */
+  static const size_t HEADERSIZE = 2 * sizeof(void *);
 
   void internal_init() {
     remaining = 0;
@@ -623,12 +635,19 @@ class PooledAllocator {
   /**
       Default constructor. Initializes a new pool.
    */
-  PooledAllocator() { internal_init(); }
+  PooledAllocator() : spare(NULL) { internal_init(); }
 
   /**
    * Destructor. Frees all the memory allocated in this pool.
    */
-  ~PooledAllocator() { free_all(); }
+  ~PooledAllocator() {
+    free_all();
+    while (spare != NULL) {
+      void *next = *(static_cast<void **>(spare));
+      ::free(spare);
+      spare = next;
+    }
+  }
 
   /** Frees all allocated memory chunks */
   void free_all() {
@@ -641,6 +660,24 @@ class PooledAllocator {
     internal_init();
   }
 
+  /** Makes all the memory of the pool available again. The blocks of the
+      standard size are kept for the next allocations instead of being
+      returned to the system, so that rebuilding an index of a similar size
+      does not allocate. */
+  void recycle() {
+    while (base != NULL) {
+      void *prev = *(static_cast<void **>(base));
+      if (static_cast<size_t *>(base)[1] == BLOCKSIZE) {
+        *(static_cast<void **>(base)) = spare;
+        spare = base;
+      } else {
+        ::free(base);
+      }
+      base = prev;
+    }
+    internal_init();
+  }
+
   /**
    * Returns a pointer to a piece of new memory of the given size in bytes
    * allocated from the pool.
@@ -652,8 +689,9 @@ class PooledAllocator {
      */
     const size_t size = (req_size + (WORDSIZE - 1)) & ~(WORDSIZE - 1);
 
-    /* Check whether a new block must be allocated.  Note that the first word
-        of a block is reserved for a pointer to the previous block.
+    /* Check whether a new block must be allocated.  Note that the first two
+        words of a block are reserved for a pointer to the previous block and
+        the size of the block.
      */
     if (size > remaining) {
 
@@ -661,27 +699,35 @@ class PooledAllocator {
 
       /* Allocate new storage. */
       const size_t blocksize =
-          (size + sizeof(void *) + (WORDSIZE - 1) > BLOCKSIZE)
-              ? size + sizeof(void *) + (WORDSIZE - 1)
+          (size + HEADERSIZE + (WORDSIZE - 1) > BLOCKSIZE)
+              ? size + HEADERSIZE + (WORDSIZE - 1)
               : BLOCKSIZE;
 
-      // use the standard C malloc to allocate memory
-      void *m = ::malloc(blocksize);
-      if (!m) {
-        fprintf(stderr, "Failed to allocate memory.\n");
-        return NULL;
+      void *m;
+      if (blocksize == BLOCKSIZE && spare != NULL) {
+        /* Reuse a block kept by recycle(). */
+        m = spare;
+        spare = *(static_cast<void **>(spare));
+      } else {
+        // use the standard C malloc to allocate memory
+        m = ::malloc(blocksize);
+        if (!m) {
+          fprintf(stderr, "Failed to allocate memory.\n");
+          return NULL;
+        }
       }
 
-      /* Fill first word of new block with pointer to previous block. */
+      /* Fill the header of the new block. */
       static_cast<void **>(m)[0] = base;
+      static_cast<size_t *>(m)[1] = blocksize;
       base = m;
 
       size_t shift = 0;
       // int size_t = (WORDSIZE - ( (((size_t)m) + sizeof(void*)) &
       // (WORDSIZE-1))) & (WORDSIZE-1);
 
-      remaining = blocksize - sizeof(void *) - shift;
-      loc = (static_cast<char *>(m) + sizeof(void *) + shift);
+      remaining = blocksize - HEADERSIZE - shift;
+      loc = (static_cast<char *>(m) + HEADERSIZE + shift);
     }
     void *rloc = loc;
     loc = static_cast<char *>(loc) + size;
@@ -742,7 +788,9 @@ class KDTreeBaseClass {
   /** Frees the previously-built index. Automatically called within
    * buildIndex(). */
   void freeIndex(Derived &obj) {
-    obj.pool.free_all();
+    obj.pool.recycle();
+    for (size_t i = 0; i < obj.task_pools.size(); ++i)
+      obj.task_pools[i]->recycle();
     obj.root_node = NULL;
     obj.m_size_at_index_build = 0;
   }
@@ -809,6 +857,10 @@ class KDTreeBaseClass {
    */
   PooledAllocator pool;
 
+  /** Pools of the subtrees built by concurrent tasks, see divideTreeParallel()
+   */
+  std::vector<std::unique_ptr<PooledAllocator>> task_pools;
+
   /** Returns number of points in dataset  */
   size_t size(const Derived &obj) const { return obj.m_size; }
 
@@ -828,9 +880,11 @@ class KDTreeBaseClass {
    * Returns: memory used by the index
    */
   size_t usedMemory(Derived &obj) {
-    return obj.pool.usedMemory + obj.pool.wastedMemory +
-           obj.dataset.kdtree_get_point_count() *
-               sizeof(IndexType); // pool memory and vind array memory
+    size_t memory = obj.pool.usedMemory + obj.pool.wastedMemory;
+    for (size_t i = 0; i < obj.task_pools.size(); ++i)
+      memory += obj.task_pools[i]->usedMemory + obj.task_pools[i]->wastedMemory;
+    return memory + obj.dataset.kdtree_get_point_count() *
+                        sizeof(IndexType); // pool memory and vind array memory
   }
 
   void computeMinMax(const Derived &obj, IndexType *ind, IndexType count,
@@ -856,7 +910,13 @@ class KDTreeBaseClass {
    */
   NodePtr divideTree(Derived &obj, const IndexType left, const IndexType right,
                      BoundingBox &bbox) {
-    NodePtr node = obj.pool.template allocate<Node>(); // allocate memory
+    return divideTree(obj, obj.pool, left, right, bbox);
+  }
+
+  /** Same as above, the nodes being allocated from \a pool */
+  NodePtr divideTree(Derived &obj, PooledAllocator &pool, const IndexType left,
+                     const IndexType right, BoundingBox &bbox) {
+    NodePtr node = pool.template allocate<Node>(); // allocate memory
 
     /* If too few exemplars remain, then make this a leaf node. */
     if ((right - left) <= static_cast<IndexType>(obj.m_leaf_max_size)) {
@@ -888,11 +948,11 @@ class KDTreeBaseClass {
 
       BoundingBox left_bbox(bbox);
       left_bbox[cutfeat].high = cutval;
-      node->child1 = divideTree(obj, left, left + idx, left_bbox);
+      node->child1 = divideTree(obj, pool, left, left + idx, left_bbox);
 
       BoundingBox right_bbox(bbox);
       right_bbox[cutfeat].low = cutval;
-      node->child2 = divideTree(obj, left + idx, right, right_bbox);
+      node->child2 = divideTree(obj, pool, left + idx, right, right_bbox);
 
       node->node_type.sub.divlow = left_bbox[cutfeat].high;
       node->node_type.sub.divhigh = right_bbox[cutfeat].low;
@@ -906,6 +966,63 @@ class KDTreeBaseClass {
     return node;
   }
 
+  /**
+   * Builds the same tree as divideTree(), the two subtrees of each node of the
+   * first \a levels levels being built concurrently. The splits only permute
+   * disjoint ranges of vind and read the dataset. Each task allocates its nodes
+   * from its own pool: the task of pool \a slot (0 for obj.pool, i for
+   * task_pools[i - 1]) hands the first subtree of a node to pool
+   * slot + 2^(levels - 1), which needs 2^levels pools in all.
+   */
+  NodePtr divideTreeParallel(Derived &obj, const IndexType left,
+                             const IndexType right, BoundingBox &bbox,
+                             const int levels, const size_t slot) {
+    PooledAllocator &pool = slot == 0 ? obj.pool : *obj.task_pools[slot - 1];
+    if (levels == 0 ||
+        (right - left) <= static_cast<IndexType>(obj.m_leaf_max_size))
+      return divideTree(obj, pool, left, right, bbox);
+
+    NodePtr node = pool.template allocate<Node>();
+    IndexType idx;
+    int cutfeat;
+    DistanceType cutval;
+    middleSplit_(obj, &obj.vind[0] + left, right - left, idx, cutfeat, cutval,
+                 bbox);
+
+    node->node_type.sub.divfeat = cutfeat;
+
+    BoundingBox left_bbox(bbox);
+    left_bbox[cutfeat].high = cutval;
+    BoundingBox right_bbox(bbox);
+    right_bbox[cutfeat].low = cutval;
+
+    const size_t left_slot = slot + (size_t(1) << (levels - 1));
+    std::future<NodePtr> left_task;
+    try {
+      left_task = std::async(std::launch::async, [&]() {
+        return divideTreeParallel(obj, left, left + idx, left_bbox, levels - 1,
+                                  left_slot);
+      });
+    } catch (const std::system_error &) {
+      // no thread available: this task builds both subtrees
+    }
+    node->child2 = divideTreeParallel(obj, left + idx, right, right_bbox,
+                                      levels - 1, slot);
+    node->child1 = left_task.valid()
+                       ? left_task.get()
+                       : divideTreeParallel(obj, left, left + idx, left_bbox,
+                                            levels - 1, left_slot);
+
+    node->node_type.sub.divlow = left_bbox[cutfeat].high;
+    node->node_type.sub.divhigh = right_bbox[cutfeat].low;
+
+    for (int i = 0; i < (DIM > 0 ? DIM : obj.dim); ++i) {
+      bbox[i].low = std::min(left_bbox[i].low, right_bbox[i].low);
+      bbox[i].high = std::max(left_bbox[i].high, right_bbox[i].high);
+    }
+    return node;
+  }
+
   void middleSplit_(Derived &obj, IndexType *ind, IndexType count,
                     IndexType &index, int &cutfeat, DistanceType &cutval,
                     const BoundingBox &bbox) {
@@ -1201,6 +1318,32 @@ class KDTreeSingleIndexAdaptor
                          BaseClassRef::root_bbox); // construct the tree
   }
 
+  /**
+   * Builds the same index with up to \a tasks concurrent tasks (rounded down
+   * to a power of two), each building subtrees of the top levels. Worth it for
+   * large datasets only, a task being a thread.
+   */
+  void buildIndex(const size_t tasks) {
+    int levels = 0;
+    while ((size_t(2) << levels) <= tasks)
+      ++levels;
+    if (levels == 0) {
+      buildIndex();
+      return;
+    }
+    BaseClassRef::m_size = dataset.kdtree_get_point_count();
+    init_vind();
+    this->freeIndex(*this);
+    BaseClassRef::m_size_at_index_build = BaseClassRef::m_size;
+    if (BaseClassRef::m_size == 0)
+      return;
+    while (BaseClassRef::task_pools.size() < (size_t(1) << levels) - 1)
+      BaseClassRef::task_pools.emplace_back(new PooledAllocator());
+    computeBoundingBox(BaseClassRef::root_bbox);
+    BaseClassRef::root_node = this->divideTreeParallel(
+        *this, 0, BaseClassRef::m_size, BaseClassRef::root_bbox, levels, 0);
+  }
+
   /** \name Query methods
    * @{ */
 
@@ -1234,9 +1377,11 @@ class KDTreeSingleIndexAdaptor
     assign(dists, (DIM > 0 ? DIM : BaseClassRef::dim),
            zero); // Fill it with zeros.
     DistanceType distsq = this->computeInitialDistances(*this, vec, dists);
-    searchLevel(result, vec, BaseClassRef::root_node, distsq, dists,
-                epsError); // "count_leaf" parameter removed since was neither
-        // used nor returned to the user.
+    size_t leaves = searchParams.max_leaves > 0
+                        ? searchParams.max_leaves
+                        : std::numeric_limits<size_t>::max();
+    searchLevel(result, vec, BaseClassRef::root_node, distsq, dists, epsError,
+                leaves);
     return result.full();
   }
 
@@ -1345,11 +1490,14 @@ class KDTreeSingleIndexAdaptor
   template <class RESULTSET>
   bool searchLevel(RESULTSET &result_set, const ElementType *vec,
                    const NodePtr node, DistanceType mindistsq,
-                   distance_vector_t &dists, const float epsError) const {
+                   distance_vector_t &dists, const float epsError,
+                   size_t &leaves) const {
     /* If this is a leaf node, then do check and return. */
     if ((node->child1 == NULL) && (node->child2 == NULL)) {
-      // count_leaf += (node->lr.right-node->lr.left);  // Removed since was
-      // neither used nor returned to the user.
+      // the leaf budget is spent: keep the neighbours found so far
+      if (leaves == 0)
+        return false;
+      --leaves;
       DistanceType worst_dist = result_set.worstDist();
       for (IndexType i = node->node_type.lr.left; i < node->node_type.lr.right;
            ++i) {
@@ -1387,7 +1535,8 @@ class KDTreeSingleIndexAdaptor
     }
 
     /* Call recursively to search next level down. */
-    if (!searchLevel(result_set, vec, bestChild, mindistsq, dists, epsError)) {
+    if (!searchLevel(result_set, vec, bestChild, mindistsq, dists, epsError,
+                     leaves)) {
       // the resultset doesn't want to receive any more points, we're done
       // searching!
       return false;
@@ -1398,7 +1547,7 @@ class KDTreeSingleIndexAdaptor
     dists[idx] = cut_dist;
     if (mindistsq * epsError <= result_set.worstDist()) {
       if (!searchLevel(result_set, vec, otherChild, mindistsq, dists,
-                       epsError)) {
+                       epsError, leaves)) {
         // the resultset doesn't want to receive any more points, we're done
         // searching!
         return false;
@@ -74,6 +74,15 @@ class KdTreeFLANN
 
   void  setSortedResults (bool sorted);
 
+  // Approximate searches: the neighbours found are within (1 + eps) times the
+  // distance of the true ones (setEpsilon), and at most this many leaves of the
+  // tree are checked (0: no limit), which may miss some of them
+  void  setMaxLeafChecks (size_t leaves);
+
+  // setInputCloud() builds the tree with up to this many threads when the cloud
+  // has at least minPoints points, the tree being the same
+  void  setBuildTasks (int tasks, size_t minPoints);
+
   inline Ptr makeShared () { return Ptr (new KdTreeFLANN<PointT> (*this)); }
 
   void setInputCloud (const PointCloudPtr &cloud, const IndicesConstPtr &indices = IndicesConstPtr ());
@@ -84,10 +93,20 @@ class KdTreeFLANN
   int radiusSearch (const PointT &point, double radius, std::vector<int> &k_indices,
                    std::vector<float> &k_sqr_distances) const;
 
+  // Same search into a buffer of the caller: safe from several threads at once
+  int radiusSearch (const PointT &point, double radius,
+                   std::vector<std::pair<int, float>> &indices_dist) const;
+
+  // Bytes held by the index and the search buffers
+  size_t usedMemory ();
+
  private:
 
   nanoflann::SearchParams _params;
 
+  int _build_tasks;
+  size_t _build_min_points;
+
   struct PointCloud_Adaptor
   {
     inline size_t kdtree_get_point_count() const;
@@ -105,12 +124,17 @@ class KdTreeFLANN
 
   KDTreeFlann_PCL_SO3 _kdtree;
 
+  // radiusSearch() results, kept to reuse their storage (one thread per tree)
+  mutable std::vector<std::pair<int, float>> _indices_dist;
+
 };
 
 //---------- Definitions ---------------------
 
 template<typename PointT> inline
     KdTreeFLANN<PointT>::KdTreeFLANN(bool sorted):
+                                                    _build_tasks(1),
+                                                    _build_min_points(0),
                                                     _kdtree(3,_adaptor)
 {
   _params.sorted = sorted;
@@ -128,13 +152,31 @@ template<typename PointT> inline
   _params.sorted = sorted;
 }
 
+template<typename PointT> inline
+    void KdTreeFLANN<PointT>::setMaxLeafChecks(size_t leaves)
+{
+  _params.max_leaves = leaves;
+}
+
+template<typename PointT> inline
+    void KdTreeFLANN<PointT>::setBuildTasks(int tasks, size_t minPoints)
+{
+  _build_tasks = std::max(tasks, 1);
+  _build_min_points = minPoints;
+}
+
 template<typename PointT> inline
     void KdTreeFLANN<PointT>::setInputCloud(const KdTreeFLANN::PointCloudPtr &cloud,
                                        const IndicesConstPtr &indices)
 {
   _adaptor.pcl = cloud;
   _adaptor.indices = indices;
-  _kdtree.buildIndex();
+  if (_build_tasks > 1 &&
+      _adaptor.kdtree_get_point_count() >= _build_min_points) {
+    _kdtree.buildIndex(_build_tasks);
+  } else {
+    _kdtree.buildIndex();
+  }
 }
 
 template<typename PointT> inline
@@ -147,7 +189,7 @@ template<typename PointT> inline
 
   nanoflann::KNNResultSet<float,int> resultSet(num_closest);
   resultSet.init( k_indices.data(), k_sqr_distances.data());
-  _kdtree.findNeighbors(resultSet, point.data, nanoflann::SearchParams() );
+  _kdtree.findNeighbors(resultSet, point.data, _params);
   return resultSet.size();
 }
 
@@ -156,15 +198,8 @@ inline int KdTreeFLANN<PointT>::radiusSearch(
     const PointT &point, double radius, std::vector<int> &k_indices,
     std::vector<float> &k_sqr_distances) const
 {
-  std::vector<std::pair<int, float>> indices_dist;
-  indices_dist.reserve(128);
-  RadiusResultSet<float, int> resultSet(static_cast<float>(radius * radius),
-                                        indices_dist);
-  _kdtree.findNeighbors(resultSet, point.data, _params);
-  const size_t nFound = resultSet.size();
-  if (_params.sorted) {
-    std::sort(indices_dist.begin(), indices_dist.end(), IndexDist_Sorter());
-  }
+  std::vector<std::pair<int, float>> &indices_dist = _indices_dist;
+  const size_t nFound = radiusSearch(point, radius, indices_dist);
   k_indices.resize(nFound);
   k_sqr_distances.resize(nFound);
   for (int i = 0; i < nFound; i++) {
@@ -174,6 +209,28 @@ inline int KdTreeFLANN<PointT>::radiusSearch(
   return nFound;
 }
 
+template <typename PointT>
+inline int KdTreeFLANN<PointT>::radiusSearch(
+    const PointT &point, double radius,
+    std::vector<std::pair<int, float>> &indices_dist) const
+{
+  indices_dist.clear();
+  RadiusResultSet<float, int> resultSet(static_cast<float>(radius * radius),
+                                        indices_dist);
+  _kdtree.findNeighbors(resultSet, point.data, _params);
+  if (_params.sorted) {
+    std::sort(indices_dist.begin(), indices_dist.end(), IndexDist_Sorter());
+  }
+  return indices_dist.size();
+}
+
+template <typename PointT>
+inline size_t KdTreeFLANN<PointT>::usedMemory()
+{
+  return _kdtree.usedMemory(_kdtree) +
+         _indices_dist.capacity() * sizeof(std::pair<int, float>);
+}
+
 template<typename PointT> inline
     size_t KdTreeFLANN<PointT>::PointCloud_Adaptor::kdtree_get_point_count() const {
   if( indices ) return indices->size();
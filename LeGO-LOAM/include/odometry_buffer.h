@@ -0,0 +1,140 @@
+#ifndef ODOMETRY_BUFFER_H
+#define ODOMETRY_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+#include <Eigen/Geometry>
+#include <nav_msgs/Odometry.h>
+
+// Fixed size ring of timestamped poses coming from an external odometry source
+// (wheel encoders, visual odometry...).
+// One writer (the odometry callback) and any number of readers. Neither side
+// ever blocks: every slot is protected by a sequence counter, a reader retries
+// when the slot was overwritten while it was being copied.
+// Poses are assumed to be expressed for a body frame aligned with the lidar
+// frame (x forward, z up).
+class OdometryBuffer {
+ public:
+  struct Sample {
+    double time;
+    Eigen::Vector3d position;
+    Eigen::Quaterniond orientation;
+  };
+
+  OdometryBuffer() : _head(0) {
+    for (size_t i = 0; i < Size; i++) {
+      _slots[i].seq.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  bool empty() const { return _head.load(std::memory_order_acquire) == 0; }
+
+  void push(const nav_msgs::Odometry::ConstPtr &odometry) {
+    const geometry_msgs::Pose &pose = odometry->pose.pose;
+    push(odometry->header.stamp.toSec(),
+         Eigen::Vector3d(pose.position.x, pose.position.y, pose.position.z),
+         Eigen::Quaterniond(pose.orientation.w, pose.orientation.x,
+                            pose.orientation.y, pose.orientation.z));
+  }
+
+  // Single writer only
+  void push(double time, const Eigen::Vector3d &position,
+            const Eigen::Quaterniond &orientation) {
+    const uint64_t head = _head.load(std::memory_order_relaxed);
+    Slot &slot = _slots[head % Size];
+
+    const uint64_t seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);  // odd: being written
+    std::atomic_thread_fence(std::memory_order_release);
+
+    const Eigen::Quaterniond q = orientation.normalized();
+    const double values[Slot::Fields] = {time,  position.x(), position.y(),
+                                         position.z(), q.w(), q.x(), q.y(),
+                                         q.z()};
+    for (int i = 0; i < Slot::Fields; i++) {
+      slot.data[i].store(values[i], std::memory_order_relaxed);
+    }
+
+    slot.seq.store(seq + 2, std::memory_order_release);
+    _head.store(head + 1, std::memory_order_release);
+  }
+
+  // Pose at the given time, linearly interpolated (slerp for the rotation)
+  // between the two samples around it. Returns false when the time is not
+  // covered by the buffer.
+  bool interpolate(double time, Sample &out) const {
+    const uint64_t head = _head.load(std::memory_order_acquire);
+    if (head == 0) return false;
+
+    const uint64_t oldest = head > Size ? head - Size : 0;
+    Sample after;
+    if (!read(head - 1, after) || time > after.time) return false;
+
+    for (uint64_t i = head - 1; i > oldest; i--) {
+      Sample before;
+      if (!read(i - 1, before)) return false;
+      if (before.time <= time) {
+        const double dt = after.time - before.time;
+        const double ratio = dt > 0 ? (time - before.time) / dt : 0.0;
+        out.time = time;
+        out.position = before.position + ratio * (after.position - before.position);
+        out.orientation = before.orientation.slerp(ratio, after.orientation);
+        return true;
+      }
+      after = before;
+    }
+    return false;
+  }
+
+  // Motion of the body between the two times, expressed in the body frame at
+  // timeFrom.
+  bool relativeMotion(double timeFrom, double timeTo,
+                      Eigen::Vector3d &translation,
+                      Eigen::Quaterniond &rotation) const {
+    Sample from, to;
+    if (!interpolate(timeFrom, from) || !interpolate(timeTo, to)) return false;
+    const Eigen::Quaterniond inverse = from.orientation.conjugate();
+    translation = inverse * (to.position - from.position);
+    rotation = inverse * to.orientation;
+    return true;
+  }
+
+ private:
+  // 50 Hz odometry: 10 seconds of history
+  static const size_t Size = 512;
+
+  struct Slot {
+    static const int Fields = 8;
+    std::atomic<uint64_t> seq;
+    std::atomic<double> data[Fields];
+  };
+
+  // Copy of the n-th sample ever written. Fails if it was already overwritten.
+  bool read(uint64_t n, Sample &out) const {
+    const Slot &slot = _slots[n % Size];
+    double values[Slot::Fields];
+    for (int attempt = 0; attempt < 4; attempt++) {
+      if (_head.load(std::memory_order_acquire) > n + Size) return false;
+      const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      if (seq & 1) continue;
+      for (int i = 0; i < Slot::Fields; i++) {
+        values[i] = slot.data[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != seq) continue;
+      // the slot may have been recycled in between the head check and the copy
+      if (seq != 2 * (n / Size + 1)) return false;
+
+      out.time = values[0];
+      out.position = Eigen::Vector3d(values[1], values[2], values[3]);
+      out.orientation = Eigen::Quaterniond(values[4], values[5], values[6], values[7]);
+      return true;
+    }
+    return false;
+  }
+
+  Slot _slots[Size];
+  std::atomic<uint64_t> _head;
+};
+
+#endif  // ODOMETRY_BUFFER_H
@@ -0,0 +1,33 @@
+#ifndef PACKED_CLOUD_H
+#define PACKED_CLOUD_H
+
+#include "utility.h"
+#include <sensor_msgs/point_cloud2_iterator.h>
+
+// Clouds sent to other nodes as x, y, z, intensity float32 fields, 16 bytes per
+// point, rather than the padded 32 bytes PointType layout of pcl::toROSMsg
+inline void toPackedCloud(const pcl::PointCloud<PointType> &cloud,
+                          sensor_msgs::PointCloud2 &msg) {
+  sensor_msgs::PointCloud2Modifier modifier(msg);
+  modifier.setPointCloud2Fields(
+      4, "x", 1, sensor_msgs::PointField::FLOAT32, "y", 1,
+      sensor_msgs::PointField::FLOAT32, "z", 1, sensor_msgs::PointField::FLOAT32,
+      "intensity", 1, sensor_msgs::PointField::FLOAT32);
+  modifier.resize(cloud.points.size());
+  float *data = reinterpret_cast<float *>(msg.data.data());
+  for (const PointType &point : cloud.points) {
+    *data++ = point.x;
+    *data++ = point.y;
+    *data++ = point.z;
+    *data++ = point.intensity;
+  }
+  // organized clouds keep their rows
+  if (cloud.height > 1 && cloud.width * cloud.height == cloud.points.size()) {
+    msg.width = cloud.width;
+    msg.height = cloud.height;
+    msg.row_step = msg.width * msg.point_step;
+  }
+  msg.is_dense = cloud.is_dense;
+}
+
+#endif  // PACKED_CLOUD_H
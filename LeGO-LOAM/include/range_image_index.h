@@ -0,0 +1,137 @@
+#ifndef RANGE_IMAGE_INDEX_H
+#define RANGE_IMAGE_INDEX_H
+
+#include "utility.h"
+
+// Nearest neighbour search among the features of a sweep, through the range
+// image of the sensor instead of a kd-tree.
+// Points are binned by (ring, block of columns) and a query only probes the
+// cells around its own projection, so building the index is a counting sort
+// and a query costs a fixed number of cells whatever the cloud size.
+// The ring is the integer part of the intensity, as set by ImageProjection, and
+// the column is recomputed from the azimuth of the point in the camera frame.
+// Only the calls made by FeatureAssociation are mirrored from KdTreeFLANN.
+class RangeImageIndex {
+ public:
+  RangeImageIndex(size_t N_scan, size_t horizontal_scan, int row_window = 2,
+                  int cell_window = 2, size_t columns_per_cell = 8)
+      : _rows(N_scan),
+        _cells_per_row((horizontal_scan + columns_per_cell - 1) /
+                       columns_per_cell),
+        _row_window(row_window),
+        _cell_window(cell_window) {}
+
+  void setInputCloud(const pcl::PointCloud<PointType>::Ptr &cloud) {
+    _cloud = cloud;
+    const size_t cellNum = _rows * _cells_per_row;
+    _cell_start.assign(cellNum + 1, 0);
+    _point_cell.resize(cloud->points.size());
+
+    for (size_t i = 0; i < cloud->points.size(); ++i) {
+      _point_cell[i] = cellIndex(cloud->points[i]);
+      if (_point_cell[i] >= 0) _cell_start[_point_cell[i] + 1]++;
+    }
+    for (size_t c = 0; c < cellNum; ++c) {
+      _cell_start[c + 1] += _cell_start[c];
+    }
+
+    _cell_points.resize(_cell_start[cellNum]);
+    _fill.assign(_cell_start.begin(), _cell_start.end() - 1);
+    for (size_t i = 0; i < _point_cell.size(); ++i) {
+      if (_point_cell[i] >= 0) _cell_points[_fill[_point_cell[i]]++] = i;
+    }
+  }
+
+  size_t usedMemory() const {
+    return (_cell_start.capacity() + _fill.capacity()) * sizeof(size_t) +
+           (_point_cell.capacity() + _cell_points.capacity()) * sizeof(int);
+  }
+
+  // Returns the number of neighbours found in the probed cells, sorted by
+  // distance, which can be less than k (or zero).
+  int nearestKSearch(const PointType &point, int k, std::vector<int> &k_indices,
+                     std::vector<float> &k_sqr_distances) const {
+    k_indices.clear();
+    k_sqr_distances.clear();
+    if (!_cloud) return 0;
+
+    const int row = int(point.intensity);
+    const int cell = cellOf(point);
+
+    for (int r = std::max(0, row - _row_window);
+         r <= std::min(int(_rows) - 1, row + _row_window); ++r) {
+      for (int dc = -_cell_window; dc <= _cell_window; ++dc) {
+        int c = (cell + dc) % _cells_per_row;
+        if (c < 0) c += _cells_per_row;
+        const size_t index = r * _cells_per_row + c;
+
+        for (size_t n = _cell_start[index]; n < _cell_start[index + 1]; ++n) {
+          const PointType &p = _cloud->points[_cell_points[n]];
+          const float dx = p.x - point.x;
+          const float dy = p.y - point.y;
+          const float dz = p.z - point.z;
+          insert(_cell_points[n], dx * dx + dy * dy + dz * dz, k, k_indices,
+                 k_sqr_distances);
+        }
+      }
+    }
+    return k_indices.size();
+  }
+
+ private:
+  int cellOf(const PointType &p) const {
+    // camera frame: the lidar x axis is z, the lidar y axis is x
+    const float azimuth = std::atan2(p.x, p.z) + M_PI;
+    int cell = int(azimuth / (2 * M_PI) * _cells_per_row);
+    return std::min(cell, _cells_per_row - 1);
+  }
+
+  int cellIndex(const PointType &p) const {
+    const int row = int(p.intensity);
+    if (row < 0 || row >= int(_rows)) return -1;
+    return row * _cells_per_row + cellOf(p);
+  }
+
+  static void insert(int index, float sqDis, int k, std::vector<int> &indices,
+                     std::vector<float> &sqDistances) {
+    if (int(indices.size()) == k && sqDis >= sqDistances.back()) return;
+    size_t pos = sqDistances.size();
+    while (pos > 0 && sqDistances[pos - 1] > sqDis) pos--;
+    indices.insert(indices.begin() + pos, index);
+    sqDistances.insert(sqDistances.begin() + pos, sqDis);
+    if (int(indices.size()) > k) {
+      indices.pop_back();
+      sqDistances.pop_back();
+    }
+  }
+
+  const size_t _rows;
+  const int _cells_per_row;
+  const int _row_window;
+  const int _cell_window;
+
+  pcl::PointCloud<PointType>::Ptr _cloud;
+  std::vector<size_t> _cell_start;  // prefix sums, one entry per cell + 1
+  std::vector<size_t> _fill;
+  std::vector<int> _point_cell;
+  std::vector<int> _cell_points;
+};
+
+// Side by side run of the kd-tree and the range image association
+struct AssociationBenchmark {
+  size_t queries;
+  size_t agreements;  // same nearest point, or same distance
+  size_t misses;      // found by the kd-tree only
+  double kdtreeBuildTime, kdtreeQueryTime;
+  double gridBuildTime, gridQueryTime;
+
+  AssociationBenchmark() { reset(); }
+
+  void reset() {
+    queries = agreements = misses = 0;
+    kdtreeBuildTime = kdtreeQueryTime = 0;
+    gridBuildTime = gridQueryTime = 0;
+  }
+};
+
+#endif  // RANGE_IMAGE_INDEX_H
@@ -0,0 +1,74 @@
+#ifndef ROBUST_KERNEL_H
+#define ROBUST_KERNEL_H
+
+#include <cmath>
+#include <cstddef>
+
+enum class RobustKernelType {
+  LOAM,          // original linear down-weighting: sqrt(w) = 1 - |r| / c
+  Huber,         // w = 1 if |r| <= c, c / |r| otherwise
+  Cauchy,        // w = 1 / (1 + (r / c)^2)
+  GemanMcClure   // w = 1 / (1 + (r / c)^2)^2
+};
+
+// Iteratively reweighted least squares weighting of point-to-line and
+// point-to-plane residuals.
+// The Jacobian row and the residual of a correspondence are both scaled by
+// sqrt(w), correspondences whose weight falls below minWeight are rejected and
+// never reach the normal equations.
+class RobustKernel {
+ public:
+  RobustKernel(RobustKernelType type, float scale, float minWeight = 0.01)
+      : _type(type), _scale(scale), _minWeight(minWeight) {
+    resetStats();
+  }
+
+  // Returns false if the correspondence must be rejected, otherwise the
+  // factor to apply to its row of the linear system.
+  bool rowScale(float residual, float &scale) {
+    const float w = weight(residual);
+    _evaluated++;
+    if (w < _minWeight) {
+      _rejected++;
+      return false;
+    }
+    scale = std::sqrt(w);
+    return true;
+  }
+
+  float weight(float residual) const {
+    const float r = std::fabs(residual) / _scale;
+    switch (_type) {
+      case RobustKernelType::LOAM: {
+        const float s = 1 - r;
+        return s > 0 ? s * s : 0;
+      }
+      case RobustKernelType::Huber:
+        return r <= 1 ? 1 : 1 / r;
+      case RobustKernelType::Cauchy:
+        return 1 / (1 + r * r);
+      case RobustKernelType::GemanMcClure:
+        return 1 / ((1 + r * r) * (1 + r * r));
+    }
+    return 1;
+  }
+
+  size_t evaluated() const { return _evaluated; }
+  size_t rejected() const { return _rejected; }
+  float rejectedRatio() const {
+    return _evaluated ? float(_rejected) / _evaluated : 0;
+  }
+  void resetStats() {
+    _evaluated = 0;
+    _rejected = 0;
+  }
+
+ private:
+  RobustKernelType _type;
+  float _scale;
+  float _minWeight;
+  size_t _evaluated;
+  size_t _rejected;
+};
+
+#endif  // ROBUST_KERNEL_H
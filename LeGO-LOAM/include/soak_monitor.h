@@ -0,0 +1,212 @@
+#ifndef SOAK_MONITOR_H
+#define SOAK_MONITOR_H
+
+#include "memory_accounting.h"
+#include <algorithm>
+
+// Long-duration run in compressed time: the input is replayed at full speed
+// until the requested simulated duration elapsed. Every sample period of
+// simulated time, the latency percentiles of each stage, the resident size and
+// the bytes of each memory owner are logged. At the end, the growth per
+// simulated hour is fitted by least squares and checked against the bounds.
+// The first sample, which includes the map build-up, is left out of the fit.
+class SoakMonitor {
+ public:
+  enum Stage {
+    PROJECTION = 0,
+    ODOMETRY,
+    MAPPING,
+    GLOBAL_MAP,
+    LOOP_CLOSURE,
+    STAGE_COUNT
+  };
+
+  explicit SoakMonitor(const MemoryAccounting &memory)
+      : _memory(memory),
+        _hours(0),
+        _period(3600),
+        _max_latency_growth(0),
+        _max_memory_growth(0),
+        _start(-1),
+        _period_end(0) {}
+
+  // hours of simulated time, sample period in simulated seconds, bounds in
+  // ms per hour (95th percentile of every stage) and MB per hour (resident
+  // size), 0 leaves a bound unchecked
+  void configure(double hours, double samplePeriod, double maxLatencyGrowth,
+                 double maxMemoryGrowth) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _hours = hours;
+    _period = samplePeriod;
+    _max_latency_growth = maxLatencyGrowth;
+    _max_memory_growth = maxMemoryGrowth;
+  }
+
+  bool enabled() const { return _hours > 0; }
+
+  // Called by the input loop with the stamp of every scan, returns false once
+  // the soak duration elapsed
+  bool advance(double time) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_start < 0) {
+      _start = time;
+      _period_end = time + _period;
+    }
+    while (time >= _period_end) {
+      sample((_period_end - _start) / 3600);
+      _period_end += _period;
+    }
+    return time - _start < _hours * 3600;
+  }
+
+  // Called once per processed scan by each stage
+  void record(Stage stage, double latency) {
+    if (!enabled()) return;
+    std::lock_guard<std::mutex> lock(_mutex);
+    _latencies[stage].push_back(latency);
+  }
+
+  // Logs the growth of every stage and owner, false if a bound is exceeded
+  // or if there are too few samples to fit a slope
+  bool evaluate() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_samples.size() < 3) {
+      ROS_ERROR("Soak: %lu samples, at least 3 are needed to measure the "
+                "growth (soak_hours / soak_sample_period)",
+                _samples.size());
+      return false;
+    }
+
+    bool passed = true;
+    for (int s = 0; s < STAGE_COUNT; s++) {
+      double slope = 0;
+      if (!fit([&](const Sample &sample) { return sample.p95[s] * 1000; },
+               [&](const Sample &sample) { return sample.scans[s] > 0; },
+               slope)) {
+        continue;
+      }
+      const bool exceeded =
+          _max_latency_growth > 0 && slope > _max_latency_growth;
+      ROS_INFO("Soak: %s latency p95 growth %+.2f ms/h%s", stageName(s), slope,
+               exceeded ? ", ABOVE BOUND" : "");
+      passed = passed && !exceeded;
+    }
+
+    std::ostringstream owners;
+    owners.precision(2);
+    owners << std::fixed << "Soak: memory growth (MB/h):";
+    for (int o = 0; o < MemoryAccounting::OWNER_COUNT; o++) {
+      double slope = 0;
+      fit([&](const Sample &sample) { return sample.owners[o]; },
+          [](const Sample &) { return true; }, slope);
+      owners << " " << MemoryAccounting::ownerName(o) << " " << slope << ",";
+    }
+    double slope = 0;
+    fit([](const Sample &sample) { return sample.resident; },
+        [](const Sample &) { return true; }, slope);
+    const bool exceeded = _max_memory_growth > 0 && slope > _max_memory_growth;
+    owners << " resident " << slope << (exceeded ? ", ABOVE BOUND" : "");
+    ROS_INFO("%s", owners.str().c_str());
+    passed = passed && !exceeded;
+
+    if (passed) {
+      ROS_INFO("Soak passed: %.1f simulated hours", _samples.back().hour);
+    } else {
+      ROS_ERROR("Soak failed: growth above the bounds (%.2f ms/h, %.1f MB/h)",
+                _max_latency_growth, _max_memory_growth);
+    }
+    return passed;
+  }
+
+ private:
+  struct Sample {
+    double hour;  // simulated hours since the first scan
+    double p50[STAGE_COUNT];
+    double p95[STAGE_COUNT];
+    double p99[STAGE_COUNT];
+    double max[STAGE_COUNT];
+    size_t scans[STAGE_COUNT];
+    double resident;                                // MB
+    double owners[MemoryAccounting::OWNER_COUNT];  // MB
+  };
+
+  static const char *stageName(int stage) {
+    static const char *names[STAGE_COUNT] = {
+        "projection", "odometry", "mapping", "global map", "loop closure"};
+    return names[stage];
+  }
+
+  static double percentile(const std::vector<double> &sorted, double q) {
+    return sorted[std::min(sorted.size() - 1, size_t(q * sorted.size()))];
+  }
+
+  void sample(double hour) {
+    Sample sample;
+    sample.hour = hour;
+
+    std::ostringstream out;
+    out.precision(1);
+    out << std::fixed << "Soak " << hour
+        << " h (ms, p50 / p95 / p99 / max):";
+    for (int s = 0; s < STAGE_COUNT; s++) {
+      std::vector<double> &latencies = _latencies[s];
+      sample.scans[s] = latencies.size();
+      sample.p50[s] = sample.p95[s] = sample.p99[s] = sample.max[s] = 0;
+      if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        sample.p50[s] = percentile(latencies, 0.50);
+        sample.p95[s] = percentile(latencies, 0.95);
+        sample.p99[s] = percentile(latencies, 0.99);
+        sample.max[s] = latencies.back();
+      }
+      latencies.clear();
+      out << " " << stageName(s) << " " << sample.p50[s] * 1000 << " / "
+          << sample.p95[s] * 1000 << " / " << sample.p99[s] * 1000 << " / "
+          << sample.max[s] * 1000 << ",";
+    }
+
+    sample.resident = MemoryAccounting::residentBytes() / 1048576.0;
+    for (int o = 0; o < MemoryAccounting::OWNER_COUNT; o++) {
+      sample.owners[o] =
+          _memory.bytes(MemoryAccounting::Owner(o)) / 1048576.0;
+    }
+    out << " resident " << sample.resident << " MB";
+    ROS_INFO("%s", out.str().c_str());
+
+    _samples.push_back(sample);
+  }
+
+  // Least squares slope of value(sample) per hour, first sample left out
+  template <typename Value, typename Valid>
+  bool fit(Value value, Valid valid, double &slope) const {
+    double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (size_t i = 1; i < _samples.size(); i++) {
+      if (!valid(_samples[i])) continue;
+      const double x = _samples[i].hour;
+      const double y = value(_samples[i]);
+      n += 1;
+      sx += x;
+      sy += y;
+      sxx += x * x;
+      sxy += x * y;
+    }
+    const double det = n * sxx - sx * sx;
+    if (n < 2 || det <= 0) return false;
+    slope = (n * sxy - sx * sy) / det;
+    return true;
+  }
+
+  const MemoryAccounting &_memory;
+  double _hours;
+  double _period;
+  double _max_latency_growth;
+  double _max_memory_growth;
+
+  mutable std::mutex _mutex;
+  double _start;
+  double _period_end;
+  std::vector<double> _latencies[STAGE_COUNT];
+  std::vector<Sample> _samples;
+};
+
+#endif  // SOAK_MONITOR_H
@@ -0,0 +1,137 @@
+#ifndef STATIONARY_DETECTOR_H
+#define STATIONARY_DETECTOR_H
+
+#include "utility.h"
+
+// Zero motion detection, from the variance of the IMU over the last
+// stationaryImuWindow seconds and optionally from the difference between the
+// range image of the scan and the one of the first scan of the stop.
+// The vehicle is declared stationary after stationaryEnterScans quiet scans and
+// moving again at the first scan that is not quiet.
+class StationaryDetector {
+ public:
+  StationaryDetector(size_t N_scan, size_t horizontal_scan)
+      : _N_scan(N_scan),
+        _horizontal_scan(horizontal_scan),
+        _enabled(false),
+        _range_check(false),
+        _quiet_scans(0),
+        _stationary(false),
+        _has_reference(false) {}
+
+  void configure(bool enabled, bool range_check) {
+    _enabled = enabled;
+    _range_check = range_check;
+    if (_range_check) {
+      _reference.assign(_N_scan * _horizontal_scan, 0);
+      _current.assign(_N_scan * _horizontal_scan, 0);
+    }
+  }
+
+  bool enabled() const { return _enabled; }
+  bool stationary() const { return _stationary; }
+
+  void addImu(const ImuSample &imu) {
+    if (!_enabled) return;
+    _imu.push_back(imu);
+    while (_imu.front().time < imu.time - stationaryImuWindow) {
+      _imu.pop_front();
+    }
+  }
+
+  // Called once per scan, returns true while the vehicle is stationary
+  bool update(double time, const pcl::PointCloud<PointType> &segmented,
+              const cloud_msgs::cloud_info &info) {
+    if (!_enabled) return false;
+
+    bool quiet = true;
+    bool evidence = false;
+
+    // IMU samples covering the window up to the scan
+    if (_imu.size() > 10 && _imu.back().time >= time - 0.1) {
+      evidence = true;
+      quiet = imuQuiet();
+    }
+
+    if (_range_check) {
+      fillRangeImage(segmented, info);
+      if (_has_reference) {
+        evidence = true;
+        quiet = quiet && rangeImageUnchanged();
+      }
+    }
+
+    if (!evidence || !quiet) {
+      _quiet_scans = 0;
+      if (_stationary) ROS_INFO("Vehicle moving, odometry and mapping resumed");
+      _stationary = false;
+    } else if (!_stationary && ++_quiet_scans >= stationaryEnterScans) {
+      _stationary = true;
+      ROS_INFO("Vehicle stationary, odometry and mapping paused");
+    }
+
+    // while stopped, compare against the first scan of the stop so that slow
+    // motion adds up
+    if (_range_check && (!_stationary || !_has_reference)) {
+      _reference.swap(_current);
+      _has_reference = true;
+    }
+    return _stationary;
+  }
+
+ private:
+  bool imuQuiet() const {
+    Eigen::Array3f accSum = Eigen::Array3f::Zero(), accSqSum = accSum;
+    Eigen::Array3f gyroSum = accSum, gyroSqSum = accSum;
+    for (const ImuSample &imu : _imu) {
+      accSum += imu.acc.array();
+      accSqSum += imu.acc.array().square();
+      gyroSum += imu.gyro.array();
+      gyroSqSum += imu.gyro.array().square();
+    }
+    const float n = _imu.size();
+    const Eigen::Array3f accVar = accSqSum / n - (accSum / n).square();
+    const Eigen::Array3f gyroVar = gyroSqSum / n - (gyroSum / n).square();
+    return accVar.maxCoeff() < stationaryAccStdDev * stationaryAccStdDev &&
+           gyroVar.maxCoeff() < stationaryGyroStdDev * stationaryGyroStdDev;
+  }
+
+  void fillRangeImage(const pcl::PointCloud<PointType> &segmented,
+                      const cloud_msgs::cloud_info &info) {
+    std::fill(_current.begin(), _current.end(), 0);
+    for (size_t i = 0; i < segmented.points.size(); ++i) {
+      const size_t row = segmented.points[i].intensity;
+      if (row >= _N_scan) continue;
+      _current[row * _horizontal_scan + info.segmentedCloudColInd[i]] =
+          info.segmentedCloudRange[i];
+    }
+  }
+
+  bool rangeImageUnchanged() const {
+    size_t common = 0, changed = 0;
+    for (size_t i = 0; i < _current.size(); ++i) {
+      if (_current[i] == 0 || _reference[i] == 0) continue;
+      common++;
+      if (std::fabs(_current[i] - _reference[i]) > stationaryRangeTolerance) {
+        changed++;
+      }
+    }
+    return common > 100 && changed < stationaryChangedPixelRatio * common;
+  }
+
+  const size_t _N_scan;
+  const size_t _horizontal_scan;
+  bool _enabled;
+  bool _range_check;
+
+  int _quiet_scans;
+  bool _stationary;
+
+  std::deque<ImuSample> _imu;
+
+  bool _has_reference;
+  std::vector<float> _reference;
+  std::vector<float> _current;
+};
+
+#endif  // STATIONARY_DETECTOR_H
@@ -9,6 +9,7 @@
 #include <nav_msgs/Odometry.h>
 
 #include "cloud_msgs/cloud_info.h"
+#include "robust_kernel.h"
 
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
@@ -23,6 +24,8 @@
 
 #include <tf/transform_broadcaster.h>
 #include <tf/transform_datatypes.h>
+
+#include <gtsam/navigation/PreintegrationParams.h>
  
 #include <vector>
 #include <cmath>
@@ -67,7 +70,8 @@ static const int groundScanInd = 7;
 // static const float ang_bottom = 30.67;
 // static const int groundScanInd = 20;
 
-// Ouster users may need to uncomment line 159 in imageProjection.cpp
+// Organized clouds (height == N_SCAN, width == HORIZONTAL_SCAN), as published by
+// the Ouster driver, are decoded by direct indexing, column stagger included
 // Usage of Ouster imu data is not supported yet, please just publish point cloud data
 // Ouster OS1-16
 // static const int N_SCAN = 16;
@@ -86,12 +90,72 @@ static const int groundScanInd = 7;
 // static const int groundScanInd = 15;
 static const float scanPeriod = 0.1;
 
+// The organized layout is measured by a vote of the valid points of a row, a
+// row is calibrated when this share of them agree, else on a later cloud.
+// Rows not calibrated yet are projected from the azimuth of their points.
+static const float organizedLayoutAgreement = 0.8;
+static const int organizedLayoutMinPoints = 50;     // valid points of a row
+static const size_t organizedLayoutAttempts = 20;   // clouds tried in a row
+static const size_t organizedLayoutRetryScans = 100;  // then one in this many
+
 static const bool loopClosureEnableFlag = false;
 static const size_t mappingFrequencyDivider = 5;
 
 static const int systemDelay = 0;
 static const int imuQueLength = 200;
 
+// IMU preintegration: ImuFactors between key frames and IMU-propagated initial guesses
+static const bool imuPreintegrationEnableFlag = false;
+static const double imuGravity = 9.80511;
+static const double imuAccNoise = 3.9939570888238808e-03;   // accelerometer white noise (m/s^2/sqrt(Hz))
+static const double imuGyrNoise = 1.5636343949698187e-03;   // gyroscope white noise (rad/s/sqrt(Hz))
+static const double imuAccBiasNoise = 6.4356659353532566e-05;  // accelerometer bias random walk
+static const double imuGyrBiasNoise = 3.5640318696367613e-05;  // gyroscope bias random walk
+static const double imuMaxGap = 0.05;  // s, longer steps (dropouts, ring overrun) are not integrated
+
+// Preintegration noise model of the IMU above, z up. The IMU frame is assumed
+// aligned with the lidar frame used by the graph (x forward, z up)
+inline boost::shared_ptr<gtsam::PreintegrationParams> MakeImuPreintegrationParams() {
+  auto params = gtsam::PreintegrationParams::MakeSharedU(imuGravity);
+  params->accelerometerCovariance = gtsam::Matrix33::Identity() * pow(imuAccNoise, 2);
+  params->gyroscopeCovariance = gtsam::Matrix33::Identity() * pow(imuGyrNoise, 2);
+  params->integrationCovariance = gtsam::Matrix33::Identity() * pow(1e-4, 2);
+  return params;
+}
+static const float aggressiveRotationRate = 1.0;  // rad/s, scans above this rate are reported separately
+
+// External (wheel) odometry, used only when an odometry topic is configured
+static const double externalOdometryRotationNoise = 0.05;    // rad, between two key frames
+static const double externalOdometryTranslationNoise = 0.2;  // m, between two key frames
+
+// Stationary vehicle detection (~stationary_detection): odometry and mapping are
+// held while the IMU is quiet and, with ~stationary_range_check, the range image
+// stays the same
+static const double stationaryImuWindow = 1.0;       // s
+static const float stationaryGyroStdDev = 0.01;      // rad/s
+static const float stationaryAccStdDev = 0.05;       // m/s^2
+static const float stationaryRangeTolerance = 0.05;  // m, per pixel
+static const float stationaryChangedPixelRatio = 0.02;
+static const int stationaryEnterScans = 5;  // quiet scans before holding the pose
+
+// Heap allocation tracking (built with -DALLOCATION_TRACKING=ON): the per scan
+// path of each stage is expected to allocate nothing once warmed up, outside
+// the listed third party calls. ImageProjection and FeatureAssociation abort
+// at the first report otherwise
+static const size_t allocationWarmupScans = 50;
+static const size_t allocationReportScans = 500;
+
+// Memory accounting: bytes held by each subsystem, logged periodically. Over the
+// ceiling (~memory_ceiling, MB of resident memory), old key frames are spilled to
+// ~memory_spill_directory and the global map buffers are released
+static const double memoryReportPeriod = 60.0;  // s
+static const int memorySpillBatch = 10;          // key frames spilled per scan at most
+static const size_t spilledFrameCacheSize = 16;  // spilled key frames kept loaded
+
+// Crash-safe journal of the map (~journal, file path): records are written and
+// synced in batches, a crash loses at most this period
+static const double journalSyncPeriod = 1.0;  // s
+
 static const float sensorMountAngle = 0.0;
 static const float segmentTheta = 60.0*DEG_TO_RAD; // decrese this value may improve accuracy
 static const int segmentValidPointNum = 5;
@@ -104,6 +168,14 @@ static const float edgeThreshold = 0.1;
 static const float surfThreshold = 0.1;
 static const float nearestFeatureSearchSqDist = 25;
 
+// Robust weighting of the scan matching residuals. Surface residuals are divided
+// by the square root of the point range before weighting.
+// LOAM reproduces the original linear weights: 1 - 1.8*|d| (odometry), 1 - 0.9*|d| (mapping)
+static const RobustKernelType odometryRobustKernel = RobustKernelType::LOAM;
+static const float odometryRobustKernelScale = 1.0 / 1.8;
+static const RobustKernelType mappingRobustKernel = RobustKernelType::LOAM;
+static const float mappingRobustKernelScale = 1.0 / 0.9;
+
 
 // Mapping Params
 static const float surroundingKeyframeSearchRadius = 50.0; // key frame that is within n meters from current pose will be considerd for scan-to-map optimization (when loop closure disabled)
@@ -112,8 +184,20 @@ static const int   surroundingKeyframeSearchNum = 50; // submap size (when loop
 static const float historyKeyframeSearchRadius = 7.0; // key frame that is within n meters from current pose will be considerd for loop closure
 static const int   historyKeyframeSearchNum = 25; // 2n+1 number of hostory key frames will be fused into a submap for loop closure
 static const float historyKeyframeFitnessScore = 0.3; // the smaller the better alignment
+static const size_t loopClosureCacheSize = 8; // history submaps kept ready for the candidates tried again
 
 static const float globalMapVisualizationSearchRadius = 500.0; // key frames with in n meters will be visualized
+static const size_t mapQueryMaxK = 100000; // ~map_query NEAREST requests above n points are rejected
+static const size_t kdtreeParallelBuildPoints = 20000; // map kd-trees of at least n points are built by ~kdtree_build_tasks threads
+// level of detail map tiles (~map_tile_budget): the voxel edge doubles at each level, as in an octree
+static const float mapTileSize = 25.0; // edge of the square tiles of the horizontal plane
+static const float mapTileResolution = 0.4; // voxel edge of level 0
+static const float mapTileLevelDistance = 50.0; // tiles within n meters are sent at level 0, the distance doubles at each level
+static const int   mapTileLevels = 4;
+
+// range image log (~record_range_images)
+static const float rangeImageRangeResolution = 0.004; // ranges are stored by steps of n meters, up to 65535 steps
+static const float rangeImageIntensityScale = 256.0; // intensities are stored by steps of 1 / n, up to 65535 steps
 
 
 struct smoothness_t{ 
@@ -141,8 +225,135 @@ struct AssociationOut
   pcl::PointCloud<PointType>::Ptr cloud_corner_last;
   pcl::PointCloud<PointType>::Ptr cloud_surf_last;
   nav_msgs::Odometry laser_odometry;
+  bool stationary = false;  // no clouds, the odometry pose is held
+};
+
+// Running count of LM iterations per scan. Scans taken under aggressive rotation
+// are kept apart, so that initial guess strategies can be compared between runs.
+struct IterationStats
+{
+  size_t scans[2];
+  size_t iterations[2];
+
+  IterationStats() { reset(); }
+
+  void reset() {
+    scans[0] = scans[1] = 0;
+    iterations[0] = iterations[1] = 0;
+  }
+
+  void add(int iterationCount, bool aggressive) {
+    scans[aggressive] += 1;
+    iterations[aggressive] += iterationCount;
+  }
+
+  float mean(bool aggressive) const {
+    return scans[aggressive] ? float(iterations[aggressive]) / scans[aggressive] : 0;
+  }
+
+  size_t total() const { return scans[0] + scans[1]; }
 };
 
+// Scan matching with approximate nearest neighbour searches timed against the
+// same matching, from the same initial guess, with exact searches (~knn_compare),
+// and the difference of the converged poses (rx, ry, rz, tx, ty, tz)
+struct ApproximateSearchBenchmark
+{
+  size_t scans;
+  double exactTime, approximateTime;
+  double rotationError, translationError;  // sums, rad (Euler angles) and m
+  float maxRotationError, maxTranslationError;
+
+  ApproximateSearchBenchmark() { reset(); }
+
+  void reset() {
+    scans = 0;
+    exactTime = approximateTime = 0;
+    rotationError = translationError = 0;
+    maxRotationError = maxTranslationError = 0;
+  }
+
+  void add(double exact_time, double approximate_time, const float *exact,
+           const float *approximate) {
+    float rotation = 0, translation = 0;
+    for (int i = 0; i < 3; i++) {
+      rotation += (exact[i] - approximate[i]) * (exact[i] - approximate[i]);
+      translation +=
+          (exact[i + 3] - approximate[i + 3]) * (exact[i + 3] - approximate[i + 3]);
+    }
+    rotation = sqrt(rotation);
+    translation = sqrt(translation);
+    scans++;
+    exactTime += exact_time;
+    approximateTime += approximate_time;
+    rotationError += rotation;
+    translationError += translation;
+    maxRotationError = std::max(maxRotationError, rotation);
+    maxTranslationError = std::max(maxTranslationError, translation);
+  }
+
+  void report(const char *stage, float eps, int maxLeaves) const {
+    if (scans == 0) return;
+    ROS_INFO("%s approximate search (eps %.2f, %d leaves): speed-up %.2f, "
+             "%.2f / %.2f ms per scan, pose difference mean %.2f cm %.3f deg, "
+             "max %.2f cm %.3f deg",
+             stage, eps, maxLeaves,
+             approximateTime > 0 ? exactTime / approximateTime : 0.0,
+             approximateTime * 1000 / scans, exactTime * 1000 / scans,
+             translationError * 100 / scans, rotationError / scans / DEG_TO_RAD,
+             maxTranslationError * 100, maxRotationError / DEG_TO_RAD);
+  }
+};
+
+// Parallel kd-tree builds timed against a serial build of the same clouds
+// (~kdtree_build_compare). Both trees must find the same neighbours.
+struct KdTreeBuildBenchmark
+{
+  size_t builds;
+  size_t points;
+  size_t queries;
+  size_t mismatches;
+  double parallelTime, serialTime;
+
+  KdTreeBuildBenchmark() { reset(); }
+
+  void reset() {
+    builds = points = queries = mismatches = 0;
+    parallelTime = serialTime = 0;
+  }
+};
+
+// IMU message decoded once and shared by all the consumers
+struct ImuSample
+{
+  double time;
+  float roll, pitch, yaw;
+  Vector3 acc;
+  Vector3 gyro;
+  bool orientationValid;
+};
+
+inline void ImuMsgToSample(const sensor_msgs::Imu &imuIn, ImuSample &sample) {
+  const geometry_msgs::Quaternion &q = imuIn.orientation;
+  sample.orientationValid = !(q.x == 0 && q.y == 0 && q.z == 0 && q.w == 0);
+
+  double roll = 0, pitch = 0, yaw = 0;
+  if (sample.orientationValid) {
+    tf::Quaternion orientation;
+    tf::quaternionMsgToTF(q, orientation);
+    tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw);
+  }
+
+  sample.time = imuIn.header.stamp.toSec();
+  sample.roll = roll;
+  sample.pitch = pitch;
+  sample.yaw = yaw;
+  sample.acc = Vector3(imuIn.linear_acceleration.x, imuIn.linear_acceleration.y,
+                       imuIn.linear_acceleration.z);
+  sample.gyro = Vector3(imuIn.angular_velocity.x, imuIn.angular_velocity.y,
+                        imuIn.angular_velocity.z);
+}
+
 inline void OdometryToTransform(const nav_msgs::Odometry& odometry,
                                 float* transform) {
   double roll, pitch, yaw;
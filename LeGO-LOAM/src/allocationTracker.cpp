@@ -0,0 +1,35 @@
+#include "allocation_tracker.h"
+
+#ifdef ALLOCATION_TRACKING
+
+#include <cstdlib>
+#include <new>
+
+// Replacement of the global allocation functions, the array and nothrow forms
+// end up here as well through their default definitions.
+// A thread local counter keeps the hook free of contention.
+
+namespace {
+thread_local size_t allocationCount = 0;
+}
+
+size_t threadAllocationCount() { return allocationCount; }
+
+void *operator new(std::size_t size) {
+  allocationCount++;
+  if (size == 0) size = 1;
+  while (true) {
+    if (void *p = std::malloc(size)) return p;
+    std::new_handler handler = std::get_new_handler();
+    if (!handler) throw std::bad_alloc();
+    handler();
+  }
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+#else
+
+size_t threadAllocationCount() { return 0; }
+
+#endif  // ALLOCATION_TRACKING
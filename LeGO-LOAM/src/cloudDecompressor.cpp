@@ -0,0 +1,58 @@
+// Local relay for the compressed clouds of lego_loam (cloud_codec.h): for each
+// topic of ~topics, <topic>/compressed is decoded and republished as a
+// sensor_msgs/PointCloud2 (x, y, z, intensity float32) on ~output_prefix<topic>.
+#include "cloud_codec.h"
+#include "packed_cloud.h"
+#include "cloud_msgs/CompressedCloud.h"
+#include <memory>
+
+class Relay {
+ public:
+  Relay(ros::NodeHandle &nh, const std::string &topic,
+        const std::string &output) {
+    _pub = nh.advertise<sensor_msgs::PointCloud2>(output, 2);
+    _sub = nh.subscribe(topic + "/compressed", 2, &Relay::handler, this);
+  }
+
+ private:
+  void handler(const cloud_msgs::CompressedCloudConstPtr &compressed) {
+    if (_pub.getNumSubscribers() == 0) return;
+    if (!_codec.decode(compressed->data.data(), compressed->data.size(),
+                       _cloud)) {
+      ROS_WARN_THROTTLE(10, "Invalid compressed cloud on [%s]",
+                        _sub.getTopic().c_str());
+      return;
+    }
+    sensor_msgs::PointCloud2 msg;
+    msg.header = compressed->header;
+    toPackedCloud(_cloud, msg);
+    _pub.publish(msg);
+  }
+
+  ros::Publisher _pub;
+  ros::Subscriber _sub;
+  CloudCodec _codec;
+  pcl::PointCloud<PointType> _cloud;
+};
+
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "cloud_decompressor");
+
+  ros::NodeHandle nh;
+  ros::NodeHandle pnh("~");
+  std::vector<std::string> topics;
+  pnh.getParam("topics", topics);
+  if (topics.empty()) topics.push_back("/laser_cloud_surround");
+  std::string output_prefix = "/decompressed";
+  pnh.getParam("output_prefix", output_prefix);
+
+  std::vector<std::unique_ptr<Relay>> relays;
+  for (const std::string &topic : topics) {
+    relays.emplace_back(new Relay(nh, topic, output_prefix + topic));
+    ROS_INFO("Relaying %s/compressed to %s%s", topic.c_str(),
+             output_prefix.c_str(), topic.c_str());
+  }
+
+  ros::spin();
+  return 0;
+}
@@ -0,0 +1,291 @@
+#include "datasetReader.h"
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char RAW_MAGIC[8] = {'L', 'E', 'G', 'O', 'R', 'A', 'W', '1'};
+const size_t RAW_RECORD_HEADER = sizeof(uint32_t) + sizeof(double);
+
+const char RANGE_IMAGE_MAGIC[8] = {'L', 'E', 'G', 'O', 'R', 'I', 'M', '1'};
+// magic, rows, columns, range resolution
+const size_t RANGE_IMAGE_HEADER = 8 + 2 * sizeof(uint32_t) + sizeof(float);
+const size_t RANGE_IMAGE_RECORD_HEADER = 2 * sizeof(uint32_t);
+
+// Read-only mapping of a whole file, released with unmapFile()
+const uint8_t *mapFile(const std::string &path, size_t &size) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    ::close(fd);
+    return nullptr;
+  }
+  size = st.st_size;
+  void *data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) return nullptr;
+
+  madvise(data, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+  return static_cast<const uint8_t *>(data);
+}
+
+void unmapFile(const uint8_t *data, size_t size) {
+  munmap(const_cast<uint8_t *>(data), size);
+}
+
+// Starts one period after zero, a null stamp means "latest" to tf
+double syntheticTime(size_t index) { return (index + 1) * scanPeriod; }
+
+void fillCloud(const uint8_t *data, size_t count,
+               pcl::PointCloud<PointType> &cloud) {
+  cloud.points.resize(count);
+  float values[4];
+  for (size_t i = 0; i < count; ++i, data += sizeof(values)) {
+    std::memcpy(values, data, sizeof(values));
+    PointType &point = cloud.points[i];
+    point.x = values[0];
+    point.y = values[1];
+    point.z = values[2];
+    point.intensity = values[3];
+  }
+  cloud.width = count;
+  cloud.height = 1;
+  cloud.is_dense = false;
+}
+
+}  // namespace
+
+DatasetReader::DatasetReader(size_t prefetch)
+    : _prefetch(prefetch),
+      _endless(false),
+      _raw_data(nullptr),
+      _raw_size(0),
+      _rows(0),
+      _columns(0),
+      _range_resolution(0),
+      _finished(false),
+      _stop(false) {}
+
+DatasetReader::~DatasetReader() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cv.notify_all();
+  if (_thread.joinable()) _thread.join();
+  if (_raw_data) unmapFile(_raw_data, _raw_size);
+}
+
+bool DatasetReader::open(const std::string &path, bool endless) {
+  _endless = endless;
+
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) return false;
+
+  if (S_ISDIR(st.st_mode)) {
+    _format = KITTI;
+    if (!listKittiScans(path)) return false;
+  } else {
+    _raw_data = mapFile(path, _raw_size);
+    if (!_raw_data || _raw_size < sizeof(RAW_MAGIC)) return false;
+    if (std::memcmp(_raw_data, RAW_MAGIC, sizeof(RAW_MAGIC)) == 0) {
+      _format = RAW;
+      if (!listRawScans()) return false;
+    } else if (std::memcmp(_raw_data, RANGE_IMAGE_MAGIC,
+                           sizeof(RANGE_IMAGE_MAGIC)) == 0) {
+      _format = RANGE_IMAGE;
+      if (!listRangeImageScans()) return false;
+    } else {
+      return false;
+    }
+  }
+
+  _thread = std::thread(&DatasetReader::prefetchThread, this);
+  return true;
+}
+
+bool DatasetReader::listKittiScans(const std::string &directory) {
+  DIR *dir = opendir(directory.c_str());
+  if (!dir) return false;
+
+  while (struct dirent *entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0) {
+      _kitti_files.push_back(directory + "/" + name);
+    }
+  }
+  closedir(dir);
+
+  // KITTI file names are zero padded frame numbers
+  std::sort(_kitti_files.begin(), _kitti_files.end());
+  return !_kitti_files.empty();
+}
+
+bool DatasetReader::listRawScans() {
+  size_t offset = sizeof(RAW_MAGIC);
+  while (offset + RAW_RECORD_HEADER <= _raw_size) {
+    uint32_t count;
+    std::memcpy(&count, _raw_data + offset, sizeof(count));
+    const size_t payload = size_t(count) * 4 * sizeof(float);
+    if (offset + RAW_RECORD_HEADER + payload > _raw_size) {
+      ROS_ERROR("Truncated raw scan %lu", _raw_offsets.size());
+      break;
+    }
+    _raw_offsets.push_back(offset);
+    offset += RAW_RECORD_HEADER + payload;
+  }
+  return !_raw_offsets.empty();
+}
+
+bool DatasetReader::listRangeImageScans() {
+  if (_raw_size < RANGE_IMAGE_HEADER) return false;
+  std::memcpy(&_rows, _raw_data + 8, sizeof(_rows));
+  std::memcpy(&_columns, _raw_data + 12, sizeof(_columns));
+  std::memcpy(&_range_resolution, _raw_data + 16, sizeof(_range_resolution));
+
+  size_t offset = RANGE_IMAGE_HEADER;
+  while (offset + RANGE_IMAGE_RECORD_HEADER <= _raw_size) {
+    uint32_t header[2];
+    std::memcpy(header, _raw_data + offset, sizeof(header));
+    const size_t payload = offset + RANGE_IMAGE_RECORD_HEADER;
+    if (payload + header[1] > _raw_size) {
+      ROS_ERROR("Truncated range image log after scan %lu",
+                _raw_offsets.size());
+      break;
+    }
+    if (header[0] == RangeImageRecorder::SCAN) {
+      _raw_offsets.push_back(offset);
+      _imu_end.push_back(_imu.size());
+    } else if (header[0] == RangeImageRecorder::IMU) {
+      ImuSample imu;
+      if (RangeImageRecorder::decodeImu(_raw_data + payload, header[1], imu)) {
+        _imu.push_back(imu);
+      }
+    }
+    offset = payload + header[1];
+  }
+  return !_raw_offsets.empty();
+}
+
+bool DatasetReader::loadKittiScan(size_t index, DatasetScan &scan) {
+  if (index >= _kitti_files.size()) return false;
+
+  size_t size = 0;
+  const uint8_t *data = mapFile(_kitti_files[index], size);
+  if (!data) {
+    ROS_ERROR("Unable to read [%s]", _kitti_files[index].c_str());
+    return false;
+  }
+  scan.cloud.reset(new pcl::PointCloud<PointType>());
+  fillCloud(data, size / (4 * sizeof(float)), *scan.cloud);
+  unmapFile(data, size);
+
+  scan.time = syntheticTime(index);
+  scan.index = index;
+  return true;
+}
+
+bool DatasetReader::loadRawScan(size_t index, DatasetScan &scan) {
+  if (index >= _raw_offsets.size()) return false;
+
+  const size_t offset = _raw_offsets[index];
+  uint32_t count;
+  double time;
+  std::memcpy(&count, _raw_data + offset, sizeof(count));
+  std::memcpy(&time, _raw_data + offset + sizeof(count), sizeof(time));
+
+  scan.cloud.reset(new pcl::PointCloud<PointType>());
+  fillCloud(_raw_data + offset + RAW_RECORD_HEADER, count, *scan.cloud);
+
+  scan.time = (time != 0) ? time : syntheticTime(index);
+  scan.index = index;
+  return true;
+}
+
+bool DatasetReader::loadRangeImageScan(size_t index, DatasetScan &scan) {
+  if (index >= _raw_offsets.size()) return false;
+
+  const size_t offset = _raw_offsets[index];
+  uint32_t header[2];
+  std::memcpy(header, _raw_data + offset, sizeof(header));
+
+  scan.cloud.reset(new pcl::PointCloud<PointType>());
+  if (!RangeImageRecorder::decodeScan(
+          _raw_data + offset + RANGE_IMAGE_RECORD_HEADER, header[1], _rows,
+          _columns, _range_resolution, scan.time, *scan.cloud, _planes)) {
+    ROS_ERROR("Corrupt range image %lu", index);
+    scan.cloud->clear();
+  }
+  scan.index = index;
+
+  const size_t imuBegin = (index > 0) ? _imu_end[index - 1] : 0;
+  scan.imu.assign(_imu.begin() + imuBegin, _imu.begin() + _imu_end[index]);
+  return true;
+}
+
+void DatasetReader::prefetchThread() {
+  const size_t count =
+      (_format == KITTI) ? _kitti_files.size() : _raw_offsets.size();
+  // endless mode: position in the back and forth sequence, and stamps
+  size_t step = 0;
+  double previousTime = 0;
+  double time = 0;
+
+  for (size_t index = 0;; ++index) {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [&]() { return _stop || _queue.size() < _prefetch; });
+      if (_stop) break;
+    }
+
+    if (_endless && count > 1) {
+      const size_t period = 2 * (count - 1);
+      const size_t phase = step++ % period;
+      index = (phase < count) ? phase : period - phase;
+    }
+
+    DatasetScan scan;
+    bool loaded = false;
+    switch (_format) {
+      case KITTI: loaded = loadKittiScan(index, scan); break;
+      case RAW: loaded = loadRawScan(index, scan); break;
+      case RANGE_IMAGE: loaded = loadRangeImageScan(index, scan); break;
+    }
+
+    if (loaded && _endless) {
+      const bool forward = scan.time >= previousTime;
+      time = (step > 1) ? time + std::abs(scan.time - previousTime) : scan.time;
+      previousTime = scan.time;
+      // IMU samples played backward make no sense, they are shifted otherwise
+      if (!forward) scan.imu.clear();
+      for (ImuSample &imu : scan.imu) imu.time += time - scan.time;
+      scan.time = time;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!loaded) {
+      _finished = true;
+      _cv.notify_all();
+      break;
+    }
+    _queue.push_back(std::move(scan));
+    _cv.notify_all();
+  }
+}
+
+bool DatasetReader::next(DatasetScan &scan) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _cv.wait(lock, [&]() { return !_queue.empty() || _finished; });
+  if (_queue.empty()) return false;
+
+  scan = std::move(_queue.front());
+  _queue.pop_front();
+  _cv.notify_all();
+  return true;
+}
@@ -0,0 +1,74 @@
+#ifndef DATASETREADER_H
+#define DATASETREADER_H
+
+#include "utility.h"
+#include "rangeImageRecorder.h"
+#include <condition_variable>
+
+struct DatasetScan {
+  pcl::PointCloud<PointType>::Ptr cloud;
+  double time;
+  size_t index;
+  std::vector<ImuSample> imu;  // recorded since the previous scan
+};
+
+// Reads benchmark datasets without converting them to rosbags.
+//  - KITTI: a directory of velodyne .bin files (float32 x, y, z, reflectance)
+//  - raw: a single file starting with the 8 bytes "LEGORAW1" followed by
+//    records of { uint32 point count, float64 time, count * float32 x, y, z, i }
+//    A null time is replaced by a synthetic one.
+//  - range image log: a file starting with "LEGORIM1", see RangeImageRecorder,
+//    whose IMU samples come with the scans.
+// Files are memory mapped and a background thread prefetches the next scans.
+// KITTI scans get synthetic timestamps, one scanPeriod apart.
+// In endless mode the sequence is played forward, then backward, and so on,
+// so that the trajectory stays continuous, and the stamps keep increasing by
+// the original spacing between consecutive scans. The IMU samples are only
+// replayed forward.
+class DatasetReader {
+ public:
+  explicit DatasetReader(size_t prefetch = 4);
+  ~DatasetReader();
+
+  bool open(const std::string &path, bool endless = false);
+
+  // Blocks until the next scan is available, returns false at the end
+  bool next(DatasetScan &scan);
+
+ private:
+  bool listKittiScans(const std::string &directory);
+  bool listRawScans();
+  bool listRangeImageScans();
+  bool loadKittiScan(size_t index, DatasetScan &scan);
+  bool loadRawScan(size_t index, DatasetScan &scan);
+  bool loadRangeImageScan(size_t index, DatasetScan &scan);
+  void prefetchThread();
+
+  enum Format { KITTI, RAW, RANGE_IMAGE } _format;
+  const size_t _prefetch;
+  bool _endless;
+
+  std::vector<std::string> _kitti_files;
+
+  const uint8_t *_raw_data;
+  size_t _raw_size;
+  std::vector<size_t> _raw_offsets;  // start of each record
+
+  // range image log: image size, and IMU samples, scan i gets those from
+  // _imu_end[i - 1] to _imu_end[i]
+  uint32_t _rows;
+  uint32_t _columns;
+  float _range_resolution;
+  std::vector<ImuSample> _imu;
+  std::vector<size_t> _imu_end;
+  std::vector<uint8_t> _planes;  // prefetch thread
+
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::deque<DatasetScan> _queue;
+  bool _finished;
+  bool _stop;
+};
+
+#endif  // DATASETREADER_H
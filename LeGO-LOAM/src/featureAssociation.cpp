@@ -35,21 +35,37 @@
 //      (IROS). October 2018.
 
 #include "featureAssociation.h"
+#include <chrono>
 
 const float RAD2DEG = 180.0 / M_PI;
 
 FeatureAssociation::FeatureAssociation(ros::NodeHandle &node, size_t N_scan,
                                        size_t horizontal_scan,
                                        Channel<ProjectionOut> &input_channel,
-                                       Channel<AssociationOut> &output_channel)
+                                       Channel<AssociationOut> &output_channel,
+                                       const OdometryBuffer &odometry_buffer,
+                                       AutoTuner &tuner,
+                                       AsyncPublisher &publisher,
+                                       MemoryAccounting &memory,
+                                       SoakMonitor &soak)
     : nh(node),
       _N_scan(N_scan),
       _horizontal_scan(horizontal_scan),
       _input_channel(input_channel),
-      _output_channel(output_channel) {
-  subImu = nh.subscribe<sensor_msgs::Imu>(
-      imuTopic, 50, &FeatureAssociation::imuHandler, this);
-
+      _output_channel(output_channel),
+      _publisher(publisher),
+      _allocations("FeatureAssociation", true),
+      _scratch_memory(memory, MemoryAccounting::SCRATCH),
+      _kdtree_memory(memory, MemoryAccounting::KD_TREES),
+      _channel_memory(memory, MemoryAccounting::CHANNELS),
+      _soak(soak),
+      _odometry_buffer(odometry_buffer),
+      _tuner(tuner),
+      gridCornerLast(N_scan, horizontal_scan),
+      gridSurfLast(N_scan, horizontal_scan),
+      _stationary_detector(N_scan, horizontal_scan),
+      cornerRobustKernel(odometryRobustKernel, odometryRobustKernelScale),
+      surfRobustKernel(odometryRobustKernel, odometryRobustKernelScale) {
   pubCornerPointsSharp =
       nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_sharp", 1);
   pubCornerPointsLessSharp =
@@ -67,6 +83,28 @@ FeatureAssociation::FeatureAssociation(ros::NodeHandle &node, size_t N_scan,
       nh.advertise<sensor_msgs::PointCloud2>("/outlier_cloud_last", 2);
   pubLaserOdometry = nh.advertise<nav_msgs::Odometry>("/laser_odom_to_init", 5);
 
+  // "kdtree" (default) or "range_image"
+  std::string association = "kdtree";
+  nh.getParam("association", association);
+  _range_image_association = (association == "range_image");
+  _compare_association = false;
+  nh.getParam("association_compare", _compare_association);
+
+  // eps 0 and no leaf limit: exact searches
+  _knn_eps = 0;
+  nh.getParam("odometry_knn_eps", _knn_eps);
+  _knn_max_leaves = 0;
+  nh.getParam("odometry_knn_max_leaves", _knn_max_leaves);
+  _knn_compare = false;
+  nh.getParam("knn_compare", _knn_compare);
+  setApproximateSearch(true);
+
+  bool stationary_detection = false;
+  bool stationary_range_check = false;
+  nh.getParam("stationary_detection", stationary_detection);
+  nh.getParam("stationary_range_check", stationary_range_check);
+  _stationary_detector.configure(stationary_detection, stationary_range_check);
+
   cycle_count = 0;
   initializationValue();
 
@@ -83,7 +121,9 @@ void FeatureAssociation::initializationValue() {
   const size_t cloud_size = _N_scan * _horizontal_scan;
   cloudSmoothness.resize(cloud_size);
 
-  downSizeFilter.setLeafSize(0.2, 0.2, 0.2);
+  _tuning = _tuner.profile();
+  downSizeFilter.setLeafSize(_tuning.odometryLeafSize, _tuning.odometryLeafSize,
+                             _tuning.odometryLeafSize);
 
   segmentedCloud.reset(new pcl::PointCloud<PointType>());
   outlierCloud.reset(new pcl::PointCloud<PointType>());
@@ -112,6 +152,9 @@ void FeatureAssociation::initializationValue() {
   systemInitCount = 0;
   systemInited = false;
 
+  _imu_pending.reserve(imuQueLength);
+  _imu_received.reserve(imuQueLength);
+
   imuPointerFront = 0;
   imuPointerLast = -1;
   imuPointerLastIteration = 0;
@@ -148,6 +191,7 @@ void FeatureAssociation::initializationValue() {
     imuPitch[i] = 0;
     imuYaw[i] = 0;
     imuAcc[i].setZero();
+    imuAccRaw[i].setZero();
     imuVelo[i].setZero();
     imuShift[i].setZero();
     imuAngularVelo[i].setZero();
@@ -169,6 +213,10 @@ void FeatureAssociation::initializationValue() {
   imuShiftFromStart.setZero();
   imuVeloFromStart.setZero();
 
+  imuPreintegrationParams = MakeImuPreintegrationParams();
+  timeScanLast = -1;
+  degenerateScanCount = 0;
+
   laserCloudCornerLast.reset(new pcl::PointCloud<PointType>());
   laserCloudSurfLast.reset(new pcl::PointCloud<PointType>());
   laserCloudOri.reset(new pcl::PointCloud<PointType>());
@@ -290,33 +338,63 @@ void FeatureAssociation::AccumulateIMUShiftAndRotation() {
   }
 }
 
-void FeatureAssociation::imuHandler(const sensor_msgs::Imu::ConstPtr &imuIn) {
+void FeatureAssociation::imuHandler(const ImuSample &imu) {
   std::lock_guard<std::mutex> lock(_imu_mutex);
-  double roll, pitch, yaw;
-  tf::Quaternion orientation;
-  tf::quaternionMsgToTF(imuIn->orientation, orientation);
-  tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw);
+  _stationary_detector.addImu(imu);
+  // the ring only keeps imuQueLength samples anyway
+  if (_imu_pending.size() == size_t(imuQueLength)) {
+    _imu_pending.erase(_imu_pending.begin());
+  }
+  _imu_pending.push_back(imu);
+}
+
+void FeatureAssociation::addImuToQueue(const ImuSample &imu) {
+
+  const float roll = imu.roll;
+  const float pitch = imu.pitch;
 
-  float accX = imuIn->linear_acceleration.y - sin(roll) * cos(pitch) * 9.81;
-  float accY = imuIn->linear_acceleration.z - cos(roll) * cos(pitch) * 9.81;
-  float accZ = imuIn->linear_acceleration.x + sin(pitch) * 9.81;
+  float accX = imu.acc.y() - sin(roll) * cos(pitch) * 9.81;
+  float accY = imu.acc.z() - cos(roll) * cos(pitch) * 9.81;
+  float accZ = imu.acc.x() + sin(pitch) * 9.81;
 
   imuPointerLast = (imuPointerLast + 1) % imuQueLength;
 
-  imuTime[imuPointerLast] = imuIn->header.stamp.toSec();
+  imuTime[imuPointerLast] = imu.time;
 
   imuRoll[imuPointerLast] = roll;
   imuPitch[imuPointerLast] = pitch;
-  imuYaw[imuPointerLast] = yaw;
+  imuYaw[imuPointerLast] = imu.yaw;
 
   imuAcc[imuPointerLast] = {accX, accY, accZ};
+  imuAccRaw[imuPointerLast] = imu.acc;
 
-  imuAngularVelo[imuPointerLast] = {imuIn->angular_velocity.x,
-                                    imuIn->angular_velocity.y,
-                                    imuIn->angular_velocity.z};
+  imuAngularVelo[imuPointerLast] = imu.gyro;
   AccumulateIMUShiftAndRotation();
 }
 
+bool FeatureAssociation::preintegrateImuRotation(Vector3 &angularFromStart) {
+  if (imuPointerLast < 0 || timeScanLast < 0) return false;
+
+  gtsam::PreintegratedImuMeasurements pim(imuPreintegrationParams,
+                                          gtsam::imuBias::ConstantBias());
+  double lastTime = timeScanLast;
+  // walk the circular buffer from the oldest to the newest sample
+  for (int k = 1; k <= imuQueLength; ++k) {
+    int ind = (imuPointerLast + k) % imuQueLength;
+    if (imuTime[ind] <= timeScanLast) continue;
+    if (imuTime[ind] > timeScanCur) break;
+    pim.integrateMeasurement(imuAccRaw[ind].cast<double>(),
+                             imuAngularVelo[ind].cast<double>(),
+                             imuTime[ind] - lastTime);
+    lastTime = imuTime[ind];
+  }
+  if (pim.deltaTij() <= 0) return false;
+
+  // rotation between the two sweep starts, integrated on SO(3)
+  angularFromStart = gtsam::Rot3::Logmap(pim.deltaRij()).cast<float>();
+  return true;
+}
+
 void FeatureAssociation::adjustDistortion() {
   bool halfPassed = false;
   int cloudSize = segmentedCloud->points.size();
@@ -530,11 +608,11 @@ void FeatureAssociation::extractFeatures() {
             cloudCurvature[ind] > edgeThreshold &&
             segInfo.segmentedCloudGroundFlag[ind] == false) {
           largestPickedNum++;
-          if (largestPickedNum <= 2) {
+          if (largestPickedNum <= _tuning.sharpFeatureNum) {
             cloudLabel[ind] = 2;
             cornerPointsSharp->push_back(segmentedCloud->points[ind]);
             cornerPointsLessSharp->push_back(segmentedCloud->points[ind]);
-          } else if (largestPickedNum <= 20) {
+          } else if (largestPickedNum <= _tuning.lessSharpFeatureNum) {
             cloudLabel[ind] = 1;
             cornerPointsLessSharp->push_back(segmentedCloud->points[ind]);
           } else {
@@ -575,7 +653,7 @@ void FeatureAssociation::extractFeatures() {
           surfPointsFlat->push_back(segmentedCloud->points[ind]);
 
           smallestPickedNum++;
-          if (smallestPickedNum >= 4) {
+          if (smallestPickedNum >= _tuning.flatFeatureNum) {
             break;
           }
 
@@ -614,7 +692,11 @@ void FeatureAssociation::extractFeatures() {
 
     surfPointsLessFlatScanDS->clear();
     downSizeFilter.setInputCloud(surfPointsLessFlatScan);
-    downSizeFilter.filter(*surfPointsLessFlatScanDS);
+    {
+      // voxel indices are sorted in a new vector on every call
+      AllocationMonitor::Allowance allow(_allocations, "pcl::VoxelGrid");
+      downSizeFilter.filter(*surfPointsLessFlatScanDS);
+    }
 
     *surfPointsLessFlat += *surfPointsLessFlatScanDS;
   }
@@ -837,6 +919,78 @@ void FeatureAssociation::AccumulateRotation(float cx, float cy, float cz,
   oz = atan2(srzcrx / cos(ox), crzcrx / cos(ox));
 }
 
+void FeatureAssociation::buildLastFeatureIndexes() {
+  using Clock = std::chrono::steady_clock;
+  auto elapsed = [](Clock::time_point since) {
+    return std::chrono::duration<double>(Clock::now() - since).count();
+  };
+
+  if (!_range_image_association || _compare_association) {
+    const auto start = Clock::now();
+    kdtreeCornerLast.setInputCloud(laserCloudCornerLast);
+    kdtreeSurfLast.setInputCloud(laserCloudSurfLast);
+    associationBenchmark.kdtreeBuildTime += elapsed(start);
+  }
+  if (_range_image_association || _compare_association) {
+    const auto start = Clock::now();
+    gridCornerLast.setInputCloud(laserCloudCornerLast);
+    gridSurfLast.setInputCloud(laserCloudSurfLast);
+    associationBenchmark.gridBuildTime += elapsed(start);
+  }
+}
+
+bool FeatureAssociation::nearestLastFeature(bool corner,
+                                            const PointType &point,
+                                            int &index, float &sqDis) {
+  auto &kdtree = corner ? kdtreeCornerLast : kdtreeSurfLast;
+  auto &grid = corner ? gridCornerLast : gridSurfLast;
+
+  if (!_compare_association) {
+    if (_range_image_association) {
+      if (grid.nearestKSearch(point, 1, pointSearchInd, pointSearchSqDis) == 0) {
+        return false;
+      }
+    } else {
+      kdtree.nearestKSearch(point, 1, pointSearchInd, pointSearchSqDis);
+    }
+    index = pointSearchInd[0];
+    sqDis = pointSearchSqDis[0];
+    return true;
+  }
+
+  using Clock = std::chrono::steady_clock;
+  auto start = Clock::now();
+  kdtree.nearestKSearch(point, 1, pointSearchInd, pointSearchSqDis);
+  const int kdtreeIndex = pointSearchInd[0];
+  const float kdtreeSqDis = pointSearchSqDis[0];
+  associationBenchmark.kdtreeQueryTime +=
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  start = Clock::now();
+  const bool found =
+      grid.nearestKSearch(point, 1, pointSearchInd, pointSearchSqDis) > 0;
+  associationBenchmark.gridQueryTime +=
+      std::chrono::duration<double>(Clock::now() - start).count();
+
+  associationBenchmark.queries++;
+  if (found && (pointSearchInd[0] == kdtreeIndex ||
+                pointSearchSqDis[0] == kdtreeSqDis)) {
+    associationBenchmark.agreements++;
+  } else if (!found && kdtreeSqDis < nearestFeatureSearchSqDist) {
+    associationBenchmark.misses++;
+  }
+
+  if (_range_image_association) {
+    if (!found) return false;
+    index = pointSearchInd[0];
+    sqDis = pointSearchSqDis[0];
+  } else {
+    index = kdtreeIndex;
+    sqDis = kdtreeSqDis;
+  }
+  return true;
+}
+
 void FeatureAssociation::findCorrespondingCornerFeatures(int iterCount) {
   int cornerPointsSharpNum = cornerPointsSharp->points.size();
 
@@ -845,12 +999,13 @@ void FeatureAssociation::findCorrespondingCornerFeatures(int iterCount) {
     TransformToStart(&cornerPointsSharp->points[i], &pointSel);
 
     if (iterCount % 5 == 0) {
-      kdtreeCornerLast.nearestKSearch(pointSel, 1, pointSearchInd,
-                                       pointSearchSqDis);
+      int nearestInd;
+      float nearestSqDis;
       int closestPointInd = -1, minPointInd2 = -1;
 
-      if (pointSearchSqDis[0] < nearestFeatureSearchSqDist) {
-        closestPointInd = pointSearchInd[0];
+      if (nearestLastFeature(true, pointSel, nearestInd, nearestSqDis) &&
+          nearestSqDis < nearestFeatureSearchSqDist) {
+        closestPointInd = nearestInd;
         int closestPointScan =
             int(laserCloudCornerLast->points[closestPointInd].intensity);
 
@@ -937,11 +1092,12 @@ void FeatureAssociation::findCorrespondingCornerFeatures(int iterCount) {
       float ld2 = a012 / l12;
 
       float s = 1;
+      bool accepted = true;
       if (iterCount >= 5) {
-        s = 1 - 1.8 * fabs(ld2);
+        accepted = cornerRobustKernel.rowScale(ld2, s);
       }
 
-      if (s > 0.1 && ld2 != 0) {
+      if (accepted && ld2 != 0) {
         PointType coeff;
         coeff.x = s * la;
         coeff.y = s * lb;
@@ -963,12 +1119,13 @@ void FeatureAssociation::findCorrespondingSurfFeatures(int iterCount) {
     TransformToStart(&surfPointsFlat->points[i], &pointSel);
 
     if (iterCount % 5 == 0) {
-      kdtreeSurfLast.nearestKSearch(pointSel, 1, pointSearchInd,
-                                     pointSearchSqDis);
+      int nearestInd;
+      float nearestSqDis;
       int closestPointInd = -1, minPointInd2 = -1, minPointInd3 = -1;
 
-      if (pointSearchSqDis[0] < nearestFeatureSearchSqDist) {
-        closestPointInd = pointSearchInd[0];
+      if (nearestLastFeature(false, pointSel, nearestInd, nearestSqDis) &&
+          nearestSqDis < nearestFeatureSearchSqDist) {
+        closestPointInd = nearestInd;
         int closestPointScan =
             int(laserCloudSurfLast->points[closestPointInd].intensity);
 
@@ -1056,14 +1213,15 @@ void FeatureAssociation::findCorrespondingSurfFeatures(int iterCount) {
       float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
 
       float s = 1;
+      bool accepted = true;
       if (iterCount >= 5) {
-        s = 1 -
-            1.8 * fabs(pd2) /
-                sqrt(sqrt(pointSel.x * pointSel.x + pointSel.y * pointSel.y +
-                          pointSel.z * pointSel.z));
+        accepted = surfRobustKernel.rowScale(
+            pd2 / sqrt(sqrt(pointSel.x * pointSel.x + pointSel.y * pointSel.y +
+                            pointSel.z * pointSel.z)),
+            s);
       }
 
-      if (s > 0.1 && pd2 != 0) {
+      if (accepted && pd2 != 0) {
         PointType coeff;
         coeff.x = s * pa;
         coeff.y = s * pb;
@@ -1080,11 +1238,11 @@ void FeatureAssociation::findCorrespondingSurfFeatures(int iterCount) {
 bool FeatureAssociation::calculateTransformationSurf(int iterCount) {
   int pointSelNum = laserCloudOri->points.size();
 
-  Eigen::Matrix<float,Eigen::Dynamic,3> matA(pointSelNum, 3);
-  Eigen::Matrix<float,3,Eigen::Dynamic> matAt(3,pointSelNum);
-  Eigen::Matrix<float,3,3> matAtA;
-  Eigen::VectorXf matB(pointSelNum);
-  Eigen::Matrix<float,3,1> matAtB;
+  // the normal equations are accumulated point by point, nothing is sized by
+  // the number of correspondences
+  Eigen::Matrix<float,1,3> matA;
+  Eigen::Matrix<float,3,3> matAtA = Eigen::Matrix<float,3,3>::Zero();
+  Eigen::Matrix<float,3,1> matAtB = Eigen::Matrix<float,3,1>::Zero();
   Eigen::Matrix<float,3,1> matX;
   Eigen::Matrix<float,3,3> matP;
 
@@ -1142,15 +1300,11 @@ bool FeatureAssociation::calculateTransformationSurf(int iterCount) {
 
     float d2 = coeff.intensity;
 
-    matA(i, 0) = arx;
-    matA(i, 1) = arz;
-    matA(i, 2) = aty;
-    matB(i, 0) = -0.05 * d2;
+    matA << arx, arz, aty;
+    matAtA += matA.transpose() * matA;
+    matAtB += matA.transpose() * (-0.05f * d2);
   }
 
-  matAt = matA.transpose();
-  matAtA = matAt * matA;
-  matAtB = matAt * matB;
   matX = matAtA.colPivHouseholderQr().solve(matAtB);
 
   if (iterCount == 0) {
@@ -1205,11 +1359,11 @@ bool FeatureAssociation::calculateTransformationSurf(int iterCount) {
 bool FeatureAssociation::calculateTransformationCorner(int iterCount) {
   int pointSelNum = laserCloudOri->points.size();
 
-  Eigen::Matrix<float,Eigen::Dynamic,3> matA(pointSelNum, 3);
-  Eigen::Matrix<float,3,Eigen::Dynamic> matAt(3,pointSelNum);
-  Eigen::Matrix<float,3,3> matAtA;
-  Eigen::VectorXf matB(pointSelNum);
-  Eigen::Matrix<float,3,1> matAtB;
+  // the normal equations are accumulated point by point, nothing is sized by
+  // the number of correspondences
+  Eigen::Matrix<float,1,3> matA;
+  Eigen::Matrix<float,3,3> matAtA = Eigen::Matrix<float,3,3>::Zero();
+  Eigen::Matrix<float,3,1> matAtB = Eigen::Matrix<float,3,1>::Zero();
   Eigen::Matrix<float,3,1> matX;
   Eigen::Matrix<float,3,3> matP;
 
@@ -1248,15 +1402,11 @@ bool FeatureAssociation::calculateTransformationCorner(int iterCount) {
 
     float d2 = coeff.intensity;
 
-    matA(i, 0) = ary;
-    matA(i, 1) = atx;
-    matA(i, 2) = atz;
-    matB(i, 0) = -0.05 * d2;
+    matA << ary, atx, atz;
+    matAtA += matA.transpose() * matA;
+    matAtB += matA.transpose() * (-0.05f * d2);
   }
 
-  matAt = matA.transpose();
-  matAtA = matAt * matA;
-  matAtB = matAt * matB;
   matX = matAtA.colPivHouseholderQr().solve(matAtB);
 
   if (iterCount == 0) {
@@ -1311,11 +1461,11 @@ bool FeatureAssociation::calculateTransformationCorner(int iterCount) {
 bool FeatureAssociation::calculateTransformation(int iterCount) {
   int pointSelNum = laserCloudOri->points.size();
 
-  Eigen::Matrix<float,Eigen::Dynamic,6> matA(pointSelNum, 6);
-  Eigen::Matrix<float,6,Eigen::Dynamic> matAt(6,pointSelNum);
-  Eigen::Matrix<float,6,6> matAtA;
-  Eigen::VectorXf matB(pointSelNum);
-  Eigen::Matrix<float,6,1> matAtB;
+  // the normal equations are accumulated point by point, nothing is sized by
+  // the number of correspondences
+  Eigen::Matrix<float,1,6> matA;
+  Eigen::Matrix<float,6,6> matAtA = Eigen::Matrix<float,6,6>::Zero();
+  Eigen::Matrix<float,6,1> matAtB = Eigen::Matrix<float,6,1>::Zero();
   Eigen::Matrix<float,6,1> matX;
   Eigen::Matrix<float,6,6> matP;
 
@@ -1385,18 +1535,11 @@ bool FeatureAssociation::calculateTransformation(int iterCount) {
 
     float d2 = coeff.intensity;
 
-    matA(i, 0) = arx;
-    matA(i, 1) = ary;
-    matA(i, 2) = arz;
-    matA(i, 3) = atx;
-    matA(i, 4) = aty;
-    matA(i, 5) = atz;
-    matB(i, 0) = -0.05 * d2;
+    matA << arx, ary, arz, atx, aty, atz;
+    matAtA += matA.transpose() * matA;
+    matAtB += matA.transpose() * (-0.05f * d2);
   }
 
-  matAt = matA.transpose();
-  matAtA = matAt * matA;
-  matAtB = matAt * matB;
   matX = matAtA.colPivHouseholderQr().solve(matAtB);
 
   if (iterCount == 0) {
@@ -1463,23 +1606,15 @@ void FeatureAssociation::checkSystemInitialization() {
   surfPointsLessFlat = laserCloudSurfLast;
   laserCloudSurfLast = laserCloudTemp;
 
-  kdtreeCornerLast.setInputCloud(laserCloudCornerLast);
-  kdtreeSurfLast.setInputCloud(laserCloudSurfLast);
+  buildLastFeatureIndexes();
 
   laserCloudCornerLastNum = laserCloudCornerLast->points.size();
   laserCloudSurfLastNum = laserCloudSurfLast->points.size();
 
-  sensor_msgs::PointCloud2 laserCloudCornerLast2;
-  pcl::toROSMsg(*laserCloudCornerLast, laserCloudCornerLast2);
-  laserCloudCornerLast2.header.stamp = cloudHeader.stamp;
-  laserCloudCornerLast2.header.frame_id = "/camera";
-  _pub_cloud_corner_last.publish(laserCloudCornerLast2);
-
-  sensor_msgs::PointCloud2 laserCloudSurfLast2;
-  pcl::toROSMsg(*laserCloudSurfLast, laserCloudSurfLast2);
-  laserCloudSurfLast2.header.stamp = cloudHeader.stamp;
-  laserCloudSurfLast2.header.frame_id = "/camera";
-  _pub_cloud_surf_last.publish(laserCloudSurfLast2);
+  _publisher.publishCopy(_pub_cloud_corner_last, *laserCloudCornerLast,
+                         cloudHeader.stamp, "/camera");
+  _publisher.publishCopy(_pub_cloud_surf_last, *laserCloudSurfLast,
+                         cloudHeader.stamp, "/camera");
 
   transformSum[0] += imuPitchStart;
   transformSum[2] += imuRollStart;
@@ -1495,6 +1630,10 @@ void FeatureAssociation::updateInitialGuess() {
   imuShiftFromStart = imuShiftFromStartCur;
   imuVeloFromStart = imuVeloFromStartCur;
 
+  if (imuPreintegrationEnableFlag) {
+    preintegrateImuRotation(imuAngularFromStart);
+  }
+
   if (imuAngularFromStart.x() != 0 || imuAngularFromStart.y() != 0 ||
       imuAngularFromStart.z() != 0) {
     transformCur[0] = -imuAngularFromStart.y();
@@ -1508,11 +1647,49 @@ void FeatureAssociation::updateInitialGuess() {
     transformCur[4] -= imuVeloFromStart.y() * scanPeriod;
     transformCur[5] -= imuVeloFromStart.z() * scanPeriod;
   }
+
+  float odometryTransform[6];
+  if (odometryMotionGuess(odometryTransform)) {
+    // the IMU is trusted more for rotation, odometry for translation
+    if (imuPointerLast < 0) {
+      transformCur[0] = odometryTransform[0];
+      transformCur[1] = odometryTransform[1];
+      transformCur[2] = odometryTransform[2];
+    }
+    transformCur[3] = odometryTransform[3];
+    transformCur[4] = odometryTransform[4];
+    transformCur[5] = odometryTransform[5];
+  }
 }
 
-void FeatureAssociation::updateTransformation() {
-  if (laserCloudCornerLastNum < 10 || laserCloudSurfLastNum < 100) return;
+bool FeatureAssociation::odometryMotionGuess(float *transform) {
+  if (timeScanLast < 0 || _odometry_buffer.empty()) return false;
 
+  Eigen::Vector3d translation;
+  Eigen::Quaterniond rotation;
+  if (!_odometry_buffer.relativeMotion(timeScanLast, timeScanCur, translation,
+                                       rotation)) {
+    return false;
+  }
+
+  // lidar frame to camera frame, transformCur holds the inverse motion
+  double roll, pitch, yaw;
+  tf::Matrix3x3(tf::Quaternion(rotation.x(), rotation.y(), rotation.z(),
+                               rotation.w()))
+      .getRPY(roll, pitch, yaw);
+  transform[0] = -pitch;
+  transform[1] = -yaw;
+  transform[2] = -roll;
+  transform[3] = -translation.y();
+  transform[4] = -translation.z();
+  transform[5] = -translation.x();
+  return true;
+}
+
+int FeatureAssociation::updateTransformation() {
+  if (laserCloudCornerLastNum < 10 || laserCloudSurfLastNum < 100) return 0;
+
+  int iterations = 0;
   for (int iterCount1 = 0; iterCount1 < 25; iterCount1++) {
     laserCloudOri->clear();
     coeffSel->clear();
@@ -1520,6 +1697,7 @@ void FeatureAssociation::updateTransformation() {
     findCorrespondingSurfFeatures(iterCount1);
 
     if (laserCloudOri->points.size() < 10) continue;
+    iterations++;
     if (calculateTransformationSurf(iterCount1) == false) break;
   }
 
@@ -1530,8 +1708,46 @@ void FeatureAssociation::updateTransformation() {
     findCorrespondingCornerFeatures(iterCount2);
 
     if (laserCloudOri->points.size() < 10) continue;
+    iterations++;
     if (calculateTransformationCorner(iterCount2) == false) break;
   }
+  return iterations;
+}
+
+void FeatureAssociation::setApproximateSearch(bool approximate) {
+  for (auto *kdtree : {&kdtreeCornerLast, &kdtreeSurfLast}) {
+    kdtree->setEpsilon(approximate ? _knn_eps : 0);
+    kdtree->setMaxLeafChecks(approximate ? std::max(_knn_max_leaves, 0) : 0);
+  }
+}
+
+int FeatureAssociation::benchmarkApproximateSearch() {
+  using Clock = std::chrono::steady_clock;
+  float initial[6], exact[6];
+  std::copy(transformCur, transformCur + 6, initial);
+  // the statistics count the approximate pass only
+  const RobustKernel cornerKernel = cornerRobustKernel;
+  const RobustKernel surfKernel = surfRobustKernel;
+  const AssociationBenchmark association = associationBenchmark;
+
+  setApproximateSearch(false);
+  auto start = Clock::now();
+  updateTransformation();
+  const double exactTime =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  std::copy(transformCur, transformCur + 6, exact);
+
+  std::copy(initial, initial + 6, transformCur);
+  cornerRobustKernel = cornerKernel;
+  surfRobustKernel = surfKernel;
+  associationBenchmark = association;
+  setApproximateSearch(true);
+  start = Clock::now();
+  const int iterations = updateTransformation();
+  knnBenchmark.add(exactTime,
+                   std::chrono::duration<double>(Clock::now() - start).count(),
+                   exact, transformCur);
+  return iterations;
 }
 
 void FeatureAssociation::integrateTransformation() {
@@ -1577,6 +1793,21 @@ void FeatureAssociation::adjustOutlierCloud() {
   }
 }
 
+void FeatureAssociation::holdStationaryPose() {
+  // identity motion, the next scan starts again from it
+  for (int i = 0; i < 6; ++i) transformCur[i] = 0;
+  timeScanLast = timeScanCur;
+
+  publishOdometry();
+
+  if (++cycle_count == mappingFrequencyDivider) {
+    cycle_count = 0;
+    _association_out.laser_odometry = laserOdometry;
+    _association_out.stationary = true;
+    _output_channel.exchange(_association_out);
+  }
+}
+
 void FeatureAssociation::publishOdometry() {
   geometry_msgs::Quaternion geoQuat = tf::createQuaternionMsgFromRollPitchYaw(
       transformSum[2], -transformSum[0], -transformSum[1]);
@@ -1589,6 +1820,9 @@ void FeatureAssociation::publishOdometry() {
   laserOdometry.pose.pose.position.x = transformSum[3];
   laserOdometry.pose.pose.position.y = transformSum[4];
   laserOdometry.pose.pose.position.z = transformSum[5];
+
+  // messages are serialized into new buffers
+  AllocationMonitor::Allowance allow(_allocations, "ROS publication");
   pubLaserOdometry.publish(laserOdometry);
 
   laserOdometryTrans.stamp_ = cloudHeader.stamp;
@@ -1600,16 +1834,9 @@ void FeatureAssociation::publishOdometry() {
 }
 
 void FeatureAssociation::publishCloud() {
-  sensor_msgs::PointCloud2 laserCloudOutMsg;
-
   auto Publish = [&](ros::Publisher &pub,
                      const pcl::PointCloud<PointType>::Ptr &cloud) {
-    if (pub.getNumSubscribers() != 0) {
-      pcl::toROSMsg(*cloud, laserCloudOutMsg);
-      laserCloudOutMsg.header.stamp = cloudHeader.stamp;
-      laserCloudOutMsg.header.frame_id = "/camera";
-      pub.publish(laserCloudOutMsg);
-    }
+    _publisher.publishCopy(pub, *cloud, cloudHeader.stamp, "/camera");
   };
 
   Publish(pubCornerPointsSharp, cornerPointsSharp);
@@ -1645,8 +1872,7 @@ void FeatureAssociation::publishCloudsLast() {
   laserCloudSurfLastNum = laserCloudSurfLast->points.size();
 
   if (laserCloudCornerLastNum > 10 && laserCloudSurfLastNum > 100) {
-    kdtreeCornerLast.setInputCloud(laserCloudCornerLast);
-    kdtreeSurfLast.setInputCloud(laserCloudSurfLast);
+    buildLastFeatureIndexes();
   }
 
   frameCount++;
@@ -1654,16 +1880,10 @@ void FeatureAssociation::publishCloudsLast() {
 
   if (frameCount >= skipFrameNum + 1) {
     frameCount = 0;
-    sensor_msgs::PointCloud2 cloudTemp;
 
     auto Publish = [&](ros::Publisher &pub,
                        const pcl::PointCloud<PointType>::Ptr &cloud) {
-      if (pub.getNumSubscribers() != 0) {
-        pcl::toROSMsg(*cloud, cloudTemp);
-        cloudTemp.header.stamp = cloudHeader.stamp;
-        cloudTemp.header.frame_id = "/camera";
-        pub.publish(cloudTemp);
-      }
+      _publisher.publishCopy(pub, *cloud, cloudHeader.stamp, "/camera");
     };
 
     Publish(_pub_outlier_cloudLast, outlierCloud);
@@ -1672,23 +1892,85 @@ void FeatureAssociation::publishCloudsLast() {
   }
 }
 
+void FeatureAssociation::accountMemory(const ProjectionOut &projection) {
+  _scratch_memory.set(
+      cloudBytes(segmentedCloud) + cloudBytes(outlierCloud) +
+      cloudBytes(cornerPointsSharp) + cloudBytes(cornerPointsLessSharp) +
+      cloudBytes(surfPointsFlat) + cloudBytes(surfPointsLessFlat) +
+      cloudBytes(surfPointsLessFlatScan) + cloudBytes(surfPointsLessFlatScanDS) +
+      cloudBytes(laserCloudCornerLast) + cloudBytes(laserCloudSurfLast) +
+      cloudBytes(laserCloudOri) + cloudBytes(coeffSel) +
+      cloudInfoBytes(segInfo) + vectorBytes(cloudSmoothness) +
+      vectorBytes(cloudCurvature) + vectorBytes(cloudNeighborPicked) +
+      vectorBytes(cloudLabel) + vectorBytes(pointSelCornerInd) +
+      vectorBytes(pointSearchCornerInd1) + vectorBytes(pointSearchCornerInd2) +
+      vectorBytes(pointSelSurfInd) + vectorBytes(pointSearchSurfInd1) +
+      vectorBytes(pointSearchSurfInd2) + vectorBytes(pointSearchSurfInd3));
+
+  _kdtree_memory.set(kdtreeCornerLast.usedMemory() +
+                     kdtreeSurfLast.usedMemory() +
+                     gridCornerLast.usedMemory() + gridSurfLast.usedMemory());
+
+  // buffers on their way back to ImageProjection and MapOptimization
+  _channel_memory.set(
+      cloudBytes(projection.segmented_cloud) +
+      cloudBytes(projection.outlier_cloud) +
+      cloudInfoBytes(projection.seg_msg) +
+      cloudBytes(_association_out.cloud_corner_last) +
+      cloudBytes(_association_out.cloud_surf_last) +
+      cloudBytes(_association_out.cloud_outlier_last));
+}
+
 void FeatureAssociation::runFeatureAssociation() {
+  // keeps the buffers of the previous scan, handed back to ImageProjection
+  // with the next receive
+  ProjectionOut projection;
+
   while (ros::ok()) {
-    ProjectionOut projection;
+    // a scan ends when waiting for the next one
+    _allocations.endScan();
     _input_channel.receive(projection);
 
     if( !ros::ok() ) break;
+    _allocations.beginScan();
 
     //--------------
-    std::lock_guard<std::mutex> lock(_imu_mutex);
+    const auto startTime = std::chrono::steady_clock::now();
 
-    outlierCloud = projection.outlier_cloud;
-    segmentedCloud = projection.segmented_cloud;
-    segInfo = std::move(projection.seg_msg);
+    if (_tuner.enabled()) {
+      _tuning = _tuner.profile();
+      downSizeFilter.setLeafSize(_tuning.odometryLeafSize,
+                                 _tuning.odometryLeafSize,
+                                 _tuning.odometryLeafSize);
+    }
+
+    outlierCloud.swap(projection.outlier_cloud);
+    segmentedCloud.swap(projection.segmented_cloud);
+    std::swap(segInfo, projection.seg_msg);
+    accountMemory(projection);
 
     cloudHeader = segInfo.header;
     timeScanCur = cloudHeader.stamp.toSec();
 
+    // the IMU callback only waits for the swap and the stationary check
+    bool stationary;
+    {
+      std::lock_guard<std::mutex> lock(_imu_mutex);
+      _imu_received.swap(_imu_pending);
+      stationary =
+          _stationary_detector.update(timeScanCur, *segmentedCloud, segInfo);
+    }
+    for (const ImuSample &imu : _imu_received) {
+      addImuToQueue(imu);
+    }
+    _imu_received.clear();
+
+    // nothing to do while parked, the last features stay valid for the restart
+    if (stationary && systemInitedLM) {
+      holdStationaryPose();
+      continue;
+    }
+
     /**  1. Feature Extraction  */
     adjustDistortion();
 
@@ -1703,12 +1985,52 @@ void FeatureAssociation::runFeatureAssociation() {
     // Feature Association
     if (!systemInitedLM) {
       checkSystemInitialization();
+      timeScanLast = timeScanCur;
       continue;
     }
 
     updateInitialGuess();
 
-    updateTransformation();
+    int iterations = _knn_compare ? benchmarkApproximateSearch()
+                                  : updateTransformation();
+    float rotation = sqrt(transformCur[0] * transformCur[0] +
+                          transformCur[1] * transformCur[1] +
+                          transformCur[2] * transformCur[2]);
+    lmIterationStats.add(iterations, rotation / scanPeriod > aggressiveRotationRate);
+    if (isDegenerate) degenerateScanCount++;
+    if (lmIterationStats.total() == 500) {
+      ROS_INFO("Odometry LM iterations per scan: %.2f, aggressive motion: %.2f "
+               "(%lu scans), degenerate scans: %lu, rejected correspondences: "
+               "%.1f%% corner %.1f%% surf, initial guess from %s%s",
+               lmIterationStats.mean(false), lmIterationStats.mean(true),
+               lmIterationStats.scans[1], degenerateScanCount,
+               100 * cornerRobustKernel.rejectedRatio(),
+               100 * surfRobustKernel.rejectedRatio(),
+               imuPreintegrationEnableFlag ? "IMU preintegration" : "IMU Euler integration",
+               _odometry_buffer.empty() ? "" : " and external odometry");
+      lmIterationStats.reset();
+      degenerateScanCount = 0;
+      cornerRobustKernel.resetStats();
+      surfRobustKernel.resetStats();
+
+      if (_compare_association && associationBenchmark.queries > 0) {
+        const AssociationBenchmark &b = associationBenchmark;
+        ROS_INFO("Association kd-tree vs range image: agreement %.1f%%, "
+                 "missed %.1f%%, build %.3f / %.3f ms per scan, "
+                 "query %.2f / %.2f us",
+                 100.0 * b.agreements / b.queries, 100.0 * b.misses / b.queries,
+                 b.kdtreeBuildTime * 1000 / 500, b.gridBuildTime * 1000 / 500,
+                 b.kdtreeQueryTime * 1e6 / b.queries,
+                 b.gridQueryTime * 1e6 / b.queries);
+      }
+      associationBenchmark.reset();
+
+      if (_knn_compare) {
+        knnBenchmark.report("Odometry", _knn_eps, _knn_max_leaves);
+      }
+      knnBenchmark.reset();
+    }
+    timeScanLast = timeScanCur;
 
     integrateTransformation();
 
@@ -1716,23 +2038,36 @@ void FeatureAssociation::runFeatureAssociation() {
 
     publishCloudsLast();  // cloud to mapOptimization
 
+    const double latency = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - startTime).count();
+    // comparison runs do the work twice, their latency would mislead the tuner
+    if (!_knn_compare && !_compare_association) {
+      _tuner.report(AutoTuner::ODOMETRY, latency, laserCloudOri->points.size());
+    }
+    _soak.record(SoakMonitor::ODOMETRY, latency);
+
     //--------------
     cycle_count++;
 
     if (cycle_count == mappingFrequencyDivider) {
       cycle_count = 0;
-      AssociationOut out;
-      out.cloud_corner_last.reset(new pcl::PointCloud<PointType>());
-      out.cloud_surf_last.reset(new pcl::PointCloud<PointType>());
-      out.cloud_outlier_last.reset(new pcl::PointCloud<PointType>());
+      // MapOptimization gives the clouds back once it received the next ones,
+      // they are only allocated on the first exchanges
+      AssociationOut &out = _association_out;
+      if (!out.cloud_corner_last) {
+        out.cloud_corner_last.reset(new pcl::PointCloud<PointType>());
+        out.cloud_surf_last.reset(new pcl::PointCloud<PointType>());
+        out.cloud_outlier_last.reset(new pcl::PointCloud<PointType>());
+      }
 
       *out.cloud_corner_last = *laserCloudCornerLast;
       *out.cloud_surf_last = *laserCloudSurfLast;
       *out.cloud_outlier_last = *outlierCloud;
 
       out.laser_odometry = laserOdometry;
+      out.stationary = false;
 
-      _output_channel.send(std::move(out));
+      _output_channel.exchange(out);
     }
   }
 }
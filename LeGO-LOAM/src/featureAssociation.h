@@ -3,9 +3,18 @@
 
 #include "utility.h"
 #include "channel.h"
+#include "async_publisher.h"
+#include "allocation_tracker.h"
+#include "memory_accounting.h"
+#include "soak_monitor.h"
 #include "nanoflann_pcl.h"
+#include "range_image_index.h"
+#include "odometry_buffer.h"
+#include "auto_tuner.h"
+#include "stationary_detector.h"
 #include <Eigen/Eigenvalues>
 #include <Eigen/QR>
+#include <gtsam/navigation/ImuFactor.h>
 
 class FeatureAssociation {
 
@@ -14,11 +23,16 @@ class FeatureAssociation {
                      size_t N_scan,
                      size_t horizontal_scan,
                      Channel<ProjectionOut>& input_channel,
-                     Channel<AssociationOut>& output_channel);
+                     Channel<AssociationOut>& output_channel,
+                     const OdometryBuffer& odometry_buffer,
+                     AutoTuner& tuner,
+                     AsyncPublisher& publisher,
+                     MemoryAccounting& memory,
+                     SoakMonitor& soak);
 
   ~FeatureAssociation();
 
-  void imuHandler(const sensor_msgs::Imu::ConstPtr &imuIn) ;
+  void imuHandler(const ImuSample &imu);
   void runFeatureAssociation();
 
  private:
@@ -27,13 +41,24 @@ class FeatureAssociation {
   const size_t _N_scan;
   const size_t _horizontal_scan;
 
+  // imuHandler only queues the samples, the scan thread takes them over at
+  // the start of each scan and owns everything else below
   std::mutex _imu_mutex;
+  std::vector<ImuSample> _imu_pending;
+  std::vector<ImuSample> _imu_received;
   std::thread _run_thread;
 
   Channel<ProjectionOut>& _input_channel;
   Channel<AssociationOut>& _output_channel;
-
-  ros::Subscriber subImu;
+  AsyncPublisher& _publisher;
+  AllocationMonitor _allocations;
+  MemoryGauge _scratch_memory;
+  MemoryGauge _kdtree_memory;
+  MemoryGauge _channel_memory;
+  SoakMonitor& _soak;
+  const OdometryBuffer& _odometry_buffer;
+  AutoTuner& _tuner;
+  TuningProfile _tuning;
 
   ros::Publisher pubCornerPointsSharp;
   ros::Publisher pubCornerPointsLessSharp;
@@ -94,6 +119,7 @@ class FeatureAssociation {
   float imuYaw[imuQueLength];
 
   Vector3 imuAcc[imuQueLength];
+  Vector3 imuAccRaw[imuQueLength];
   Vector3 imuVelo[imuQueLength];
   Vector3 imuShift[imuQueLength];
   Vector3 imuAngularVelo[imuQueLength];
@@ -122,6 +148,14 @@ class FeatureAssociation {
   float transformCur[6];
   float transformSum[6];
 
+  boost::shared_ptr<gtsam::PreintegrationParams> imuPreintegrationParams;
+  double timeScanLast;
+  IterationStats lmIterationStats;
+  size_t degenerateScanCount;
+
+  RobustKernel cornerRobustKernel;
+  RobustKernel surfRobustKernel;
+
   float imuRollLast, imuPitchLast, imuYawLast;
   Vector3 imuShiftFromStart;
   Vector3 imuVeloFromStart;
@@ -134,11 +168,29 @@ class FeatureAssociation {
   nanoflann::KdTreeFLANN<PointType> kdtreeCornerLast;
   nanoflann::KdTreeFLANN<PointType> kdtreeSurfLast;
 
+  // association through the range image of the last sweep (~association)
+  RangeImageIndex gridCornerLast;
+  RangeImageIndex gridSurfLast;
+  bool _range_image_association;
+  bool _compare_association;
+  AssociationBenchmark associationBenchmark;
+
+  // approximate kd-tree searches (~odometry_knn_eps, ~odometry_knn_max_leaves)
+  float _knn_eps;
+  int _knn_max_leaves;
+  bool _knn_compare;
+  ApproximateSearchBenchmark knnBenchmark;
+
+  StationaryDetector _stationary_detector;
+
   std::vector<int> pointSearchInd;
   std::vector<float> pointSearchSqDis;
 
   nav_msgs::Odometry laserOdometry;
 
+  // sent to MapOptimization, holds the clouds it gives back in between
+  AssociationOut _association_out;
+
   tf::TransformBroadcaster tfBroadcaster;
   tf::StampedTransform laserOdometryTrans;
 
@@ -153,7 +205,10 @@ class FeatureAssociation {
   void ShiftToStartIMU(float pointTime);
   void VeloToStartIMU();
   void TransformToStartIMU(PointType *p);
+  void addImuToQueue(const ImuSample &imu);
   void AccumulateIMUShiftAndRotation();
+  bool preintegrateImuRotation(Vector3 &angularFromStart);
+  bool odometryMotionGuess(float *transform);
   void adjustDistortion();
   void calculateSmoothness();
   void markOccludedPoints();
@@ -168,6 +223,9 @@ class FeatureAssociation {
   void AccumulateRotation(float cx, float cy, float cz, float lx, float ly,
                           float lz, float &ox, float &oy, float &oz);
 
+  void buildLastFeatureIndexes();
+  bool nearestLastFeature(bool corner, const PointType &point, int &index,
+                          float &sqDis);
   void findCorrespondingCornerFeatures(int iterCount);
   void findCorrespondingSurfFeatures(int iterCount);
 
@@ -177,8 +235,11 @@ class FeatureAssociation {
 
   void checkSystemInitialization();
   void updateInitialGuess();
-  void updateTransformation();
+  int updateTransformation();
+  void setApproximateSearch(bool approximate);
+  int benchmarkApproximateSearch();
 
+  void holdStationaryPose();
   void integrateTransformation();
   void publishCloud();
   void publishOdometry();
@@ -186,6 +247,8 @@ class FeatureAssociation {
   void adjustOutlierCloud();
   void publishCloudsLast();
 
+  void accountMemory(const ProjectionOut &projection);
+
 };
 
 #endif // FEATUREASSOCIATION_H
@@ -26,18 +26,75 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
-#include <boost/circular_buffer.hpp>
 #include "imageProjection.h"
 
+static const int COLUMN_UNTOUCHED = -1;
+static const int COLUMN_DONE = -2;
+
+// Range image column of a point from its azimuth, for a sensor with
+// horizon_scan evenly spaced columns
+static int azimuthToColumn(const PointType& point, size_t horizon_scan) {
+  const float resolution = 2 * M_PI / horizon_scan;
+  float horizonAngle = std::atan2(point.x, point.y);
+  int columnIdn = -round((horizonAngle - M_PI_2) / resolution) + horizon_scan * 0.5;
+  if (columnIdn >= int(horizon_scan)) columnIdn -= horizon_scan;
+  if (columnIdn < 0) columnIdn += horizon_scan;
+  return columnIdn;
+}
+
+static bool isValidReturn(const PointType& point) {
+  return pcl::isFinite(point) &&
+         point.x * point.x + point.y * point.y + point.z * point.z >= 0.01;
+}
+
 ImageProjection::ImageProjection(ros::NodeHandle& nh,
                                  size_t N_scan,
                                  size_t horizontal_scan,
-                                 Channel<ProjectionOut>& output_channel)
+                                 Channel<ProjectionOut>& output_channel,
+                                 AsyncPublisher& publisher,
+                                 MemoryAccounting& memory,
+                                 SoakMonitor& soak,
+                                 RangeImageRecorder& recorder)
     : _nh(nh), _N_scan(N_scan), _horizon_scan(horizontal_scan),
-      _output_channel(output_channel)
+      _output_channel(output_channel),
+      _publisher(publisher),
+      _allocations("ImageProjection", true),
+      _scratch_memory(memory, MemoryAccounting::SCRATCH),
+      _channel_memory(memory, MemoryAccounting::CHANNELS),
+      _soak(soak),
+      _recorder(recorder),
+      _velodyne_decoder(N_scan == 32 ? VelodyneDecoder::HDL32E
+                                     : VelodyneDecoder::VLP16,
+                        horizontal_scan)
 {
+  // in sector streaming mode the driver publishes partial sweeps
+  _sector_streaming = false;
+  _nh.getParam("sector_streaming", _sector_streaming);
+
   _sub_laser_cloud = nh.subscribe<sensor_msgs::PointCloud2>(
-      pointCloudTopic, 1, &ImageProjection::cloudHandler, this);
+      pointCloudTopic, _sector_streaming ? 100 : 1,
+      &ImageProjection::cloudHandler, this);
+
+  // raw packets (velodyne_msgs/VelodyneScan) instead of the driver's cloud
+  std::string packet_topic;
+  _nh.getParam("packet_topic", packet_topic);
+  if (!packet_topic.empty()) {
+    _sub_laser_packets = nh.subscribe<velodyne_msgs::VelodyneScan>(
+        packet_topic, 1, &ImageProjection::packetHandler, this);
+  }
+
+  std::vector<double> vertical_angles, rotation_corrections;
+  if (_nh.getParam("laser_vertical_angles", vertical_angles)) {
+    _nh.getParam("laser_rotation_corrections", rotation_corrections);
+    if (rotation_corrections.empty()) {
+      rotation_corrections.assign(vertical_angles.size(), 0.0);
+    }
+    if (!_velodyne_decoder.setCalibration(vertical_angles,
+                                          rotation_corrections)) {
+      ROS_ERROR("Invalid laser calibration, %lu lasers expected",
+                _velodyne_decoder.lasers());
+    }
+  }
 
   _pub_full_cloud =
       nh.advertise<sensor_msgs::PointCloud2>("/full_cloud_projected", 1);
@@ -67,9 +124,27 @@ ImageProjection::ImageProjection(ros::NodeHandle& nh,
   _full_cloud->points.resize(cloud_size);
   _full_info_cloud->points.resize(cloud_size);
 
+  _component_queue.set_capacity(cloud_size);
+  _component_pushed.set_capacity(cloud_size);
+
+  _sweep_started = false;
+  _sector_count = 0;
+  _column_sector.assign(_horizon_scan, COLUMN_UNTOUCHED);
+
+  _organized_flip_rows = false;
+  _organized_column_sign = 0;
+  _organized_column_table.assign(cloud_size, -1);
+  _organized_row_calibrated.assign(_N_scan, false);
+  _organized_rows_calibrated = 0;
+  _organized_calibration_clouds = 0;
+  _organized_votes.resize(_horizon_scan);
 }
 
 void ImageProjection::resetParameters() {
+  // every scan (or sweep of sectors) starts here
+  _allocations.beginScan();
+  _scan_start = std::chrono::steady_clock::now();
+
   const size_t cloud_size = _N_scan * _horizon_scan;
   PointType nanPoint;
   nanPoint.x = std::numeric_limits<float>::quiet_NaN();
@@ -83,10 +158,12 @@ void ImageProjection::resetParameters() {
   _outlier_cloud->clear();
 
   _range_mat.resize(_N_scan, _horizon_scan);
+  _intensity_mat.resize(_N_scan, _horizon_scan);
   _ground_mat.resize(_N_scan, _horizon_scan);
   _label_mat.resize(_N_scan, _horizon_scan);
 
   _range_mat.fill(FLT_MAX);
+  _intensity_mat.setZero();
   _ground_mat.setZero();
   _label_mat.setZero();
 
@@ -102,20 +179,66 @@ void ImageProjection::resetParameters() {
   _seg_msg.segmentedCloudGroundFlag.assign(cloud_size, false);
   _seg_msg.segmentedCloudColInd.assign(cloud_size, 0);
   _seg_msg.segmentedCloudRange.assign(cloud_size, 0);
+
+  _sector_count = 0;
+  std::fill(_column_sector.begin(), _column_sector.end(), COLUMN_UNTOUCHED);
+  _previous_sector_columns.clear();
+  _current_sector_columns.clear();
 }
 
 void ImageProjection::cloudHandler(
     const sensor_msgs::PointCloud2ConstPtr& laserCloudMsg) {
+  if (_sector_streaming) {
+    sectorHandler(laserCloudMsg);
+    return;
+  }
+
   // Reset parameters
   resetParameters();
 
+  if (isOrganized(*laserCloudMsg)) {
+    readCloudMsg(*laserCloudMsg);
+    _seg_msg.header = laserCloudMsg->header;
+    if (!projectOrganizedCloud()) return;
+    groundRemoval();
+    cloudSegmentation();
+    publishClouds();
+    return;
+  }
+
   // Copy and remove NAN points
-  pcl::fromROSMsg(*laserCloudMsg, *_laser_cloud_in);
-  std::vector<int> indices;
-  pcl::removeNaNFromPointCloud(*_laser_cloud_in, *_laser_cloud_in, indices);
+  readCloudMsg(*laserCloudMsg);
+  pcl::removeNaNFromPointCloud(*_laser_cloud_in, *_laser_cloud_in,
+                               _nan_indices);
+  if (_laser_cloud_in->points.empty()) return;
   _seg_msg.header = laserCloudMsg->header;
 
-  findStartEndAngle();
+  processCloud();
+}
+
+void ImageProjection::readCloudMsg(const sensor_msgs::PointCloud2& msg) {
+  // the field mapping is built again on every conversion
+  AllocationMonitor::Allowance allow(_allocations, "pcl::fromROSMsg");
+  pcl::fromROSMsg(msg, *_laser_cloud_in);
+}
+
+void ImageProjection::datasetHandler(pcl::PointCloud<PointType>::Ptr &cloud,
+                                     const std_msgs::Header &header) {
+  resetParameters();
+
+  // take the scan over instead of copying it, the caller gets the old buffer
+  _laser_cloud_in.swap(cloud);
+  pcl::removeNaNFromPointCloud(*_laser_cloud_in, *_laser_cloud_in,
+                               _nan_indices);
+  if (_laser_cloud_in->points.empty()) return;
+  _seg_msg.header = header;
+
+  processCloud();
+}
+
+void ImageProjection::processCloud() {
+  findStartEndAngle(_laser_cloud_in->points.front(),
+                    _laser_cloud_in->points.back());
   // Range image projection
   projectPointCloud();
   // Mark ground points
@@ -126,6 +249,114 @@ void ImageProjection::cloudHandler(
   publishClouds();
 }
 
+void ImageProjection::packetHandler(
+    const velodyne_msgs::VelodyneScan::ConstPtr& scanMsg) {
+  _velodyne_returns.clear();
+  for (const auto& packet : scanMsg->packets) {
+    _velodyne_decoder.decodePacket(packet, _velodyne_returns);
+  }
+  if (_velodyne_returns.empty()) return;
+
+  resetParameters();
+
+  // the sweep is stamped with its first firing
+  _seg_msg.header = scanMsg->header;
+  _seg_msg.header.stamp.fromSec(_velodyne_returns.front().time);
+
+  for (const VelodyneReturn& ret : _velodyne_returns) {
+    if (ret.row >= _N_scan) continue;
+    _range_mat(ret.row, ret.column) = ret.range;
+    _intensity_mat(ret.row, ret.column) = ret.point.intensity;
+
+    PointType thisPoint = ret.point;
+    thisPoint.intensity = (float)ret.row + (float)ret.column / 10000.0;
+
+    size_t index = ret.column + ret.row * _horizon_scan;
+    _full_cloud->points[index] = thisPoint;
+    // the corresponding range of a point is saved as "intensity"
+    _full_info_cloud->points[index] = thisPoint;
+    _full_info_cloud->points[index].intensity = ret.range;
+  }
+
+  findStartEndAngle(_velodyne_returns.front().point,
+                    _velodyne_returns.back().point);
+  groundRemoval();
+  cloudSegmentation();
+  publishClouds();
+}
+
+void ImageProjection::sectorHandler(
+    const sensor_msgs::PointCloud2ConstPtr& sectorMsg) {
+  // a sweep that never completed (dropped packets) is flushed as it is
+  if (_sweep_started &&
+      sectorMsg->header.stamp.toSec() - _sweep_start_time > 1.5 * scanPeriod) {
+    finishSweep();
+  }
+
+  if (!_sweep_started) {
+    resetParameters();
+  } else {
+    _laser_cloud_in->clear();
+  }
+
+  readCloudMsg(*sectorMsg);
+  pcl::removeNaNFromPointCloud(*_laser_cloud_in, *_laser_cloud_in,
+                               _nan_indices);
+  if (_laser_cloud_in->points.empty()) return;
+
+  const PointType& first = _laser_cloud_in->points.front();
+  const PointType& last = _laser_cloud_in->points.back();
+  const float lastOrientation = -std::atan2(last.y, last.x);
+
+  if (!_sweep_started) {
+    _sweep_started = true;
+    _seg_msg.header = sectorMsg->header;
+    _sweep_start_time = sectorMsg->header.stamp.toSec();
+    _sweep_first_point = first;
+    _sweep_angle = 0;
+    _sweep_last_orientation = -std::atan2(first.y, first.x);
+  }
+  float delta = lastOrientation - _sweep_last_orientation;
+  while (delta < 0) delta += 2 * M_PI;
+  while (delta >= 2 * M_PI) delta -= 2 * M_PI;
+  _sweep_angle += delta;
+  _sweep_last_orientation = lastOrientation;
+  _sweep_last_point = last;
+
+  projectPointCloud();
+
+  // columns left behind by the rotation are final: mark their ground points
+  for (int col : _previous_sector_columns) {
+    if (_column_sector[col] == _sector_count - 1) {
+      markGroundColumn(col);
+      extractGroundColumn(col);
+      _column_sector[col] = COLUMN_DONE;
+    }
+  }
+  std::swap(_previous_sector_columns, _current_sector_columns);
+  _current_sector_columns.clear();
+  _sector_count++;
+
+  if (_sweep_angle >= 2 * M_PI - 2 * ang_res_x) {
+    finishSweep();
+  }
+}
+
+void ImageProjection::finishSweep() {
+  _sweep_started = false;
+
+  for (size_t col = 0; col < _horizon_scan; ++col) {
+    if (_column_sector[col] != COLUMN_DONE) {
+      markGroundColumn(col);
+      extractGroundColumn(col);
+    }
+  }
+
+  findStartEndAngle(_sweep_first_point, _sweep_last_point);
+  cloudSegmentation();
+  publishClouds();
+}
+
 
 void ImageProjection::projectPointCloud() {
   // range image projection
@@ -164,6 +395,13 @@ void ImageProjection::projectPointCloud() {
     }
 
     _range_mat(rowIdn, columnIdn) = range;
+    _intensity_mat(rowIdn, columnIdn) = thisPoint.intensity;
+
+    if (_sector_streaming && _column_sector[columnIdn] != _sector_count &&
+        _column_sector[columnIdn] != COLUMN_DONE) {
+      _column_sector[columnIdn] = _sector_count;
+      _current_sector_columns.push_back(columnIdn);
+    }
 
     thisPoint.intensity = (float)rowIdn + (float)columnIdn / 10000.0;
 
@@ -175,13 +413,165 @@ void ImageProjection::projectPointCloud() {
   }
 }
 
-void ImageProjection::findStartEndAngle() {
+bool ImageProjection::isOrganized(const sensor_msgs::PointCloud2& msg) const {
+  return msg.height == _N_scan && msg.width == _horizon_scan;
+}
+
+void ImageProjection::calibrateOrganizedLayout() {
+  const auto& points = _laser_cloud_in->points;
+
+  if (_organized_column_sign == 0) {
+    // rows are stored bottom-up in the range image
+    float firstRowZ = 0, lastRowZ = 0;
+    int firstRowCount = 0, lastRowCount = 0;
+    for (size_t col = 0; col < _horizon_scan; ++col) {
+      const PointType& low = points[col];
+      const PointType& high = points[col + (_N_scan - 1) * _horizon_scan];
+      if (isValidReturn(low)) {
+        firstRowZ += low.z / sqrt(low.x * low.x + low.y * low.y + low.z * low.z);
+        firstRowCount++;
+      }
+      if (isValidReturn(high)) {
+        lastRowZ += high.z / sqrt(high.x * high.x + high.y * high.y + high.z * high.z);
+        lastRowCount++;
+      }
+    }
+    if (firstRowCount == 0 || lastRowCount == 0) return;
+    _organized_flip_rows = firstRowZ / firstRowCount > lastRowZ / lastRowCount;
+
+    // direction of the columns with respect to the azimuth, voted by all the
+    // pairs of valid points a few columns apart
+    const int step = _horizon_scan / 8;
+    int increasing = 0, decreasing = 0;
+    for (size_t i = 0; i < points.size(); ++i) {
+      const size_t col = i % _horizon_scan;
+      if (col + step >= _horizon_scan) continue;
+      const PointType& a = points[i];
+      const PointType& b = points[i + step];
+      if (!isValidReturn(a) || !isValidReturn(b)) continue;
+      int diff = azimuthToColumn(b, _horizon_scan) - azimuthToColumn(a, _horizon_scan);
+      if (diff < 0) diff += _horizon_scan;
+      if (diff < int(_horizon_scan / 2)) {
+        increasing++;
+      } else {
+        decreasing++;
+      }
+    }
+    const int pairs = increasing + decreasing;
+    if (pairs < organizedLayoutMinPoints) return;
+    if (increasing >= organizedLayoutAgreement * pairs) {
+      _organized_column_sign = 1;
+    } else if (decreasing >= organizedLayoutAgreement * pairs) {
+      _organized_column_sign = -1;
+    } else {
+      return;
+    }
+  }
+
+  // per row column offset, this absorbs the stagger between rings. Each valid
+  // point votes for an offset, a point or two off by one column (rounding of
+  // the azimuth, noise) do not change the majority.
+  std::vector<int>& votes = _organized_votes;
+  for (size_t row = 0; row < _N_scan; ++row) {
+    if (_organized_row_calibrated[row]) continue;
+    std::fill(votes.begin(), votes.end(), 0);
+    int valid = 0;
+    for (size_t col = 0; col < _horizon_scan; ++col) {
+      const PointType& point = points[col + row * _horizon_scan];
+      if (!isValidReturn(point)) continue;
+      int offset = (azimuthToColumn(point, _horizon_scan) -
+                    _organized_column_sign * int(col)) % int(_horizon_scan);
+      if (offset < 0) offset += _horizon_scan;
+      votes[offset]++;
+      valid++;
+    }
+    if (valid < organizedLayoutMinPoints) continue;
+
+    // votes of the neighbouring offsets count as agreeing
+    int offset = 0, agreeing = 0;
+    for (size_t o = 0; o < _horizon_scan; ++o) {
+      const int around = votes[(o + _horizon_scan - 1) % _horizon_scan] +
+                         votes[o] + votes[(o + 1) % _horizon_scan];
+      if (around > agreeing || (around == agreeing && votes[o] > votes[offset])) {
+        offset = o;
+        agreeing = around;
+      }
+    }
+    if (agreeing < organizedLayoutAgreement * valid) {
+      ROS_WARN_THROTTLE(10, "Organized cloud row %lu: no clear column offset "
+                        "(%d of %d points), calibration retried on the next cloud",
+                        row, agreeing, valid);
+      continue;
+    }
+
+    int* table = &_organized_column_table[row * _horizon_scan];
+    for (size_t c = 0; c < _horizon_scan; ++c) {
+      int imageCol = (_organized_column_sign * int(c) + offset) % int(_horizon_scan);
+      if (imageCol < 0) imageCol += _horizon_scan;
+      table[c] = imageCol;
+    }
+    _organized_row_calibrated[row] = true;
+    _organized_rows_calibrated++;
+  }
+}
+
+bool ImageProjection::projectOrganizedCloud() {
+  // rows that never get a clear vote (a top ring seeing mostly sky) are tried
+  // again at a low rate
+  if (_organized_rows_calibrated < _N_scan &&
+      (_organized_calibration_clouds < organizedLayoutAttempts ||
+       _organized_calibration_clouds % organizedLayoutRetryScans == 0)) {
+    calibrateOrganizedLayout();
+  }
+  if (_organized_rows_calibrated < _N_scan) _organized_calibration_clouds++;
+
+  const auto& points = _laser_cloud_in->points;
+  int first = -1, last = -1;
+
+  for (size_t row = 0; row < _N_scan; ++row) {
+    const bool calibrated = _organized_row_calibrated[row];
+    const size_t rowIdn = _organized_flip_rows ? _N_scan - 1 - row : row;
+    const PointType* src = &points[row * _horizon_scan];
+    const int* table = &_organized_column_table[row * _horizon_scan];
+
+    for (size_t col = 0; col < _horizon_scan; ++col) {
+      PointType thisPoint = src[col];
+      if (!pcl::isFinite(thisPoint)) continue;
+
+      float range = sqrt(thisPoint.x * thisPoint.x +
+                         thisPoint.y * thisPoint.y +
+                         thisPoint.z * thisPoint.z);
+      if (range < 0.1) continue;
+
+      if (first < 0) first = row * _horizon_scan + col;
+      last = row * _horizon_scan + col;
+
+      const size_t columnIdn =
+          calibrated ? table[col] : azimuthToColumn(thisPoint, _horizon_scan);
+      _range_mat(rowIdn, columnIdn) = range;
+      _intensity_mat(rowIdn, columnIdn) = thisPoint.intensity;
+
+      thisPoint.intensity = (float)rowIdn + (float)columnIdn / 10000.0;
+
+      size_t index = columnIdn + rowIdn * _horizon_scan;
+      _full_cloud->points[index] = thisPoint;
+      // the corresponding range of a point is saved as "intensity"
+      _full_info_cloud->points[index] = thisPoint;
+      _full_info_cloud->points[index].intensity = range;
+    }
+  }
+
+  if (first < 0) return false;
+  findStartEndAngle(points[first], points[last]);
+  return true;
+}
+
+void ImageProjection::findStartEndAngle(const PointType& first,
+                                        const PointType& last) {
   // start and end orientation of this cloud
-  auto point = _laser_cloud_in->points.front();
-  _seg_msg.startOrientation = -std::atan2(point.y, point.x);
+  _seg_msg.startOrientation = -std::atan2(first.y, first.x);
 
-  point = _laser_cloud_in->points.back();
-  _seg_msg.endOrientation = -std::atan2(point.y, point.x) + 2 * M_PI;
+  _seg_msg.endOrientation = -std::atan2(last.y, last.x) + 2 * M_PI;
 
   if (_seg_msg.endOrientation - _seg_msg.startOrientation > 3 * M_PI) {
     _seg_msg.endOrientation -= 2 * M_PI;
@@ -193,57 +583,66 @@ void ImageProjection::findStartEndAngle() {
 }
 
 void ImageProjection::groundRemoval() {
+  for (size_t j = 0; j < _horizon_scan; ++j) {
+    markGroundColumn(j);
+  }
+
+  for (size_t i = 0; i <= groundScanInd; ++i) {
+    for (size_t j = 0; j < _horizon_scan; ++j) {
+      if (_ground_mat(i, j) == 1)
+        _ground_cloud->push_back(_full_cloud->points[j + i * _horizon_scan]);
+    }
+  }
+}
+
+void ImageProjection::markGroundColumn(size_t j) {
   // _ground_mat
   // -1, no valid info to check if ground of not
   //  0, initial value, after validation, means not ground
   //  1, ground
-  for (size_t j = 0; j < _horizon_scan; ++j) {
-    for (size_t i = 0; i < groundScanInd; ++i) {
-      size_t lowerInd = j + (i)*_horizon_scan;
-      size_t upperInd = j + (i + 1) * _horizon_scan;
-
-      if (_full_cloud->points[lowerInd].intensity == -1 ||
-          _full_cloud->points[upperInd].intensity == -1) {
-        // no info to check, invalid points
-        _ground_mat(i, j) = -1;
-        continue;
-      }
+  for (size_t i = 0; i < groundScanInd; ++i) {
+    size_t lowerInd = j + (i)*_horizon_scan;
+    size_t upperInd = j + (i + 1) * _horizon_scan;
+
+    if (_full_cloud->points[lowerInd].intensity == -1 ||
+        _full_cloud->points[upperInd].intensity == -1) {
+      // no info to check, invalid points
+      _ground_mat(i, j) = -1;
+      continue;
+    }
 
-      float dX =
-          _full_cloud->points[upperInd].x - _full_cloud->points[lowerInd].x;
-      float dY =
-          _full_cloud->points[upperInd].y - _full_cloud->points[lowerInd].y;
-      float dZ =
-          _full_cloud->points[upperInd].z - _full_cloud->points[lowerInd].z;
+    float dX =
+        _full_cloud->points[upperInd].x - _full_cloud->points[lowerInd].x;
+    float dY =
+        _full_cloud->points[upperInd].y - _full_cloud->points[lowerInd].y;
+    float dZ =
+        _full_cloud->points[upperInd].z - _full_cloud->points[lowerInd].z;
 
-      float vertical_angle = std::atan2(dZ , sqrt(dX * dX + dY * dY + dZ * dZ));
+    float vertical_angle = std::atan2(dZ , sqrt(dX * dX + dY * dY + dZ * dZ));
 
-      // TODO: review this change
+    // TODO: review this change
 
-      if ( (vertical_angle - sensorMountAngle) <= 10 * DEG_TO_RAD) {
-        _ground_mat(i, j) = 1;
-        _ground_mat(i + 1, j) = 1;
-      }
+    if ( (vertical_angle - sensorMountAngle) <= 10 * DEG_TO_RAD) {
+      _ground_mat(i, j) = 1;
+      _ground_mat(i + 1, j) = 1;
     }
   }
-  // extract ground cloud (_ground_mat == 1)
   // mark entry that doesn't need to label (ground and invalid point) for
   // segmentation note that ground remove is from 0~_N_scan-1, need _range_mat
   // for mark label matrix for the 16th scan
   for (size_t i = 0; i < _N_scan; ++i) {
-    for (size_t j = 0; j < _horizon_scan; ++j) {
-      if (_ground_mat(i, j) == 1 ||
-          _range_mat(i, j) == FLT_MAX) {
-        _label_mat(i, j) = -1;
-      }
+    if (_ground_mat(i, j) == 1 ||
+        _range_mat(i, j) == FLT_MAX) {
+      _label_mat(i, j) = -1;
     }
   }
+}
 
+void ImageProjection::extractGroundColumn(size_t j) {
+  // extract ground cloud (_ground_mat == 1)
   for (size_t i = 0; i <= groundScanInd; ++i) {
-    for (size_t j = 0; j < _horizon_scan; ++j) {
-      if (_ground_mat(i, j) == 1)
-        _ground_cloud->push_back(_full_cloud->points[j + i * _horizon_scan]);
-    }
+    if (_ground_mat(i, j) == 1)
+      _ground_cloud->push_back(_full_cloud->points[j + i * _horizon_scan]);
   }
 }
 
@@ -310,11 +709,13 @@ void ImageProjection::labelComponents(int row, int col) {
 
   const float segmentThetaThreshold = tan(segmentTheta);
 
-  std::vector<bool> lineCountFlag(_N_scan, false);
-  const size_t cloud_size = _N_scan * _horizon_scan;
+  std::vector<bool>& lineCountFlag = _line_count_flag;
+  lineCountFlag.assign(_N_scan, false);
   using Coord2D = Eigen::Vector2i;
-  boost::circular_buffer<Coord2D> queue(cloud_size);
-  boost::circular_buffer<Coord2D> all_pushed(cloud_size);
+  boost::circular_buffer<Coord2D>& queue = _component_queue;
+  boost::circular_buffer<Coord2D>& all_pushed = _component_pushed;
+  queue.clear();
+  all_pushed.clear();
 
   queue.push_back({ row,col } );
   all_pushed.push_back({ row,col } );
@@ -395,16 +796,10 @@ void ImageProjection::labelComponents(int row, int col) {
 void ImageProjection::publishClouds() {
   const auto& cloudHeader = _seg_msg.header;
 
-  sensor_msgs::PointCloud2 laserCloudTemp;
-
+  // the buffers are reused for the next scan, or modified by FeatureAssociation
   auto PublishCloud = [&](ros::Publisher& pub,
                           const pcl::PointCloud<PointType>::Ptr& cloud) {
-    if (pub.getNumSubscribers() != 0) {
-      pcl::toROSMsg(*cloud, laserCloudTemp);
-      laserCloudTemp.header.stamp = cloudHeader.stamp;
-      laserCloudTemp.header.frame_id = "base_link";
-      pub.publish(laserCloudTemp);
-    }
+    _publisher.publishCopy(pub, *cloud, cloudHeader.stamp, "base_link");
   };
 
   PublishCloud(_pub_outlier_cloud, _outlier_cloud);
@@ -415,20 +810,56 @@ void ImageProjection::publishClouds() {
   PublishCloud(_pub_full_info_cloud, _full_info_cloud);
 
   if (_pub_segmented_cloud_info.getNumSubscribers() != 0) {
+    // serialized into a new buffer
+    AllocationMonitor::Allowance allow(_allocations, "ROS publication");
     _pub_segmented_cloud_info.publish(_seg_msg);
   }
 
+  _soak.record(SoakMonitor::PROJECTION,
+               std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - _scan_start).count());
+  const double scanTime = cloudHeader.stamp.toSec();
+
   //--------------------
-  ProjectionOut out;
-  out.outlier_cloud.reset(new pcl::PointCloud<PointType>());
-  out.segmented_cloud.reset(new pcl::PointCloud<PointType>());
+  // the buffers FeatureAssociation released come back through the channel and
+  // are used for the next scan
+  std::swap(_projection_out.seg_msg, _seg_msg);
+  std::swap(_projection_out.outlier_cloud, _outlier_cloud);
+  std::swap(_projection_out.segmented_cloud, _segmented_cloud);
+
+  _output_channel.exchange(_projection_out);
+  // the range image and the full cloud are left untouched by the exchange
+  {
+    AllocationMonitor::Allowance allow(_allocations, "range image log queue");
+    _recorder.recordScan(scanTime, _range_mat, _intensity_mat, *_full_cloud);
+  }
+  _allocations.endScan();
 
-  std::swap( out.seg_msg, _seg_msg);
-  std::swap(out.outlier_cloud, _outlier_cloud);
-  std::swap(out.segmented_cloud, _segmented_cloud);
+  if (!_outlier_cloud) _outlier_cloud.reset(new pcl::PointCloud<PointType>());
+  if (!_segmented_cloud) {
+    _segmented_cloud.reset(new pcl::PointCloud<PointType>());
+  }
 
-  _output_channel.send( std::move(out) );
+  accountMemory();
+}
 
+void ImageProjection::accountMemory() {
+  _scratch_memory.set(
+      cloudBytes(_laser_cloud_in) + cloudBytes(_full_cloud) +
+      cloudBytes(_full_info_cloud) + cloudBytes(_ground_cloud) +
+      cloudBytes(_segmented_cloud) + cloudBytes(_segmented_cloud_pure) +
+      cloudBytes(_outlier_cloud) + cloudInfoBytes(_seg_msg) +
+      (_range_mat.size() + _intensity_mat.size()) * sizeof(float) +
+      _label_mat.size() * sizeof(int) +
+      _ground_mat.size() * sizeof(int8_t) + vectorBytes(_nan_indices) +
+      (_component_queue.capacity() + _component_pushed.capacity()) *
+          sizeof(Eigen::Vector2i) +
+      vectorBytes(_velodyne_returns) + vectorBytes(_organized_column_table));
+
+  // what the channel gave back, kept for the next scan
+  _channel_memory.set(cloudBytes(_projection_out.segmented_cloud) +
+                      cloudBytes(_projection_out.outlier_cloud) +
+                      cloudInfoBytes(_projection_out.seg_msg));
 }
 
 
@@ -3,7 +3,14 @@
 
 #include "utility.h"
 #include "channel.h"
+#include "async_publisher.h"
+#include "allocation_tracker.h"
+#include "memory_accounting.h"
+#include "soak_monitor.h"
+#include "velodyneDecoder.h"
+#include "rangeImageRecorder.h"
 #include <Eigen/QR>
+#include <boost/circular_buffer.hpp>
 
 class ImageProjection {
  public:
@@ -11,20 +18,39 @@ class ImageProjection {
   ImageProjection(ros::NodeHandle& nh,
                   size_t N_scan,
                   size_t horizontal_scan,
-                  Channel<ProjectionOut>& output_channel);
+                  Channel<ProjectionOut>& output_channel,
+                  AsyncPublisher& publisher,
+                  MemoryAccounting& memory,
+                  SoakMonitor& soak,
+                  RangeImageRecorder& recorder);
 
   ~ImageProjection() = default;
 
   void cloudHandler(const sensor_msgs::PointCloud2ConstPtr &laserCloudMsg);
+  void packetHandler(const velodyne_msgs::VelodyneScan::ConstPtr &scanMsg);
+  // Scans read directly from a dataset, see DatasetReader
+  void datasetHandler(pcl::PointCloud<PointType>::Ptr &cloud,
+                      const std_msgs::Header &header);
 
  private:
-  void findStartEndAngle();
+  void sectorHandler(const sensor_msgs::PointCloud2ConstPtr &sectorMsg);
+  void finishSweep();
+  void processCloud();
+  void readCloudMsg(const sensor_msgs::PointCloud2 &msg);
+
+  void findStartEndAngle(const PointType &first, const PointType &last);
   void resetParameters();
   void projectPointCloud();
+  bool isOrganized(const sensor_msgs::PointCloud2 &msg) const;
+  void calibrateOrganizedLayout();
+  bool projectOrganizedCloud();
   void groundRemoval();
+  void markGroundColumn(size_t col);
+  void extractGroundColumn(size_t col);
   void cloudSegmentation();
   void labelComponents(int row, int col);
   void publishClouds();
+  void accountMemory();
 
   pcl::PointCloud<PointType>::Ptr _laser_cloud_in;
 
@@ -36,12 +62,23 @@ class ImageProjection {
   pcl::PointCloud<PointType>::Ptr _segmented_cloud_pure;
   pcl::PointCloud<PointType>::Ptr _outlier_cloud;
 
+  // sent to FeatureAssociation, holds the buffers it gives back in between
+  ProjectionOut _projection_out;
+
   ros::NodeHandle& _nh;
   const size_t _N_scan;
   const size_t _horizon_scan;
   Channel<ProjectionOut>& _output_channel;
+  AsyncPublisher& _publisher;
+  AllocationMonitor _allocations;
+  MemoryGauge _scratch_memory;
+  MemoryGauge _channel_memory;
+  SoakMonitor& _soak;
+  RangeImageRecorder& _recorder;
+  std::chrono::steady_clock::time_point _scan_start;
 
   ros::Subscriber _sub_laser_cloud;
+  ros::Subscriber _sub_laser_packets;
 
   ros::Publisher _pub_full_cloud;
   ros::Publisher _pub_full_info_cloud;
@@ -57,9 +94,46 @@ class ImageProjection {
   int _label_count;
 
   Eigen::MatrixXf _range_mat;   // range matrix for range image
+  Eigen::MatrixXf _intensity_mat;   // sensor intensity, for the range image log
   Eigen::MatrixXi _label_mat;   // label matrix for segmentaiton marking
   Eigen::Matrix<int8_t,Eigen::Dynamic,Eigen::Dynamic> _ground_mat;  // ground matrix for ground cloud marking
 
+  // scratch buffers, kept from one scan to the next
+  std::vector<int> _nan_indices;
+  std::vector<bool> _line_count_flag;
+  boost::circular_buffer<Eigen::Vector2i> _component_queue;
+  boost::circular_buffer<Eigen::Vector2i> _component_pushed;
+
+  // Raw packet input
+  VelodyneDecoder _velodyne_decoder;
+  std::vector<VelodyneReturn> _velodyne_returns;
+
+  // Sector streaming: the sweep arrives in several azimuth sectors. Each sector
+  // is projected on arrival, and every column that the following sector did not
+  // touch any more is ground-marked right away. Segmentation runs once the
+  // sweep is complete.
+  bool _sector_streaming;
+  bool _sweep_started;
+  int _sector_count;
+  double _sweep_start_time;
+  float _sweep_last_orientation;
+  float _sweep_angle;   // azimuth covered so far
+  PointType _sweep_first_point;
+  PointType _sweep_last_point;
+  std::vector<int> _column_sector;    // last sector that touched a column
+  std::vector<int> _previous_sector_columns;
+  std::vector<int> _current_sector_columns;
+
+  // Organized input (height == rings, width == columns) is decoded by direct
+  // indexing. The layout (row order, column direction and per row column
+  // stagger) is measured once on the first clouds and kept in a table.
+  bool _organized_flip_rows;
+  int _organized_column_sign;   // 0 until measured
+  std::vector<int> _organized_column_table;  // (row, column) -> range image column, -1 if unknown
+  std::vector<bool> _organized_row_calibrated;
+  size_t _organized_rows_calibrated;
+  size_t _organized_calibration_clouds;  // clouds calibration was tried on
+  std::vector<int> _organized_votes;     // column offset votes of a row
 
 };
 
@@ -2,11 +2,13 @@
 #include "imageProjection.h"
 #include "mapOptimization.h"
 #include "transformFusion.h"
+#include "datasetReader.h"
 #include <chrono>
 
 #include <rosbag/bag.h>
 #include <rosbag/view.h>
 #include <rosgraph_msgs/Clock.h>
+#include <ros/callback_queue.h>
 
 int main(int argc, char** argv) {
   ros::init(argc, argv, "lego_loam");
@@ -15,10 +17,35 @@ int main(int argc, char** argv) {
   std::string rosbag;
   std::string imu_topic = pointCloudTopic;
   std::string lidar_topic = imuTopic;
+  std::string odom_topic;
+  std::string packet_topic;
+  std::string pcap;
+  std::string dataset;
 
   nh.getParam("rosbag", rosbag);
+  nh.getParam("pcap", pcap);
+  nh.getParam("dataset", dataset);
+  nh.getParam("packet_topic", packet_topic);
   nh.getParam("imu_topic", imu_topic);
   nh.getParam("lidar_topic", lidar_topic);
+  nh.getParam("odom_topic", odom_topic);
+
+  AutoTuner tuner;
+  {
+    bool auto_tune = false;
+    double odometry_latency = 0.05;
+    double mapping_latency = 0.3;
+    nh.getParam("auto_tune", auto_tune);
+    nh.getParam("auto_tune_odometry_latency", odometry_latency);
+    nh.getParam("auto_tune_mapping_latency", mapping_latency);
+    tuner.configure(auto_tune, odometry_latency, mapping_latency);
+
+    TuningProfile profile;
+    profile.load(nh);
+    tuner.setProfile(profile);
+  }
+  std::string tuning_profile_out;
+  nh.getParam("tuning_profile_out", tuning_profile_out);
 
   bool use_rosbag = false;
 
@@ -34,23 +61,201 @@ int main(int argc, char** argv) {
     }
   }
 
+  // raw Velodyne packets recorded with tcpdump / wireshark
+  bool use_pcap = false;
+  VelodynePcapReader pcap_reader;
+
+  if (!pcap.empty() && !use_rosbag) {
+    if (!pcap_reader.open(pcap)) {
+      ROS_FATAL("Unable to open pcap [%s]", pcap.c_str());
+      return 1;
+    }
+    use_pcap = true;
+  }
+
+  // KITTI velodyne directory, raw scan file or range image log
+  bool use_dataset = false;
+  DatasetReader dataset_reader;
+
+  // memory ceiling in MB, 0 disables spilling
+  int memory_ceiling = 0;
+  nh.getParam("memory_ceiling", memory_ceiling);
+  MemoryAccounting memory;
+  memory.configure(size_t(std::max(memory_ceiling, 0)) * 1024 * 1024);
+
+  // soak test: the dataset is replayed back and forth for soak_hours of
+  // simulated time, the exit status tells whether the growth stayed bounded
+  SoakMonitor soak(memory);
+  {
+    double soak_hours = 0;
+    double sample_period = 3600;
+    double max_latency_growth = 5.0;
+    double max_memory_growth = 100.0;
+    nh.getParam("soak_hours", soak_hours);
+    nh.getParam("soak_sample_period", sample_period);
+    nh.getParam("soak_max_latency_growth", max_latency_growth);
+    nh.getParam("soak_max_memory_growth", max_memory_growth);
+    soak.configure(soak_hours, sample_period, max_latency_growth,
+                   max_memory_growth);
+  }
+
+  // compact log of the range images and IMU samples, replayed as a dataset
+  RangeImageRecorder recorder;
+  std::string record_range_images;
+  nh.getParam("record_range_images", record_range_images);
+  if (!record_range_images.empty() &&
+      !recorder.open(record_range_images, N_SCAN, HORIZONTAL_SCAN)) {
+    ROS_FATAL("Unable to create the range image log [%s]",
+              record_range_images.c_str());
+    return 1;
+  }
+
+  if (!dataset.empty() && !use_rosbag && !use_pcap) {
+    if (!dataset_reader.open(dataset, soak.enabled())) {
+      ROS_FATAL("Unable to open dataset [%s]", dataset.c_str());
+      return 1;
+    }
+    use_dataset = true;
+  }
+
+  if (soak.enabled() && !use_dataset) {
+    ROS_FATAL("The soak test replays a dataset, set the dataset parameter");
+    return 1;
+  }
+
   Channel<ProjectionOut> projection_out_channel(true);
-  Channel<AssociationOut> association_out_channel(use_rosbag);
+  Channel<AssociationOut> association_out_channel(use_rosbag || use_pcap ||
+                                                  use_dataset);
+  OdometryBuffer odometry_buffer;
+
+  // declared before the stages, so that it outlives them
+  AsyncPublisher publisher;
+  double cloud_compression = 0;
+  nh.getParam("cloud_compression", cloud_compression);
+  if (cloud_compression > 0) {
+    publisher.enableCompression(nh, cloud_compression);
+  }
 
-  ImageProjection IP(nh, N_SCAN, HORIZONTAL_SCAN, projection_out_channel);
+  ImageProjection IP(nh, N_SCAN, HORIZONTAL_SCAN, projection_out_channel,
+                     publisher, memory, soak, recorder);
 
   FeatureAssociation FA(nh, N_SCAN, HORIZONTAL_SCAN, projection_out_channel,
-                        association_out_channel);
+                        association_out_channel, odometry_buffer, tuner,
+                        publisher, memory, soak);
 
-  MapOptimization MO(nh, association_out_channel);
+  MapOptimization MO(nh, association_out_channel, odometry_buffer, tuner,
+                     publisher, memory, soak);
 
   TransformFusion TF(nh);
 
+  // Single entry point for IMU messages: decoded once, then handed to every consumer
+  auto imu_consume = [&](const ImuSample& imu) {
+    recorder.recordImu(imu);
+    FA.imuHandler(imu);
+    MO.imuHandler(imu);
+  };
+  auto imu_dispatch = [&](const sensor_msgs::Imu& imu_msg) {
+    ImuSample imu;
+    ImuMsgToSample(imu_msg, imu);
+    imu_consume(imu);
+  };
+
   ROS_INFO("\033[1;32m---->\033[0m LeGO-LOAM Started.");
 
-  if( !use_rosbag ){
+  if( use_pcap ){
+    ROS_INFO("PCAP");
+    auto clock_publisher = nh.advertise<rosgraph_msgs::Clock>("/clock",1);
+    auto start_real_time = std::chrono::high_resolution_clock::now();
+    size_t scan_count = 0;
+
+    velodyne_msgs::VelodyneScan::Ptr scan(new velodyne_msgs::VelodyneScan);
+    while (ros::ok() && pcap_reader.nextScan(*scan)) {
+      rosgraph_msgs::Clock clock_msg;
+      clock_msg.clock = scan->header.stamp;
+      clock_publisher.publish( clock_msg );
+
+      IP.packetHandler(scan);
+      scan_count++;
+      ros::spinOnce();
+    }
+
+    auto real_time = std::chrono::high_resolution_clock::now();
+    auto delta_real = std::chrono::duration_cast<std::chrono::milliseconds>(real_time-start_real_time).count()*0.001;
+    ROS_INFO("Entire pcap processed: %lu scans at %.1f Hz", scan_count, scan_count / delta_real);
+  }
+  else if( use_dataset ){
+    ROS_INFO("DATASET");
+    auto clock_publisher = nh.advertise<rosgraph_msgs::Clock>("/clock",1);
+    auto start_real_time = std::chrono::high_resolution_clock::now();
+    auto prev_real_time = start_real_time;
+    size_t scan_count = 0;
+    size_t prev_scan_count = 0;
+    size_t point_count = 0;
+
+    std_msgs::Header header;
+    header.frame_id = "velodyne";
+    DatasetScan scan;
+    while (ros::ok() && dataset_reader.next(scan)) {
+      if (soak.enabled() && !soak.advance(scan.time)) break;
+
+      header.stamp.fromSec(scan.time);
+      header.seq = scan.index;
+
+      rosgraph_msgs::Clock clock_msg;
+      clock_msg.clock = header.stamp;
+      clock_publisher.publish( clock_msg );
+
+      // range image logs carry the IMU samples received before the scan
+      for (const ImuSample& imu : scan.imu) {
+        imu_consume(imu);
+      }
+
+      point_count += scan.cloud->size();
+      IP.datasetHandler(scan.cloud, header);
+      scan_count++;
+
+      auto real_time = std::chrono::high_resolution_clock::now();
+      if( real_time - prev_real_time > std::chrono::seconds(5) )
+      {
+        auto delta_real = std::chrono::duration_cast<std::chrono::milliseconds>(real_time-prev_real_time).count()*0.001;
+        ROS_INFO("Processing the dataset at %.1f Hz.", (scan_count - prev_scan_count) / delta_real);
+        prev_scan_count = scan_count;
+        prev_real_time = real_time;
+      }
+      ros::spinOnce();
+    }
+
+    auto real_time = std::chrono::high_resolution_clock::now();
+    auto delta_real = std::chrono::duration_cast<std::chrono::milliseconds>(real_time-start_real_time).count()*0.001;
+    ROS_INFO("Entire dataset processed: %lu scans at %.1f Hz, %.2f Mpoints/s",
+             scan_count, scan_count / delta_real, point_count * 1e-6 / delta_real);
+  }
+  else if( !use_rosbag ){
     ROS_INFO("SPINNER");
-    ros::MultiThreadedSpinner spinner(4);  // Use 4 threads
+    // High rate motion sensors get their own queue and thread, so that they are
+    // never stuck behind the point cloud processing
+    ros::NodeHandle sensor_nh;
+    ros::CallbackQueue sensor_queue;
+    sensor_nh.setCallbackQueue(&sensor_queue);
+
+    ros::Subscriber imu_subscriber = sensor_nh.subscribe<sensor_msgs::Imu>(
+        imuTopic, 200, [&](const sensor_msgs::Imu::ConstPtr& imu_msg) {
+          imu_dispatch(*imu_msg);
+        });
+
+    ros::Subscriber odometry_subscriber;
+    if (!odom_topic.empty()) {
+      odometry_subscriber = sensor_nh.subscribe<nav_msgs::Odometry>(
+          odom_topic, 100, [&](const nav_msgs::Odometry::ConstPtr& odometry) {
+            odometry_buffer.push(odometry);
+          });
+    }
+
+    ros::AsyncSpinner sensor_spinner(1, &sensor_queue);
+    sensor_spinner.start();
+
+    // point cloud projection and transform fusion
+    ros::MultiThreadedSpinner spinner(2);
     spinner.spin();
   }
   else{
@@ -58,6 +263,12 @@ int main(int argc, char** argv) {
     std::vector<std::string> topics;
     topics.push_back(imu_topic);
     topics.push_back(lidar_topic);
+    if (!odom_topic.empty()) {
+      topics.push_back(odom_topic);
+    }
+    if (!packet_topic.empty()) {
+      topics.push_back(packet_topic);
+    }
 
     rosbag::View view(bag, rosbag::TopicQuery(topics));
 
@@ -77,13 +288,22 @@ int main(int argc, char** argv) {
         //ROS_INFO("cloud");
       }
 
+      const velodyne_msgs::VelodyneScan::ConstPtr packets = m.instantiate<velodyne_msgs::VelodyneScan>();
+      if (packets != NULL){
+        IP.packetHandler(packets);
+      }
+
       const sensor_msgs::Imu::ConstPtr imu = m.instantiate<sensor_msgs::Imu>();
       if (imu != NULL){
-        FA.imuHandler(imu);
-        MO.imuHandler(imu);
+        imu_dispatch(*imu);
        // ROS_INFO("imu");
       }
 
+      const nav_msgs::Odometry::ConstPtr odometry = m.instantiate<nav_msgs::Odometry>();
+      if (odometry != NULL){
+        odometry_buffer.push(odometry);
+      }
+
       rosgraph_msgs::Clock clock_msg;
       clock_msg.clock = m.getTime();
       clock_publisher.publish( clock_msg );
@@ -109,11 +329,26 @@ int main(int argc, char** argv) {
     ROS_INFO("Entire rosbag processed at %.1fX speed", delta_sim / delta_real);
   }
 
+  memory.report();
+  publisher.report();
+
+  const bool soak_passed = !soak.enabled() || soak.evaluate();
+
+  if (!tuning_profile_out.empty()) {
+    std::string node_name = ros::this_node::getName();
+    if (!node_name.empty() && node_name[0] == '/') node_name.erase(0, 1);
+    if (tuner.profile().save(tuning_profile_out, node_name)) {
+      ROS_INFO("Tuning profile exported to [%s]", tuning_profile_out.c_str());
+    } else {
+      ROS_ERROR("Unable to export the tuning profile to [%s]",
+                tuning_profile_out.c_str());
+    }
+  }
 
   // must be called to cleanup threads
   ros::shutdown();
 
-  return 0;
+  return soak_passed ? 0 : 1;
 }
 
 
@@ -0,0 +1,577 @@
+#include "mapJournal.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/crc.hpp>
+#include <gtsam/base/serialization.h>
+#include <gtsam/inference/Symbol.h>
+#include <gtsam/navigation/ImuBias.h>
+#include <gtsam/navigation/ImuFactor.h>
+#include <gtsam/slam/BetweenFactor.h>
+#include <gtsam/slam/PriorFactor.h>
+
+using gtsam::Key;
+using gtsam::NonlinearFactor;
+using gtsam::Pose3;
+using gtsam::imuBias::ConstantBias;
+
+namespace {
+
+const char JOURNAL_MAGIC[8] = {'L', 'E', 'G', 'O', 'J', 'R', 'N', '1'};
+const size_t RECORD_HEADER = 3 * sizeof(uint32_t);
+
+enum FactorKind : uint8_t {
+  PRIOR_POSE3 = 1,
+  BETWEEN_POSE3,
+  PRIOR_VECTOR3,
+  BETWEEN_VECTOR3,
+  PRIOR_BIAS,
+  BETWEEN_BIAS,
+  IMU
+};
+
+enum ValueKind : uint8_t { VALUE_POSE3 = 1, VALUE_VECTOR3, VALUE_BIAS };
+
+uint32_t checksum(const char *data, size_t size) {
+  boost::crc_32_type crc;
+  crc.process_bytes(data, size);
+  return crc.checksum();
+}
+
+//---------------------------------------------------------------- encoding
+
+template <typename T>
+void put(std::string &out, const T &value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void putValue(std::string &out, const Pose3 &pose) {
+  const gtsam::Matrix3 rotation = pose.rotation().matrix();
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 3; c++) put(out, rotation(r, c));
+  }
+  put(out, double(pose.translation().x()));
+  put(out, double(pose.translation().y()));
+  put(out, double(pose.translation().z()));
+}
+
+void putValue(std::string &out, const gtsam::Vector3 &vector) {
+  for (int i = 0; i < 3; i++) put(out, vector(i));
+}
+
+void putValue(std::string &out, const ConstantBias &bias) {
+  putValue(out, gtsam::Vector3(bias.accelerometer()));
+  putValue(out, gtsam::Vector3(bias.gyroscope()));
+}
+
+// All the noise models of the graph are diagonal
+bool putNoise(std::string &out, const gtsam::SharedNoiseModel &noise) {
+  const gtsam::noiseModel::Diagonal::shared_ptr diagonal =
+      boost::dynamic_pointer_cast<gtsam::noiseModel::Diagonal>(noise);
+  if (!diagonal) return false;
+  const gtsam::Vector sigmas = diagonal->sigmas();
+  put(out, uint32_t(sigmas.size()));
+  for (int i = 0; i < sigmas.size(); i++) put(out, sigmas(i));
+  return true;
+}
+
+template <typename T>
+bool putPriorOrBetween(std::string &out,
+                       const boost::shared_ptr<NonlinearFactor> &factor,
+                       FactorKind priorKind, FactorKind betweenKind) {
+  if (const auto prior =
+          boost::dynamic_pointer_cast<gtsam::PriorFactor<T>>(factor)) {
+    std::string encoded;
+    put(encoded, priorKind);
+    put(encoded, prior->key());
+    putValue(encoded, prior->prior());
+    if (!putNoise(encoded, prior->noiseModel())) return false;
+    out += encoded;
+    return true;
+  }
+  if (const auto between =
+          boost::dynamic_pointer_cast<gtsam::BetweenFactor<T>>(factor)) {
+    std::string encoded;
+    put(encoded, betweenKind);
+    put(encoded, between->key1());
+    put(encoded, between->key2());
+    putValue(encoded, between->measured());
+    if (!putNoise(encoded, between->noiseModel())) return false;
+    out += encoded;
+    return true;
+  }
+  return false;
+}
+
+bool putFactor(std::string &out,
+               const boost::shared_ptr<NonlinearFactor> &factor) {
+  if (putPriorOrBetween<Pose3>(out, factor, PRIOR_POSE3, BETWEEN_POSE3) ||
+      putPriorOrBetween<gtsam::Vector3>(out, factor, PRIOR_VECTOR3,
+                                        BETWEEN_VECTOR3) ||
+      putPriorOrBetween<ConstantBias>(out, factor, PRIOR_BIAS, BETWEEN_BIAS)) {
+    return true;
+  }
+  if (const auto imu = boost::dynamic_pointer_cast<gtsam::ImuFactor>(factor)) {
+    put(out, IMU);
+    for (Key key : imu->keys()) put(out, key);
+    // the preintegrated measurements are kept in GTSAM's own format
+    const std::string measurements =
+        gtsam::serializeBinary(imu->preintegratedMeasurements());
+    put(out, uint32_t(measurements.size()));
+    out += measurements;
+    return true;
+  }
+  return false;
+}
+
+//---------------------------------------------------------------- decoding
+
+class Reader {
+ public:
+  explicit Reader(const std::string &data) : _data(data), _offset(0) {}
+
+  template <typename T>
+  bool get(T &value) {
+    if (_offset + sizeof(value) > _data.size()) return false;
+    std::memcpy(&value, _data.data() + _offset, sizeof(value));
+    _offset += sizeof(value);
+    return true;
+  }
+
+  bool get(std::string &bytes, size_t size) {
+    if (_offset + size > _data.size()) return false;
+    bytes.assign(_data, _offset, size);
+    _offset += size;
+    return true;
+  }
+
+  bool getValue(Pose3 &pose) {
+    gtsam::Matrix3 rotation;
+    double x, y, z;
+    for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) {
+        if (!get(rotation(r, c))) return false;
+      }
+    }
+    if (!get(x) || !get(y) || !get(z)) return false;
+    pose = Pose3(gtsam::Rot3(rotation), gtsam::Point3(x, y, z));
+    return true;
+  }
+
+  bool getValue(gtsam::Vector3 &vector) {
+    return get(vector(0)) && get(vector(1)) && get(vector(2));
+  }
+
+  bool getValue(ConstantBias &bias) {
+    gtsam::Vector3 accelerometer, gyroscope;
+    if (!getValue(accelerometer) || !getValue(gyroscope)) return false;
+    bias = ConstantBias(accelerometer, gyroscope);
+    return true;
+  }
+
+  bool getNoise(gtsam::SharedNoiseModel &noise) {
+    uint32_t size;
+    if (!get(size) || size > 9) return false;
+    gtsam::Vector sigmas(size);
+    for (uint32_t i = 0; i < size; i++) {
+      if (!get(sigmas(i))) return false;
+    }
+    noise = gtsam::noiseModel::Diagonal::Sigmas(sigmas);
+    return true;
+  }
+
+  bool getCloud(pcl::PointCloud<PointType> &cloud) {
+    uint32_t count;
+    if (!get(count) || _offset + count * 4 * sizeof(float) > _data.size()) {
+      return false;
+    }
+    cloud.points.resize(count);
+    for (PointType &point : cloud.points) {
+      get(point.x);
+      get(point.y);
+      get(point.z);
+      get(point.intensity);
+    }
+    cloud.width = count;
+    cloud.height = 1;
+    return true;
+  }
+
+ private:
+  const std::string &_data;
+  size_t _offset;
+};
+
+template <typename T>
+bool getPrior(Reader &in, gtsam::NonlinearFactorGraph &graph) {
+  Key key;
+  T prior;
+  gtsam::SharedNoiseModel noise;
+  if (!in.get(key) || !in.getValue(prior) || !in.getNoise(noise)) return false;
+  graph.add(gtsam::PriorFactor<T>(key, prior, noise));
+  return true;
+}
+
+template <typename T>
+bool getBetween(Reader &in, gtsam::NonlinearFactorGraph &graph) {
+  Key key1, key2;
+  T measured;
+  gtsam::SharedNoiseModel noise;
+  if (!in.get(key1) || !in.get(key2) || !in.getValue(measured) ||
+      !in.getNoise(noise)) {
+    return false;
+  }
+  graph.add(gtsam::BetweenFactor<T>(key1, key2, measured, noise));
+  return true;
+}
+
+bool getImu(Reader &in, gtsam::NonlinearFactorGraph &graph) {
+  Key keys[5];
+  for (Key &key : keys) {
+    if (!in.get(key)) return false;
+  }
+  uint32_t size;
+  std::string measurements;
+  if (!in.get(size) || !in.get(measurements, size)) return false;
+
+  gtsam::PreintegratedImuMeasurements pim;
+  try {
+    gtsam::deserializeBinary(measurements, pim);
+  } catch (std::exception &ex) {
+    return false;
+  }
+  graph.add(gtsam::ImuFactor(keys[0], keys[1], keys[2], keys[3], keys[4], pim));
+  return true;
+}
+
+//---------------------------------------------------------------- records
+
+void encodeFactors(const gtsam::NonlinearFactorGraph &graph,
+                   std::string &payload) {
+  std::string factors;
+  uint32_t count = 0;
+  for (const auto &factor : graph) {
+    if (putFactor(factors, factor)) {
+      count++;
+    } else {
+      ROS_WARN("Journal: factor of unknown type not recorded");
+    }
+  }
+  put(payload, count);
+  payload += factors;
+}
+
+void encodeValues(const gtsam::Values &values, std::string &payload) {
+  std::string encoded;
+  uint32_t count = 0;
+  for (const auto &keyValue : values) {
+    const gtsam::Value *value = &keyValue.value;
+    if (const auto pose = dynamic_cast<const gtsam::GenericValue<Pose3> *>(value)) {
+      put(encoded, keyValue.key);
+      put(encoded, VALUE_POSE3);
+      putValue(encoded, pose->value());
+    } else if (const auto vector =
+                   dynamic_cast<const gtsam::GenericValue<gtsam::Vector3> *>(value)) {
+      put(encoded, keyValue.key);
+      put(encoded, VALUE_VECTOR3);
+      putValue(encoded, vector->value());
+    } else if (const auto bias =
+                   dynamic_cast<const gtsam::GenericValue<ConstantBias> *>(value)) {
+      put(encoded, keyValue.key);
+      put(encoded, VALUE_BIAS);
+      putValue(encoded, bias->value());
+    } else {
+      ROS_WARN("Journal: value of unknown type not recorded");
+      continue;
+    }
+    count++;
+  }
+  put(payload, count);
+  payload += encoded;
+}
+
+void encodeKeyFrame(const PointTypePose &pose,
+                    const pcl::PointCloud<PointType>::ConstPtr (&clouds)[3],
+                    std::string &payload) {
+  put(payload, pose.x);
+  put(payload, pose.y);
+  put(payload, pose.z);
+  put(payload, pose.roll);
+  put(payload, pose.pitch);
+  put(payload, pose.yaw);
+  put(payload, pose.time);
+  // x, y, z, intensity only, without the alignment padding of PointType
+  for (const auto &cloud : clouds) {
+    put(payload, uint32_t(cloud->points.size()));
+    for (const PointType &point : cloud->points) {
+      put(payload, point.x);
+      put(payload, point.y);
+      put(payload, point.z);
+      put(payload, point.intensity);
+    }
+  }
+}
+
+bool decodeFactors(Reader &in, gtsam::NonlinearFactorGraph &graph) {
+  uint32_t count;
+  if (!in.get(count)) return false;
+  for (uint32_t i = 0; i < count; i++) {
+    uint8_t kind;
+    if (!in.get(kind)) return false;
+    bool decoded = false;
+    switch (kind) {
+      case PRIOR_POSE3: decoded = getPrior<Pose3>(in, graph); break;
+      case BETWEEN_POSE3: decoded = getBetween<Pose3>(in, graph); break;
+      case PRIOR_VECTOR3: decoded = getPrior<gtsam::Vector3>(in, graph); break;
+      case BETWEEN_VECTOR3: decoded = getBetween<gtsam::Vector3>(in, graph); break;
+      case PRIOR_BIAS: decoded = getPrior<ConstantBias>(in, graph); break;
+      case BETWEEN_BIAS: decoded = getBetween<ConstantBias>(in, graph); break;
+      case IMU: decoded = getImu(in, graph); break;
+    }
+    if (!decoded) return false;
+  }
+  return true;
+}
+
+bool decodeValues(Reader &in, gtsam::Values &values) {
+  uint32_t count;
+  if (!in.get(count)) return false;
+  for (uint32_t i = 0; i < count; i++) {
+    Key key;
+    uint8_t kind;
+    if (!in.get(key) || !in.get(kind) || values.exists(key)) return false;
+    if (kind == VALUE_POSE3) {
+      Pose3 pose;
+      if (!in.getValue(pose)) return false;
+      values.insert(key, pose);
+    } else if (kind == VALUE_VECTOR3) {
+      gtsam::Vector3 vector;
+      if (!in.getValue(vector)) return false;
+      values.insert(key, vector);
+    } else if (kind == VALUE_BIAS) {
+      ConstantBias bias;
+      if (!in.getValue(bias)) return false;
+      values.insert(key, bias);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool decodeKeyFrame(Reader &in, JournalContents &contents) {
+  JournalContents::KeyFrame keyFrame;
+  PointTypePose &pose = keyFrame.pose;
+  if (!in.get(pose.x) || !in.get(pose.y) || !in.get(pose.z) ||
+      !in.get(pose.roll) || !in.get(pose.pitch) || !in.get(pose.yaw) ||
+      !in.get(pose.time)) {
+    return false;
+  }
+  pose.intensity = contents.keyFrames.size();
+
+  keyFrame.corner.reset(new pcl::PointCloud<PointType>());
+  keyFrame.surf.reset(new pcl::PointCloud<PointType>());
+  keyFrame.outlier.reset(new pcl::PointCloud<PointType>());
+  if (!in.getCloud(*keyFrame.corner) || !in.getCloud(*keyFrame.surf) ||
+      !in.getCloud(*keyFrame.outlier) ||
+      !decodeValues(in, contents.values) ||
+      !decodeFactors(in, contents.graph)) {
+    return false;
+  }
+  contents.keyFrames.push_back(keyFrame);
+  return true;
+}
+
+}  // namespace
+
+MapJournal::MapJournal() : _fd(-1), _end(0), _stop(false), _failed(false) {}
+
+MapJournal::~MapJournal() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cv.notify_all();
+  if (_thread.joinable()) _thread.join();
+  if (_fd >= 0) ::close(_fd);
+}
+
+bool MapJournal::open(const std::string &path, JournalContents &contents) {
+  // length of the valid part of an existing journal, 0 if there is none
+  const size_t valid = replay(path, contents);
+  if (valid == size_t(-1)) return false;
+
+  _fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (_fd < 0) return false;
+
+  // drops the torn record of a crash, if any
+  if (ftruncate(_fd, valid) != 0 || lseek(_fd, valid, SEEK_SET) < 0 ||
+      (valid == 0 &&
+       ::write(_fd, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) !=
+           ssize_t(sizeof(JOURNAL_MAGIC)))) {
+    ::close(_fd);
+    _fd = -1;
+    return false;
+  }
+
+  _path = path;
+  _end = valid == 0 ? sizeof(JOURNAL_MAGIC) : valid;
+  _thread = std::thread(&MapJournal::writerThread, this);
+  return true;
+}
+
+size_t MapJournal::replay(const std::string &path, JournalContents &contents) {
+  std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+  if (!in) return 0;
+  const size_t size = in.tellg();
+  in.seekg(0);
+
+  char magic[sizeof(JOURNAL_MAGIC)];
+  if (!in.read(magic, sizeof(magic))) return 0;  // torn at creation
+  if (std::memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0) {
+    ROS_ERROR("[%s] is not a journal", path.c_str());
+    return size_t(-1);
+  }
+
+  size_t valid = sizeof(JOURNAL_MAGIC);
+  size_t records = 0;
+  std::string payload;
+  while (true) {
+    uint32_t header[3];
+    if (!in.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+        valid + RECORD_HEADER + header[1] > size) {
+      break;
+    }
+    payload.resize(header[1]);
+    if (!in.read(&payload[0], payload.size())) break;
+    if (checksum(payload.data(), payload.size()) != header[2]) break;
+
+    // a record is applied as a whole or not at all
+    JournalContents record;
+    Reader reader(payload);
+    bool decoded = false;
+    try {
+      decoded = (header[0] == KEY_FRAME) ? decodeKeyFrame(reader, record)
+              : (header[0] == LOOP_CLOSURE) ? decodeFactors(reader, record.graph)
+              : false;
+    } catch (std::exception &ex) {
+      decoded = false;
+    }
+    for (const Key key : record.values.keys()) {
+      decoded = decoded && !contents.values.exists(key);
+    }
+    if (!decoded) break;
+
+    for (JournalContents::KeyFrame &keyFrame : record.keyFrames) {
+      keyFrame.pose.intensity = contents.keyFrames.size();
+      contents.keyFrames.push_back(keyFrame);
+    }
+    contents.graph.push_back(record.graph);
+    contents.values.insert(record.values);
+
+    valid += RECORD_HEADER + payload.size();
+    records++;
+  }
+
+  if (size != valid) {
+    ROS_WARN("Journal [%s]: %lu bytes dropped after record %lu", path.c_str(),
+             size - valid, records);
+  }
+  return valid;
+}
+
+void MapJournal::appendKeyFrame(
+    const gtsam::NonlinearFactorGraph &graph, const gtsam::Values &values,
+    const PointTypePose &pose, const pcl::PointCloud<PointType>::ConstPtr &corner,
+    const pcl::PointCloud<PointType>::ConstPtr &surf,
+    const pcl::PointCloud<PointType>::ConstPtr &outlier) {
+  if (_fd < 0) return;
+  Record record;
+  record.type = KEY_FRAME;
+  record.graph = graph;
+  record.values = values;
+  record.pose = pose;
+  record.clouds[0] = corner;
+  record.clouds[1] = surf;
+  record.clouds[2] = outlier;
+  push(std::move(record));
+}
+
+void MapJournal::appendLoopClosure(const gtsam::NonlinearFactorGraph &graph) {
+  if (_fd < 0) return;
+  Record record;
+  record.type = LOOP_CLOSURE;
+  record.graph = graph;
+  push(std::move(record));
+}
+
+void MapJournal::push(Record &&record) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_failed) return;
+  _queue.push_back(std::move(record));
+  _cv.notify_all();
+}
+
+void MapJournal::writerThread() {
+  std::deque<Record> batch;
+  std::string buffer;
+  std::string payload;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [&]() { return _stop || !_queue.empty(); });
+      if (_queue.empty()) break;
+      // gathers the records of one period, written with a single sync
+      _cv.wait_for(lock, std::chrono::duration<double>(journalSyncPeriod),
+                   [&]() { return _stop; });
+      batch.swap(_queue);
+    }
+
+    // encoded here rather than by the mapping thread
+    buffer.clear();
+    for (const Record &record : batch) {
+      payload.clear();
+      if (record.type == KEY_FRAME) {
+        encodeKeyFrame(record.pose, record.clouds, payload);
+        encodeValues(record.values, payload);
+      }
+      encodeFactors(record.graph, payload);
+      put(buffer, uint32_t(record.type));
+      put(buffer, uint32_t(payload.size()));
+      put(buffer, checksum(payload.data(), payload.size()));
+      buffer += payload;
+    }
+    batch.clear();
+
+    size_t written = 0;
+    while (written < buffer.size()) {
+      const ssize_t n =
+          ::write(_fd, buffer.data() + written, buffer.size() - written);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      written += n;
+    }
+    if (written == buffer.size() && fdatasync(_fd) == 0) {
+      _end += written;
+      continue;
+    }
+
+    // a torn batch would hide every record appended after it from the replay:
+    // it is cut off and the journal ends here
+    const int error = errno;
+    if (ftruncate(_fd, _end) != 0) {
+      ROS_ERROR("Unable to truncate the journal [%s] after a failed write",
+                _path.c_str());
+    }
+    ROS_ERROR("Unable to write the journal [%s]: %s, journaling stopped, "
+              "it ends with the last complete batch",
+              _path.c_str(), strerror(error));
+    std::lock_guard<std::mutex> lock(_mutex);
+    _failed = true;
+    _queue.clear();
+    break;
+  }
+}
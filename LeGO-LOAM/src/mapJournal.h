@@ -0,0 +1,84 @@
+#ifndef MAPJOURNAL_H
+#define MAPJOURNAL_H
+
+#include "utility.h"
+#include <condition_variable>
+
+#include <gtsam/nonlinear/NonlinearFactorGraph.h>
+#include <gtsam/nonlinear/Values.h>
+
+// Everything a journal holds, as rebuilt by MapJournal::open()
+struct JournalContents {
+  struct KeyFrame {
+    PointTypePose pose;  // estimate when the key frame was saved
+    pcl::PointCloud<PointType>::Ptr corner;
+    pcl::PointCloud<PointType>::Ptr surf;
+    pcl::PointCloud<PointType>::Ptr outlier;
+  };
+
+  gtsam::NonlinearFactorGraph graph;  // every factor given to iSAM2, in order
+  gtsam::Values values;               // initial estimates of every variable
+  std::vector<KeyFrame> keyFrames;
+};
+
+// Append-only, crash-safe record of the mapping: each key frame (pose, clouds,
+// and the factors and initial estimates of the iSAM2 update that added it),
+// and the factors of each loop closure.
+// The file starts with the 8 bytes "LEGOJRN1" followed by records of
+//   { uint32 type, uint32 payload size, uint32 CRC-32 of the payload, payload }
+// Records are queued by the mapping and loop closure threads, encoded and
+// written by a background thread which syncs the file at most once every
+// journalSyncPeriod, so a crash loses at most the last period.
+// A torn record at the end of the file, left by a crash, is dropped on open.
+// A failed write is cut off the same way and ends the journal for this run:
+// records appended after it would not be found by the replay.
+class MapJournal {
+ public:
+  MapJournal();
+  ~MapJournal();
+
+  // Reads the existing journal into contents, then opens it for appending.
+  // Returns false if the file cannot be created or is not a journal.
+  bool open(const std::string &path, JournalContents &contents);
+
+  bool isOpen() const { return _fd >= 0; }
+
+  // Mapping thread, the graph and values are copied, the clouds are shared:
+  // they must not be modified anymore
+  void appendKeyFrame(const gtsam::NonlinearFactorGraph &graph,
+                      const gtsam::Values &values, const PointTypePose &pose,
+                      const pcl::PointCloud<PointType>::ConstPtr &corner,
+                      const pcl::PointCloud<PointType>::ConstPtr &surf,
+                      const pcl::PointCloud<PointType>::ConstPtr &outlier);
+
+  // Loop closure thread, between key frames already appended
+  void appendLoopClosure(const gtsam::NonlinearFactorGraph &graph);
+
+ private:
+  enum RecordType { KEY_FRAME = 1, LOOP_CLOSURE = 2 };
+
+  struct Record {
+    RecordType type;
+    gtsam::NonlinearFactorGraph graph;
+    gtsam::Values values;
+    PointTypePose pose;
+    pcl::PointCloud<PointType>::ConstPtr clouds[3];
+  };
+
+  size_t replay(const std::string &path, JournalContents &contents);
+  void push(Record &&record);
+  void writerThread();
+
+  int _fd;
+  std::string _path;
+  size_t _end;  // writer thread: length of the complete records
+
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::deque<Record> _queue;
+  bool _stop;
+  bool _failed;  // nothing is written anymore
+};
+
+#endif  // MAPJOURNAL_H
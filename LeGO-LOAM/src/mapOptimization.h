@@ -4,6 +4,19 @@
 #include "utility.h"
 #include "channel.h"
 #include "nanoflann_pcl.h"
+#include "odometry_buffer.h"
+#include "auto_tuner.h"
+#include "keyframe_store.h"
+#include "async_publisher.h"
+#include "allocation_tracker.h"
+#include "memory_accounting.h"
+#include "mapJournal.h"
+#include "map_snapshot.h"
+#include "packed_cloud.h"
+#include "mapTilePublisher.h"
+#include "loop_closure_cache.h"
+#include "cloud_msgs/QueryMap.h"
+#include "soak_monitor.h"
 
 #include <gtsam/geometry/Pose3.h>
 #include <gtsam/geometry/Rot3.h>
@@ -14,6 +27,9 @@
 #include <gtsam/slam/BetweenFactor.h>
 #include <gtsam/slam/PriorFactor.h>
 #include <gtsam/nonlinear/ISAM2.h>
+#include <gtsam/navigation/ImuFactor.h>
+#include <gtsam/navigation/ImuBias.h>
+#include <gtsam/inference/Symbol.h>
 
 inline gtsam::Pose3 pclPointTogtsamPose3(PointTypePose thisPoint) {
   // camera frame to lidar frame
@@ -35,13 +51,20 @@ inline Eigen::Affine3f pclPointToAffine3fCameraToLidar(
 class MapOptimization {
 
  public:
-  MapOptimization(ros::NodeHandle& node, Channel<AssociationOut> &input_channel);
+  MapOptimization(ros::NodeHandle& node, Channel<AssociationOut> &input_channel,
+                  const OdometryBuffer &odometry_buffer, AutoTuner &tuner,
+                  AsyncPublisher &publisher, MemoryAccounting &memory,
+                  SoakMonitor &soak);
 
   ~MapOptimization();
 
-  void imuHandler(const sensor_msgs::Imu::ConstPtr &imuIn);
+  void imuHandler(const ImuSample &imu);
   void run();
 
+  // Any thread: the latest map snapshot for radius, box and nearest neighbour
+  // queries, null until the first one is built (only with ~map_query)
+  MapSnapshotPtr mapSnapshot() const { return std::atomic_load(&_map_snapshot); }
+
  private:
   gtsam::NonlinearFactorGraph gtSAMgraph;
   gtsam::Values initialEstimate;
@@ -53,8 +76,43 @@ class MapOptimization {
   gtsam::noiseModel::Diagonal::shared_ptr odometryNoise;
   gtsam::noiseModel::Diagonal::shared_ptr constraintNoise;
 
+  boost::shared_ptr<gtsam::PreintegrationParams> imuPreintegrationParams;
+  gtsam::noiseModel::Diagonal::shared_ptr priorVelocityNoise;
+  gtsam::noiseModel::Diagonal::shared_ptr priorBiasNoise;
+  gtsam::noiseModel::Diagonal::shared_ptr velocityBetweenNoise;
+  gtsam::NavState imuStateLastKeyFrame;
+  gtsam::imuBias::ConstantBias imuBiasLastKeyFrame;
+  bool imuStateInitialized;
+  double timeLastKeyFrame;
+  // IMU preintegrated since the last key frame, extended at each scan so that
+  // the interval between key frames is not bounded by the IMU ring
+  gtsam::PreintegratedImuMeasurements imuSinceKeyFrame;
+  double imuIntegratedTime;   // end of imuSinceKeyFrame
+  bool imuIntegrationValid;   // false after a gap in the samples
+
+  gtsam::noiseModel::Diagonal::shared_ptr externalOdometryNoise;
+
   ros::NodeHandle& nh;
   Channel<AssociationOut>& _input_channel;
+  const OdometryBuffer& _odometry_buffer;
+  AutoTuner& _tuner;
+  AsyncPublisher& _publisher;
+  AllocationMonitor _allocations;
+
+  MemoryAccounting& _memory;
+  MemoryGauge _key_frame_memory;
+  MemoryGauge _local_map_memory;
+  MemoryGauge _kdtree_memory;
+  MemoryGauge _isam_memory;
+  MemoryGauge _channel_memory;
+  MemoryGauge _scratch_memory;
+  MemoryGauge _global_map_memory;  // global map thread only
+  MemoryGauge _loop_target_memory;  // loop closure thread only
+  std::string _spill_directory;    // empty: key frames stay in memory
+  size_t _spill_next;              // oldest key frame not spilled yet
+  SoakMonitor& _soak;
+  MapJournal _journal;
+  TuningProfile _tuning;
   std::thread _run_thread;
 
   Channel<bool> _publish_global_signal;
@@ -73,15 +131,25 @@ class MapOptimization {
   ros::Publisher pubIcpKeyFrames;
   ros::Publisher pubRecentKeyFrames;
 
-  ros::Subscriber subImu;
+  bool _map_query;
+  MapSnapshotPtr _map_snapshot;  // std::atomic_load / atomic_store only
+  ros::ServiceServer _query_map_service;
+  bool queryMap(cloud_msgs::QueryMap::Request &request,
+                cloud_msgs::QueryMap::Response &response);
+
+  MapTilePublisher _map_tiles;  // global map thread only
 
   nav_msgs::Odometry odomAftMapped;
   tf::StampedTransform aftMappedTrans;
   tf::TransformBroadcaster tfBroadcaster;
 
-  std::vector<pcl::PointCloud<PointType>::Ptr> cornerCloudKeyFrames;
-  std::vector<pcl::PointCloud<PointType>::Ptr> surfCloudKeyFrames;
-  std::vector<pcl::PointCloud<PointType>::Ptr> outlierCloudKeyFrames;
+  // written by the mapping thread only, read without locking by the global
+  // map and loop closure threads
+  KeyFrameStore keyFrames;
+  TrajectorySnapshotPtr _trajectory;       // std::atomic_load / atomic_store only
+  TrajectorySnapshotPtr _loop_trajectory;  // the one loop closure works on
+  LoopClosureCache _loop_targets;
+  LoopClosureTargetPtr _loop_target;  // of the candidate of _loop_trajectory
 
   std::deque<pcl::PointCloud<PointType>::Ptr> recentCornerCloudKeyFrames;
   std::deque<pcl::PointCloud<PointType>::Ptr> recentSurfCloudKeyFrames;
@@ -96,6 +164,7 @@ class MapOptimization {
   PointType previousRobotPosPoint;
   PointType currentRobotPosPoint;
 
+  // mapping thread copy of the key frame poses
   pcl::PointCloud<PointType>::Ptr cloudKeyPoses3D;
   pcl::PointCloud<PointTypePose>::Ptr cloudKeyPoses6D;
 
@@ -141,7 +210,6 @@ class MapOptimization {
   pcl::PointCloud<PointType>::Ptr nearHistoryCornerKeyFrameCloud;
   pcl::PointCloud<PointType>::Ptr nearHistoryCornerKeyFrameCloudDS;
   pcl::PointCloud<PointType>::Ptr nearHistorySurfKeyFrameCloud;
-  pcl::PointCloud<PointType>::Ptr nearHistorySurfKeyFrameCloudDS;
 
   pcl::PointCloud<PointType>::Ptr latestCornerKeyFrameCloud;
   pcl::PointCloud<PointType>::Ptr latestSurfKeyFrameCloud;
@@ -185,8 +253,11 @@ class MapOptimization {
   double imuTime[imuQueLength];
   float imuRoll[imuQueLength];
   float imuPitch[imuQueLength];
+  Vector3 imuAcc[imuQueLength];
+  Vector3 imuGyro[imuQueLength];
+  std::mutex _imu_mutex;
 
-  std::mutex mtx;
+  std::mutex mtx;  // iSAM2, shared by the mapping and loop closure threads
 
   double timeLastProcessing;
 
@@ -216,7 +287,22 @@ class MapOptimization {
   int closestHistoryFrameID;
   int latestFrameIDLoopCloure;
 
-  bool aLoopIsClosed;
+  std::atomic<bool> aLoopIsClosed;
+
+  IterationStats lmIterationStats;
+  int _kdtree_build_tasks;
+  bool _kdtree_build_compare;
+  nanoflann::KdTreeFLANN<PointType> _kdtree_build_reference;  // serial
+  KdTreeBuildBenchmark kdtreeBuildBenchmark;
+  // approximate kd-tree searches (~mapping_knn_eps, ~mapping_knn_max_leaves)
+  float _knn_eps;
+  int _knn_max_leaves;
+  bool _knn_compare;
+  ApproximateSearchBenchmark knnBenchmark;
+  RobustKernel cornerRobustKernel;
+  RobustKernel surfRobustKernel;
+  float transformLastMapped[6];
+  double timeLastMapped;
 
   float cRoll, sRoll, cPitch, sPitch, cYaw, sYaw, tX, tY, tZ;
   float ctRoll, stRoll, ctPitch, stPitch, ctYaw, stYaw, tInX, tInY, tInZ;
@@ -233,27 +319,49 @@ class MapOptimization {
       pcl::PointCloud<PointType>::Ptr cloudIn);
 
   pcl::PointCloud<PointType>::Ptr transformPointCloud(
-      pcl::PointCloud<PointType>::Ptr cloudIn, PointTypePose *transformIn);
+      pcl::PointCloud<PointType>::Ptr cloudIn, const PointTypePose *transformIn);
 
   void publishTF();
   void publishKeyPosesAndFrames();
   void publishGlobalMap();
+  void accountGlobalMapMemory(size_t snapshotBytes);
 
   bool detectLoopClosure();
   void performLoopClosure();
 
   void extractSurroundingKeyFrames();
   void downsampleCurrentScan();
+  void applyTuningProfile();
   void cornerOptimization(int iterCount);
   void surfOptimization(int iterCount);
 
   bool LMOptimization(int iterCount);
   void scan2MapOptimization();
+  void benchmarkKdTreeBuild(double parallelTime);
+  int matchScanToMap();
+  void setApproximateSearch(bool approximate);
+  int benchmarkApproximateSearch();
+
+  bool integrateImuMeasurements(double timeTo);
+  void resetImuIntegration();
+  void predictTransformFromImu();
+  void addImuFactor(size_t key);
+  void updateImuStateFromEstimate(size_t key);
+  void addExternalOdometryFactor(size_t key);
 
   void saveKeyFramesAndFactor();
   void correctPoses();
+  void updateKeyPosesFromEstimate();
+  void publishTrajectorySnapshot(bool posesCorrected);
+  LoopClosureTargetPtr prepareLoopClosureTarget(
+      const pcl::PointCloud<PointTypePose> &poses, int first, int last);
+  void restoreFromJournal(JournalContents &contents);
 
   void clearCloud();
+
+  size_t isamBytes() const;
+  void accountMemory(const AssociationOut &association);
+  void releaseMemory();
 };
 
 #endif // MAPOPTIMIZATION_H
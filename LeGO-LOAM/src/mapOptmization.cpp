@@ -36,15 +36,38 @@
 
 #include "mapOptimization.h"
 #include <future>
+#include <chrono>
 
 using namespace gtsam;
 
 MapOptimization::MapOptimization(ros::NodeHandle &node,
-                                 Channel<AssociationOut> &input_channel)
+                                 Channel<AssociationOut> &input_channel,
+                                 const OdometryBuffer &odometry_buffer,
+                                 AutoTuner &tuner,
+                                 AsyncPublisher &publisher,
+                                 MemoryAccounting &memory,
+                                 SoakMonitor &soak)
     : nh(node),
       _input_channel(input_channel),
+      _odometry_buffer(odometry_buffer),
+      _tuner(tuner),
+      _publisher(publisher),
+      _allocations("MapOptimization", false),
+      _memory(memory),
+      _key_frame_memory(memory, MemoryAccounting::KEY_FRAMES),
+      _local_map_memory(memory, MemoryAccounting::LOCAL_MAP),
+      _kdtree_memory(memory, MemoryAccounting::KD_TREES),
+      _isam_memory(memory, MemoryAccounting::ISAM),
+      _channel_memory(memory, MemoryAccounting::CHANNELS),
+      _scratch_memory(memory, MemoryAccounting::SCRATCH),
+      _global_map_memory(memory, MemoryAccounting::GLOBAL_MAP),
+      _loop_target_memory(memory, MemoryAccounting::LOCAL_MAP),
+      _spill_next(0),
+      _soak(soak),
       _publish_global_signal(false),
-      _loop_closure_signal(false)
+      _loop_closure_signal(false),
+      cornerRobustKernel(mappingRobustKernel, mappingRobustKernelScale),
+      surfRobustKernel(mappingRobustKernel, mappingRobustKernelScale)
 {
   ISAM2Params parameters;
   parameters.relinearizeThreshold = 0.01;
@@ -56,9 +79,6 @@ MapOptimization::MapOptimization(ros::NodeHandle &node,
       nh.advertise<sensor_msgs::PointCloud2>("/laser_cloud_surround", 2);
   pubOdomAftMapped = nh.advertise<nav_msgs::Odometry>("/aft_mapped_to_init", 5);
 
-  subImu = nh.subscribe<sensor_msgs::Imu>(imuTopic, 50,
-                                          &MapOptimization::imuHandler, this);
-
   pubHistoryKeyFrames =
       nh.advertise<sensor_msgs::PointCloud2>("/history_cloud", 2);
   pubIcpKeyFrames =
@@ -66,9 +86,49 @@ MapOptimization::MapOptimization(ros::NodeHandle &node,
   pubRecentKeyFrames =
       nh.advertise<sensor_msgs::PointCloud2>("/recent_cloud", 2);
 
-  downSizeFilterCorner.setLeafSize(0.2, 0.2, 0.2);
-  downSizeFilterSurf.setLeafSize(0.4, 0.4, 0.4);
-  downSizeFilterOutlier.setLeafSize(0.4, 0.4, 0.4);
+  // where old key frames go when the memory ceiling is exceeded
+  nh.getParam("memory_spill_directory", _spill_directory);
+  if (!_spill_directory.empty()) {
+    const size_t removed = KeyFrameStore::removeStaleSpills(_spill_directory);
+    if (removed > 0) {
+      ROS_WARN("Removed %lu key frames spilled to [%s] by a previous run",
+               removed, _spill_directory.c_str());
+    }
+  }
+
+  // map snapshots served to other nodes
+  _map_query = false;
+  nh.getParam("map_query", _map_query);
+  if (_map_query) {
+    _query_map_service =
+        nh.advertiseService("/query_map", &MapOptimization::queryMap, this);
+  }
+
+  // level of detail map tiles for remote viewers, bytes per second
+  double mapTileBudget = 0;
+  nh.getParam("map_tile_budget", mapTileBudget);
+  _map_tiles.advertise(nh, mapTileBudget);
+
+  // threads building the large map kd-trees, compare also builds them serially
+  _kdtree_build_tasks = 1;
+  nh.getParam("kdtree_build_tasks", _kdtree_build_tasks);
+  _kdtree_build_compare = false;
+  nh.getParam("kdtree_build_compare", _kdtree_build_compare);
+  for (auto *kdtree :
+       {&kdtreeCornerFromMap, &kdtreeSurfFromMap, &kdtreeGlobalMap}) {
+    kdtree->setBuildTasks(_kdtree_build_tasks, kdtreeParallelBuildPoints);
+  }
+
+  // eps 0 and no leaf limit: exact searches
+  _knn_eps = 0;
+  nh.getParam("mapping_knn_eps", _knn_eps);
+  _knn_max_leaves = 0;
+  nh.getParam("mapping_knn_max_leaves", _knn_max_leaves);
+  _knn_compare = false;
+  nh.getParam("knn_compare", _knn_compare);
+  setApproximateSearch(true);
+
+  applyTuningProfile();
 
   // for histor key frames of loop closure
   downSizeFilterHistoryKeyFrames.setLeafSize(0.4, 0.4, 0.4);
@@ -88,6 +148,18 @@ MapOptimization::MapOptimization(ros::NodeHandle &node,
 
   allocateMemory();
 
+  // the map of a previous run, continued where it stopped
+  std::string journal;
+  nh.getParam("journal", journal);
+  if (!journal.empty()) {
+    JournalContents contents;
+    if (!_journal.open(journal, contents)) {
+      ROS_ERROR("Unable to open the journal [%s]", journal.c_str());
+    } else if (!contents.keyFrames.empty()) {
+      restoreFromJournal(contents);
+    }
+  }
+
   _publish_global_thread = std::thread(&MapOptimization::publishGlobalMapThread, this);
   _loop_closure_thread = std::thread(&MapOptimization::loopClosureThread, this);
   _run_thread = std::thread(&MapOptimization::run, this);
@@ -149,7 +221,6 @@ void MapOptimization::allocateMemory() {
   nearHistoryCornerKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
   nearHistoryCornerKeyFrameCloudDS.reset(new pcl::PointCloud<PointType>());
   nearHistorySurfKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
-  nearHistorySurfKeyFrameCloudDS.reset(new pcl::PointCloud<PointType>());
 
   latestCornerKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
   latestSurfKeyFrameCloud.reset(new pcl::PointCloud<PointType>());
@@ -180,6 +251,8 @@ void MapOptimization::allocateMemory() {
     imuTime[i] = 0;
     imuRoll[i] = 0;
     imuPitch[i] = 0;
+    imuAcc[i].setZero();
+    imuGyro[i].setZero();
   }
 
   gtsam::Vector Vector6(6);
@@ -187,6 +260,27 @@ void MapOptimization::allocateMemory() {
   priorNoise = noiseModel::Diagonal::Variances(Vector6);
   odometryNoise = noiseModel::Diagonal::Variances(Vector6);
 
+  imuPreintegrationParams = MakeImuPreintegrationParams();
+
+  priorVelocityNoise = noiseModel::Diagonal::Sigmas(gtsam::Vector3(1e2, 1e2, 1e2));
+  velocityBetweenNoise = noiseModel::Diagonal::Sigmas(gtsam::Vector3(1.0, 1.0, 1.0));
+  gtsam::Vector biasSigmas(6);
+  biasSigmas << 1e-1, 1e-1, 1e-1, 1e-2, 1e-2, 1e-2;
+  priorBiasNoise = noiseModel::Diagonal::Sigmas(biasSigmas);
+  imuStateInitialized = false;
+  timeLastKeyFrame = 0;
+  imuSinceKeyFrame =
+      PreintegratedImuMeasurements(imuPreintegrationParams, imuBiasLastKeyFrame);
+  imuIntegratedTime = 0;
+  imuIntegrationValid = false;
+
+  gtsam::Vector externalOdometrySigmas(6);
+  externalOdometrySigmas << externalOdometryRotationNoise,
+      externalOdometryRotationNoise, externalOdometryRotationNoise,
+      externalOdometryTranslationNoise, externalOdometryTranslationNoise,
+      externalOdometryTranslationNoise;
+  externalOdometryNoise = noiseModel::Diagonal::Sigmas(externalOdometrySigmas);
+
   matA0.setZero();
   matB0.fill(-1);
   matX0.setZero();
@@ -209,6 +303,11 @@ void MapOptimization::allocateMemory() {
   aLoopIsClosed = false;
 
   latestFrameID = 0;
+
+  for (int i = 0; i < 6; ++i) {
+    transformLastMapped[i] = 0;
+  }
+  timeLastMapped = -1;
 }
 
 
@@ -219,7 +318,11 @@ void MapOptimization::publishGlobalMapThread()
     bool ready;
     _publish_global_signal.receive(ready);
     if(ready){
+      const auto startTime = std::chrono::steady_clock::now();
       publishGlobalMap();
+      _soak.record(SoakMonitor::GLOBAL_MAP,
+                   std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - startTime).count());
     }
   }
 }
@@ -231,7 +334,11 @@ void MapOptimization::loopClosureThread()
     bool ready;
     _loop_closure_signal.receive(ready);
     if(ready && loopClosureEnableFlag){
+      const auto startTime = std::chrono::steady_clock::now();
       performLoopClosure();
+      _soak.record(SoakMonitor::LOOP_CLOSURE,
+                   std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - startTime).count());
     }
   }
 }
@@ -362,6 +469,7 @@ void MapOptimization::transformAssociateToMap() {
 }
 
 void MapOptimization::transformUpdate() {
+  std::unique_lock<std::mutex> imuLock(_imu_mutex);
   if (imuPointerLast >= 0) {
     float imuRollLast = 0, imuPitchLast = 0;
     while (imuPointerFront != imuPointerLast) {
@@ -394,6 +502,7 @@ void MapOptimization::transformUpdate() {
     transformTobeMapped[2] =
         0.998 * transformTobeMapped[2] + 0.002 * imuRollLast;
   }
+  imuLock.unlock();
 
   for (int i = 0; i < 6; i++) {
     transformBefMapped[i] = transformSum[i];
@@ -480,7 +589,7 @@ pcl::PointCloud<PointType>::Ptr MapOptimization::transformPointCloud(
 }
 
 pcl::PointCloud<PointType>::Ptr MapOptimization::transformPointCloud(
-    pcl::PointCloud<PointType>::Ptr cloudIn, PointTypePose *transformIn) {
+    pcl::PointCloud<PointType>::Ptr cloudIn, const PointTypePose *transformIn) {
   pcl::PointCloud<PointType>::Ptr cloudOut(new pcl::PointCloud<PointType>());
 
   PointType *pointFrom;
@@ -513,24 +622,141 @@ pcl::PointCloud<PointType>::Ptr MapOptimization::transformPointCloud(
   return cloudOut;
 }
 
-void MapOptimization::imuHandler(const sensor_msgs::Imu::ConstPtr &imuIn) {
+void MapOptimization::imuHandler(const ImuSample &imu) {
 
-  if( imuIn->orientation.x == 0 && imuIn->orientation.y == 0 &&
-      imuIn->orientation.z == 0 && imuIn->orientation.w == 0 )
+  if( !imu.orientationValid )
   {
     ROS_WARN_THROTTLE(1, "invalid IMU orientation. rejected");
     return;
   }
 
-  double roll, pitch, yaw;
-  tf::Quaternion orientation;
-  tf::quaternionMsgToTF(imuIn->orientation, orientation);
-  tf::Matrix3x3(orientation).getRPY(roll, pitch, yaw);
-
+  std::lock_guard<std::mutex> lock(_imu_mutex);
   imuPointerLast = (imuPointerLast + 1) % imuQueLength;
-  imuTime[imuPointerLast] = imuIn->header.stamp.toSec();
-  imuRoll[imuPointerLast] = roll;
-  imuPitch[imuPointerLast] = pitch;
+  imuTime[imuPointerLast] = imu.time;
+  imuRoll[imuPointerLast] = imu.roll;
+  imuPitch[imuPointerLast] = imu.pitch;
+  imuAcc[imuPointerLast] = imu.acc;
+  imuGyro[imuPointerLast] = imu.gyro;
+}
+
+// Extends imuSinceKeyFrame with the samples up to timeTo. False when the
+// samples do not cover the interval since the last key frame: the IMU dropped
+// out, or the ring no longer reaches back to the end of the last integration.
+// A single long step would be integrated as if the IMU had not changed
+// meanwhile, so imuSinceKeyFrame must not be used until the next key frame.
+// _imu_mutex held.
+bool MapOptimization::integrateImuMeasurements(double timeTo) {
+  if (imuPointerLast < 0) imuIntegrationValid = false;
+  if (!imuIntegrationValid) return false;
+
+  // walk the circular buffer from the oldest to the newest sample
+  for (int k = 1; k <= imuQueLength; ++k) {
+    int ind = (imuPointerLast + k) % imuQueLength;
+    if (imuTime[ind] <= imuIntegratedTime) continue;
+    if (imuTime[ind] > timeTo) break;
+    if (imuTime[ind] - imuIntegratedTime > imuMaxGap) {
+      imuIntegrationValid = false;
+      return false;
+    }
+    imuSinceKeyFrame.integrateMeasurement(imuAcc[ind].cast<double>(),
+                                          imuGyro[ind].cast<double>(),
+                                          imuTime[ind] - imuIntegratedTime);
+    imuIntegratedTime = imuTime[ind];
+  }
+  // samples still to come are integrated with the next scan
+  return timeTo - imuIntegratedTime <= imuMaxGap;
+}
+
+// After a key frame is saved: the next integration starts from its state
+void MapOptimization::resetImuIntegration() {
+  std::lock_guard<std::mutex> lock(_imu_mutex);
+  imuSinceKeyFrame.resetIntegrationAndSetBias(imuBiasLastKeyFrame);
+  imuIntegratedTime = timeLastKeyFrame;
+  imuIntegrationValid = imuStateInitialized;
+}
+
+void MapOptimization::predictTransformFromImu() {
+  if (!imuStateInitialized) return;
+
+  Pose3 predicted;
+  {
+    std::lock_guard<std::mutex> lock(_imu_mutex);
+    if (!integrateImuMeasurements(timeLaserOdometry + scanPeriod) ||
+        imuSinceKeyFrame.deltaTij() <= 0) {
+      return;
+    }
+    // propagate the last optimized key frame state to the end of this sweep
+    predicted =
+        imuSinceKeyFrame.predict(imuStateLastKeyFrame, imuBiasLastKeyFrame).pose();
+  }
+
+  transformTobeMapped[0] = predicted.rotation().pitch();
+  transformTobeMapped[1] = predicted.rotation().yaw();
+  transformTobeMapped[2] = predicted.rotation().roll();
+  transformTobeMapped[3] = predicted.translation().y();
+  transformTobeMapped[4] = predicted.translation().z();
+  transformTobeMapped[5] = predicted.translation().x();
+}
+
+void MapOptimization::addImuFactor(size_t key) {
+  using symbol_shorthand::B;
+  using symbol_shorthand::V;
+
+  std::lock_guard<std::mutex> lock(_imu_mutex);
+  if (imuPointerLast < 0) return;
+
+  if (!imuStateInitialized) {
+    // velocity and bias states start at the first key frame that has IMU data
+    gtSAMgraph.add(PriorFactor<gtsam::Vector3>(V(key), gtsam::Vector3::Zero(),
+                                               priorVelocityNoise));
+    gtSAMgraph.add(PriorFactor<imuBias::ConstantBias>(
+        B(key), imuBias::ConstantBias(), priorBiasNoise));
+    initialEstimate.insert(V(key), gtsam::Vector3(gtsam::Vector3::Zero()));
+    initialEstimate.insert(B(key), imuBias::ConstantBias());
+    return;
+  }
+
+  const PreintegratedImuMeasurements &pim = imuSinceKeyFrame;
+  const double timeTo = timeLaserOdometry + scanPeriod;
+  const bool covered = integrateImuMeasurements(timeTo);
+
+  if (covered && pim.deltaTij() > 0) {
+    gtSAMgraph.add(ImuFactor(key - 1, V(key - 1), key, V(key), B(key - 1), pim));
+    initialEstimate.insert(
+        V(key), pim.predict(imuStateLastKeyFrame, imuBiasLastKeyFrame).v());
+  } else {
+    // IMU gap or samples lost: keep the velocity chain connected
+    gtSAMgraph.add(BetweenFactor<gtsam::Vector3>(
+        V(key - 1), V(key), gtsam::Vector3::Zero(), velocityBetweenNoise));
+    initialEstimate.insert(V(key), imuStateLastKeyFrame.v());
+  }
+
+  const double dt = std::max(timeTo - timeLastKeyFrame, double(scanPeriod));
+  gtsam::Vector biasRandomWalk(6);
+  biasRandomWalk << imuAccBiasNoise, imuAccBiasNoise, imuAccBiasNoise,
+      imuGyrBiasNoise, imuGyrBiasNoise, imuGyrBiasNoise;
+  gtSAMgraph.add(BetweenFactor<imuBias::ConstantBias>(
+      B(key - 1), B(key), imuBias::ConstantBias(),
+      noiseModel::Diagonal::Sigmas(sqrt(dt) * biasRandomWalk)));
+  initialEstimate.insert(B(key), imuBiasLastKeyFrame);
+}
+
+void MapOptimization::addExternalOdometryFactor(size_t key) {
+  if (_odometry_buffer.empty()) return;
+
+  Eigen::Vector3d translation;
+  Eigen::Quaterniond rotation;
+  if (!_odometry_buffer.relativeMotion(cloudKeyPoses6D->points.back().time,
+                                       timeLaserOdometry, translation,
+                                       rotation)) {
+    return;
+  }
+  gtSAMgraph.add(BetweenFactor<Pose3>(
+      key - 1, key,
+      Pose3(Rot3::Quaternion(rotation.w(), rotation.x(), rotation.y(),
+                             rotation.z()),
+            Point3(translation.x(), translation.y(), translation.z())),
+      externalOdometryNoise));
 }
 
 void MapOptimization::publishTF() {
@@ -562,89 +788,186 @@ void MapOptimization::publishTF() {
 }
 
 void MapOptimization::publishKeyPosesAndFrames() {
-  if (pubKeyPoses.getNumSubscribers() != 0) {
-    sensor_msgs::PointCloud2 cloudMsgTemp;
-    pcl::toROSMsg(*cloudKeyPoses3D, cloudMsgTemp);
-    cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-    cloudMsgTemp.header.frame_id = "/camera_init";
-    pubKeyPoses.publish(cloudMsgTemp);
-  }
+  const ros::Time stamp = ros::Time().fromSec(timeLaserOdometry);
 
-  if (pubRecentKeyFrames.getNumSubscribers() != 0) {
-    sensor_msgs::PointCloud2 cloudMsgTemp;
-    pcl::toROSMsg(*laserCloudSurfFromMapDS, cloudMsgTemp);
-    cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-    cloudMsgTemp.header.frame_id = "/camera_init";
-    pubRecentKeyFrames.publish(cloudMsgTemp);
+  // key poses as published with the last trajectory snapshot, never modified
+  const TrajectorySnapshotPtr trajectory = std::atomic_load(&_trajectory);
+  if (trajectory) {
+    _publisher.publish(pubKeyPoses, trajectory->poses3D, stamp, "/camera_init");
   }
+
+  _publisher.publishCopy(pubRecentKeyFrames, *laserCloudSurfFromMapDS, stamp,
+                         "/camera_init");
 }
 
 void MapOptimization::publishGlobalMap() {
-  if (pubLaserCloudSurround.getNumSubscribers() == 0) return;
+  const TrajectorySnapshotPtr trajectory = std::atomic_load(&_trajectory);
+  if (!trajectory || trajectory->size() == 0) return;
 
-  if (cloudKeyPoses3D->points.empty() == true) return;
+  // the tiles are kept up to date even while nobody watches them
+  _map_tiles.update(*trajectory, keyFrames);
+
+  // a soak run has no viewer but must go through the rebuild a viewer causes
+  if (pubLaserCloudSurround.getNumSubscribers() == 0 && !_soak.enabled() &&
+      !_map_query) {
+    accountGlobalMapMemory(0);
+    return;
+  }
+
+  const PointTypePose &latestPose = trajectory->poses6D->points.back();
   // kd-tree to find near key frames to visualize
   std::vector<int> pointSearchIndGlobalMap;
   std::vector<float> pointSearchSqDisGlobalMap;
   // search near key frames to visualize
-  mtx.lock();
-  kdtreeGlobalMap.setInputCloud(cloudKeyPoses3D);
+  kdtreeGlobalMap.setInputCloud(trajectory->poses3D);
   kdtreeGlobalMap.radiusSearch(
-      currentRobotPosPoint, globalMapVisualizationSearchRadius,
+      trajectory->poses3D->points.back(), globalMapVisualizationSearchRadius,
       pointSearchIndGlobalMap, pointSearchSqDisGlobalMap);
-  mtx.unlock();
 
   for (int i = 0; i < pointSearchIndGlobalMap.size(); ++i)
     globalMapKeyPoses->points.push_back(
-        cloudKeyPoses3D->points[pointSearchIndGlobalMap[i]]);
+        trajectory->poses3D->points[pointSearchIndGlobalMap[i]]);
   // downsample near selected key frames
   downSizeFilterGlobalMapKeyPoses.setInputCloud(globalMapKeyPoses);
   downSizeFilterGlobalMapKeyPoses.filter(*globalMapKeyPosesDS);
   // extract visualized and downsampled key frames
   for (int i = 0; i < globalMapKeyPosesDS->points.size(); ++i) {
     int thisKeyInd = (int)globalMapKeyPosesDS->points[i].intensity;
-    *globalMapKeyFrames += *transformPointCloud(
-        cornerCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
-    *globalMapKeyFrames += *transformPointCloud(
-        surfCloudKeyFrames[thisKeyInd], &cloudKeyPoses6D->points[thisKeyInd]);
-    *globalMapKeyFrames +=
-        *transformPointCloud(outlierCloudKeyFrames[thisKeyInd],
-                             &cloudKeyPoses6D->points[thisKeyInd]);
+    const KeyFrame &keyFrame = keyFrames[thisKeyInd];
+    const PointTypePose *thisPose = &trajectory->poses6D->points[thisKeyInd];
+    *globalMapKeyFrames += *transformPointCloud(keyFrame.corner(), thisPose);
+    *globalMapKeyFrames += *transformPointCloud(keyFrame.surf(), thisPose);
+    *globalMapKeyFrames += *transformPointCloud(keyFrame.outlier(), thisPose);
   }
   // downsample visualized points
   downSizeFilterGlobalMapKeyFrames.setInputCloud(globalMapKeyFrames);
   downSizeFilterGlobalMapKeyFrames.filter(*globalMapKeyFramesDS);
 
-  sensor_msgs::PointCloud2 cloudMsgTemp;
-  pcl::toROSMsg(*globalMapKeyFramesDS, cloudMsgTemp);
-  cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
-  cloudMsgTemp.header.frame_id = "/camera_init";
-  pubLaserCloudSurround.publish(cloudMsgTemp);
+  // serialized and compressed on the publisher thread
+  _publisher.publishCopy(pubLaserCloudSurround, *globalMapKeyFramesDS,
+                         ros::Time().fromSec(latestPose.time), "/camera_init",
+                         AsyncPublisher::RAW | AsyncPublisher::COMPRESSED);
+
+  size_t snapshotBytes = 0;
+  if (_map_query) {
+    // the downsampled map moves to the snapshot, the queries hold it from there
+    pcl::PointCloud<PointType>::Ptr snapshotCloud(new pcl::PointCloud<PointType>());
+    snapshotCloud->swap(*globalMapKeyFramesDS);
+    MapSnapshotPtr snapshot(new MapSnapshot(snapshotCloud, latestPose.time));
+    snapshotBytes = snapshot->bytes();
+    std::atomic_store(&_map_snapshot, snapshot);
+  }
 
   globalMapKeyPoses->clear();
   globalMapKeyPosesDS->clear();
   globalMapKeyFrames->clear();
-  //globalMapKeyFramesDS->clear();
+  globalMapKeyFramesDS->clear();
+
+  // the buffers are kept for the next publication unless memory is short
+  if (_memory.overCeiling()) {
+    pcl::PointCloud<PointType>().swap(*globalMapKeyPoses);
+    pcl::PointCloud<PointType>().swap(*globalMapKeyPosesDS);
+    pcl::PointCloud<PointType>().swap(*globalMapKeyFrames);
+    pcl::PointCloud<PointType>().swap(*globalMapKeyFramesDS);
+  }
+  accountGlobalMapMemory(snapshotBytes);
+}
+
+void MapOptimization::accountGlobalMapMemory(size_t snapshotBytes) {
+  _global_map_memory.set(
+      cloudBytes(globalMapKeyPoses) + cloudBytes(globalMapKeyPosesDS) +
+      cloudBytes(globalMapKeyFrames) + cloudBytes(globalMapKeyFramesDS) +
+      kdtreeGlobalMap.usedMemory() + snapshotBytes + _map_tiles.bytes());
+}
+
+bool MapOptimization::queryMap(cloud_msgs::QueryMap::Request &request,
+                               cloud_msgs::QueryMap::Response &response) {
+  const MapSnapshotPtr snapshot = mapSnapshot();
+  response.success = bool(snapshot);
+  if (!snapshot) return true;
+
+  auto toPoint = [](const geometry_msgs::Point &point) {
+    PointType p;
+    p.x = point.x;
+    p.y = point.y;
+    p.z = point.z;
+    return p;
+  };
+
+  // requests come from other nodes: nothing unbounded reaches the kd-tree
+  auto finite = [](const geometry_msgs::Point &point) {
+    return std::isfinite(point.x) && std::isfinite(point.y) &&
+           std::isfinite(point.z);
+  };
+  bool valid = false;
+  switch (request.type) {
+    case cloud_msgs::QueryMap::Request::RADIUS:
+      valid = finite(request.center) && std::isfinite(request.radius) &&
+              request.radius > 0;
+      break;
+    case cloud_msgs::QueryMap::Request::BOX:
+      valid = finite(request.min) && finite(request.max) &&
+              request.min.x <= request.max.x &&
+              request.min.y <= request.max.y && request.min.z <= request.max.z;
+      break;
+    case cloud_msgs::QueryMap::Request::NEAREST:
+      valid = finite(request.center) && request.k > 0 &&
+              request.k <= mapQueryMaxK;
+      break;
+  }
+  if (!valid) {
+    ROS_WARN_THROTTLE(10, "Invalid map query rejected");
+    response.success = false;
+    return true;
+  }
+
+  pcl::PointCloud<PointType> result;
+  switch (request.type) {
+    case cloud_msgs::QueryMap::Request::RADIUS:
+      snapshot->radiusSearch(toPoint(request.center), request.radius,
+                             request.max_points, result);
+      break;
+    case cloud_msgs::QueryMap::Request::BOX:
+      snapshot->boxSearch(toPoint(request.min), toPoint(request.max),
+                          request.max_points, result);
+      break;
+    case cloud_msgs::QueryMap::Request::NEAREST:
+      snapshot->nearestKSearch(toPoint(request.center), request.k, result);
+      break;
+    default:
+      response.success = false;
+      return true;
+  }
+
+  response.points.header.stamp = ros::Time().fromSec(snapshot->time());
+  response.points.header.frame_id = "/camera_init";
+  toPackedCloud(result, response.points);
+  return true;
 }
 
 bool MapOptimization::detectLoopClosure() {
   latestSurfKeyFrameCloud->clear();
-  nearHistorySurfKeyFrameCloud->clear();
-  nearHistorySurfKeyFrameCloudDS->clear();
+  _loop_target.reset();
+
+  // the latest key frame is matched against the old ones around it
+  _loop_trajectory = std::atomic_load(&_trajectory);
+  const pcl::PointCloud<PointTypePose> &historyKeyPoses6D =
+      *_loop_trajectory->poses6D;
+  latestFrameIDLoopCloure = _loop_trajectory->size() - 1;
+  const PointTypePose &latestPose = historyKeyPoses6D.points.back();
 
-  std::lock_guard<std::mutex> lock(mtx);
   // find the closest history key frame
   std::vector<int> pointSearchIndLoop;
   std::vector<float> pointSearchSqDisLoop;
-  kdtreeHistoryKeyPoses.setInputCloud(cloudKeyPoses3D);
+  kdtreeHistoryKeyPoses.setInputCloud(_loop_trajectory->poses3D);
   kdtreeHistoryKeyPoses.radiusSearch(
-      currentRobotPosPoint, historyKeyframeSearchRadius, pointSearchIndLoop,
-      pointSearchSqDisLoop);
+      _loop_trajectory->poses3D->points.back(), historyKeyframeSearchRadius,
+      pointSearchIndLoop, pointSearchSqDisLoop);
 
   closestHistoryFrameID = -1;
   for (int i = 0; i < pointSearchIndLoop.size(); ++i) {
     int id = pointSearchIndLoop[i];
-    if (abs(cloudKeyPoses6D->points[id].time - timeLaserOdometry) > 30.0) {
+    if (abs(historyKeyPoses6D.points[id].time - latestPose.time) > 30.0) {
       closestHistoryFrameID = id;
       break;
     }
@@ -653,13 +976,12 @@ bool MapOptimization::detectLoopClosure() {
     return false;
   }
   // save latest key frames
-  latestFrameIDLoopCloure = cloudKeyPoses3D->points.size() - 1;
   *latestSurfKeyFrameCloud +=
-      *transformPointCloud(cornerCloudKeyFrames[latestFrameIDLoopCloure],
-                           &cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
+      *transformPointCloud(keyFrames[latestFrameIDLoopCloure].corner(),
+                           &historyKeyPoses6D.points[latestFrameIDLoopCloure]);
   *latestSurfKeyFrameCloud +=
-      *transformPointCloud(surfCloudKeyFrames[latestFrameIDLoopCloure],
-                           &cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
+      *transformPointCloud(keyFrames[latestFrameIDLoopCloure].surf(),
+                           &historyKeyPoses6D.points[latestFrameIDLoopCloure]);
 
   pcl::PointCloud<PointType>::Ptr hahaCloud(new pcl::PointCloud<PointType>());
   int cloudSize = latestSurfKeyFrameCloud->points.size();
@@ -670,26 +992,22 @@ bool MapOptimization::detectLoopClosure() {
   }
   latestSurfKeyFrameCloud->clear();
   *latestSurfKeyFrameCloud = *hahaCloud;
-  // save history near key frames
-  for (int j = -historyKeyframeSearchNum; j <= historyKeyframeSearchNum; ++j) {
-    if (closestHistoryFrameID + j < 0 ||
-        closestHistoryFrameID + j > latestFrameIDLoopCloure)
-      continue;
-    *nearHistorySurfKeyFrameCloud += *transformPointCloud(
-        cornerCloudKeyFrames[closestHistoryFrameID + j],
-        &cloudKeyPoses6D->points[closestHistoryFrameID + j]);
-    *nearHistorySurfKeyFrameCloud += *transformPointCloud(
-        surfCloudKeyFrames[closestHistoryFrameID + j],
-        &cloudKeyPoses6D->points[closestHistoryFrameID + j]);
+  // history near key frames, prepared already if this candidate was tried
+  const int first = std::max(closestHistoryFrameID - historyKeyframeSearchNum, 0);
+  const int last = std::min(closestHistoryFrameID + historyKeyframeSearchNum,
+                            latestFrameIDLoopCloure);
+  _loop_target = _loop_targets.find(closestHistoryFrameID,
+                                    _loop_trajectory->correction, first, last);
+  if (!_loop_target) {
+    _loop_target = prepareLoopClosureTarget(historyKeyPoses6D, first, last);
+    _loop_targets.insert(_loop_target);
   }
-
-  downSizeFilterHistoryKeyFrames.setInputCloud(nearHistorySurfKeyFrameCloud);
-  downSizeFilterHistoryKeyFrames.filter(*nearHistorySurfKeyFrameCloudDS);
+  _loop_target_memory.set(_loop_targets.bytes());
   // publish history near key frames
   if (pubHistoryKeyFrames.getNumSubscribers() != 0) {
     sensor_msgs::PointCloud2 cloudMsgTemp;
-    pcl::toROSMsg(*nearHistorySurfKeyFrameCloudDS, cloudMsgTemp);
-    cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
+    pcl::toROSMsg(*_loop_target->cloud, cloudMsgTemp);
+    cloudMsgTemp.header.stamp = ros::Time().fromSec(latestPose.time);
     cloudMsgTemp.header.frame_id = "/camera_init";
     pubHistoryKeyFrames.publish(cloudMsgTemp);
   }
@@ -697,17 +1015,47 @@ bool MapOptimization::detectLoopClosure() {
   return true;
 }
 
+LoopClosureTargetPtr MapOptimization::prepareLoopClosureTarget(
+    const pcl::PointCloud<PointTypePose> &poses, int first, int last) {
+  std::shared_ptr<LoopClosureTarget> target(new LoopClosureTarget);
+  target->center = closestHistoryFrameID;
+  target->correction = _loop_trajectory->correction;
+  target->first = first;
+  target->last = last;
+
+  nearHistorySurfKeyFrameCloud->clear();
+  for (int i = first; i <= last; ++i) {
+    *nearHistorySurfKeyFrameCloud +=
+        *transformPointCloud(keyFrames[i].corner(), &poses.points[i]);
+    *nearHistorySurfKeyFrameCloud +=
+        *transformPointCloud(keyFrames[i].surf(), &poses.points[i]);
+  }
+  target->cloud.reset(new pcl::PointCloud<PointType>());
+  downSizeFilterHistoryKeyFrames.setInputCloud(nearHistorySurfKeyFrameCloud);
+  downSizeFilterHistoryKeyFrames.filter(*target->cloud);
+
+  target->kdtree.reset(new pcl::search::KdTree<PointType>());
+  target->kdtree->setInputCloud(target->cloud);
+  return target;
+}
+
 void MapOptimization::performLoopClosure() {
 
-  if (cloudKeyPoses3D->points.empty() == true)
+  if (!std::atomic_load(&_trajectory))
     return;
 
+  if (_memory.overCeiling()) {
+    _loop_targets.clear();
+    _loop_target_memory.set(0);
+  }
+
   // try to find close key frame if there are any
   if (potentialLoopFlag == false) {
     if (detectLoopClosure() == true) {
       potentialLoopFlag = true;  // find some key frames that is old enough or
                                  // close enough for loop closure
-      timeSaveFirstCurrentScanForLoopClosure = timeLaserOdometry;
+      timeSaveFirstCurrentScanForLoopClosure =
+          _loop_trajectory->poses6D->points.back().time;
     }
     if (potentialLoopFlag == false) return;
   }
@@ -722,7 +1070,8 @@ void MapOptimization::performLoopClosure() {
   icp.setRANSACIterations(0);
   // Align clouds
   icp.setInputSource(latestSurfKeyFrameCloud);
-  icp.setInputTarget(nearHistorySurfKeyFrameCloudDS);
+  icp.setInputTarget(_loop_target->cloud);
+  icp.setSearchMethodTarget(_loop_target->kdtree, true);  // built already
   pcl::PointCloud<PointType>::Ptr unused_result(
       new pcl::PointCloud<PointType>());
   icp.align(*unused_result);
@@ -738,7 +1087,8 @@ void MapOptimization::performLoopClosure() {
                              icp.getFinalTransformation());
     sensor_msgs::PointCloud2 cloudMsgTemp;
     pcl::toROSMsg(*closed_cloud, cloudMsgTemp);
-    cloudMsgTemp.header.stamp = ros::Time().fromSec(timeLaserOdometry);
+    cloudMsgTemp.header.stamp =
+        ros::Time().fromSec(_loop_trajectory->poses6D->points.back().time);
     cloudMsgTemp.header.frame_id = "/camera_init";
     pubIcpKeyFrames.publish(cloudMsgTemp);
   }
@@ -756,7 +1106,7 @@ void MapOptimization::performLoopClosure() {
       pcl::getTransformation(z, x, y, yaw, roll, pitch);
   // transform from world origin to wrong pose
   Eigen::Affine3f tWrong = pclPointToAffine3fCameraToLidar(
-      cloudKeyPoses6D->points[latestFrameIDLoopCloure]);
+      _loop_trajectory->poses6D->points[latestFrameIDLoopCloure]);
   // transform from world origin to corrected pose
   Eigen::Affine3f tCorrect =
       correctionLidarFrame *
@@ -765,7 +1115,8 @@ void MapOptimization::performLoopClosure() {
   gtsam::Pose3 poseFrom =
       Pose3(Rot3::RzRyRx(roll, pitch, yaw), Point3(x, y, z));
   gtsam::Pose3 poseTo =
-      pclPointTogtsamPose3(cloudKeyPoses6D->points[closestHistoryFrameID]);
+      pclPointTogtsamPose3(
+          _loop_trajectory->poses6D->points[closestHistoryFrameID]);
   gtsam::Vector Vector6(6);
   float noiseScore = icp.getFitnessScore();
   Vector6 << noiseScore, noiseScore, noiseScore, noiseScore, noiseScore,
@@ -774,13 +1125,16 @@ void MapOptimization::performLoopClosure() {
   /*
           add constraints
           */
-  std::lock_guard<std::mutex> lock(mtx);
-  gtSAMgraph.add(
+  NonlinearFactorGraph loopGraph;
+  loopGraph.add(
       BetweenFactor<Pose3>(latestFrameIDLoopCloure, closestHistoryFrameID,
                            poseFrom.between(poseTo), constraintNoise));
-  isam->update(gtSAMgraph);
-  isam->update();
-  gtSAMgraph.resize(0);
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    isam->update(loopGraph);
+    isam->update();
+    _journal.appendLoopClosure(loopGraph);
+  }
 
   aLoopIsClosed = true;
 }
@@ -805,11 +1159,11 @@ void MapOptimization::extractSurroundingKeyFrames() {
         updateTransformPointCloudSinCos(&thisTransformation);
         // extract surrounding map
         recentCornerCloudKeyFrames.push_front(
-            transformPointCloud(cornerCloudKeyFrames[thisKeyInd]));
+            transformPointCloud(keyFrames[thisKeyInd].corner()));
         recentSurfCloudKeyFrames.push_front(
-            transformPointCloud(surfCloudKeyFrames[thisKeyInd]));
+            transformPointCloud(keyFrames[thisKeyInd].surf()));
         recentOutlierCloudKeyFrames.push_front(
-            transformPointCloud(outlierCloudKeyFrames[thisKeyInd]));
+            transformPointCloud(keyFrames[thisKeyInd].outlier()));
         if (recentCornerCloudKeyFrames.size() >= surroundingKeyframeSearchNum)
           break;
       }
@@ -828,11 +1182,11 @@ void MapOptimization::extractSurroundingKeyFrames() {
             cloudKeyPoses6D->points[latestFrameID];
         updateTransformPointCloudSinCos(&thisTransformation);
         recentCornerCloudKeyFrames.push_back(
-            transformPointCloud(cornerCloudKeyFrames[latestFrameID]));
+            transformPointCloud(keyFrames[latestFrameID].corner()));
         recentSurfCloudKeyFrames.push_back(
-            transformPointCloud(surfCloudKeyFrames[latestFrameID]));
+            transformPointCloud(keyFrames[latestFrameID].surf()));
         recentOutlierCloudKeyFrames.push_back(
-            transformPointCloud(outlierCloudKeyFrames[latestFrameID]));
+            transformPointCloud(keyFrames[latestFrameID].outlier()));
       }
     }
 
@@ -847,7 +1201,7 @@ void MapOptimization::extractSurroundingKeyFrames() {
     // extract all the nearby key poses and downsample them
     kdtreeSurroundingKeyPoses.setInputCloud(cloudKeyPoses3D);
     kdtreeSurroundingKeyPoses.radiusSearch(
-        currentRobotPosPoint, (double)surroundingKeyframeSearchRadius,
+        currentRobotPosPoint, (double)_tuning.surroundingKeyframeSearchRadius,
         pointSearchInd, pointSearchSqDis);
 
     for (int i = 0; i < pointSearchInd.size(); ++i){
@@ -899,11 +1253,11 @@ void MapOptimization::extractSurroundingKeyFrames() {
         updateTransformPointCloudSinCos(&thisTransformation);
         surroundingExistingKeyPosesID.push_back(thisKeyInd);
         surroundingCornerCloudKeyFrames.push_back(
-            transformPointCloud(cornerCloudKeyFrames[thisKeyInd]));
+            transformPointCloud(keyFrames[thisKeyInd].corner()));
         surroundingSurfCloudKeyFrames.push_back(
-            transformPointCloud(surfCloudKeyFrames[thisKeyInd]));
+            transformPointCloud(keyFrames[thisKeyInd].surf()));
         surroundingOutlierCloudKeyFrames.push_back(
-            transformPointCloud(outlierCloudKeyFrames[thisKeyInd]));
+            transformPointCloud(keyFrames[thisKeyInd].outlier()));
       }
     }
 
@@ -1040,14 +1394,13 @@ void MapOptimization::cornerOptimization(int iterCount) {
 
         float ld2 = a012 / l12;
 
-        float s = 1 - 0.9 * fabs(ld2);
-
-        coeff.x = s * la;
-        coeff.y = s * lb;
-        coeff.z = s * lc;
-        coeff.intensity = s * ld2;
+        float s;
+        if (cornerRobustKernel.rowScale(ld2, s)) {
+          coeff.x = s * la;
+          coeff.y = s * lb;
+          coeff.z = s * lc;
+          coeff.intensity = s * ld2;
 
-        if (s > 0.1) {
           laserCloudOri->push_back(pointOri);
           coeffSel->push_back(coeff);
         }
@@ -1100,17 +1453,16 @@ void MapOptimization::surfOptimization(int iterCount) {
       if (planeValid) {
         float pd2 = pa * pointSel.x + pb * pointSel.y + pc * pointSel.z + pd;
 
-        float s = 1 - 0.9 * fabs(pd2) /
-                          sqrt(sqrt(pointSel.x * pointSel.x +
-                                    pointSel.y * pointSel.y +
-                                    pointSel.z * pointSel.z));
-
-        coeff.x = s * pa;
-        coeff.y = s * pb;
-        coeff.z = s * pc;
-        coeff.intensity = s * pd2;
+        float s;
+        if (surfRobustKernel.rowScale(pd2 / sqrt(sqrt(pointSel.x * pointSel.x +
+                                                      pointSel.y * pointSel.y +
+                                                      pointSel.z * pointSel.z)),
+                                      s)) {
+          coeff.x = s * pa;
+          coeff.y = s * pb;
+          coeff.z = s * pc;
+          coeff.intensity = s * pd2;
 
-        if (s > 0.1) {
           laserCloudOri->push_back(pointOri);
           coeffSel->push_back(coeff);
         }
@@ -1236,20 +1588,141 @@ bool MapOptimization::LMOptimization(int iterCount) {
 
 void MapOptimization::scan2MapOptimization() {
   if (laserCloudCornerFromMapDSNum > 10 && laserCloudSurfFromMapDSNum > 100) {
+    const auto buildStart = std::chrono::steady_clock::now();
     kdtreeCornerFromMap.setInputCloud(laserCloudCornerFromMapDS);
     kdtreeSurfFromMap.setInputCloud(laserCloudSurfFromMapDS);
+    if (_kdtree_build_compare) {
+      benchmarkKdTreeBuild(std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - buildStart)
+                               .count());
+    }
 
-    for (int iterCount = 0; iterCount < 10; iterCount++) {
-      laserCloudOri->clear();
-      coeffSel->clear();
+    const int iterCount =
+        _knn_compare ? benchmarkApproximateSearch() : matchScanToMap();
 
-      cornerOptimization(iterCount);
-      surfOptimization(iterCount);
+    transformUpdate();
 
-      if (LMOptimization(iterCount) == true) break;
+    if (timeLastMapped > 0 && timeLaserOdometry > timeLastMapped) {
+      float rotation = sqrt(pow(transformAftMapped[0] - transformLastMapped[0], 2) +
+                            pow(transformAftMapped[1] - transformLastMapped[1], 2) +
+                            pow(transformAftMapped[2] - transformLastMapped[2], 2));
+      bool aggressive =
+          rotation / (timeLaserOdometry - timeLastMapped) > aggressiveRotationRate;
+      lmIterationStats.add(std::min(iterCount + 1, 10), aggressive);
     }
+    for (int i = 0; i < 6; ++i) transformLastMapped[i] = transformAftMapped[i];
+    timeLastMapped = timeLaserOdometry;
+
+    if (lmIterationStats.total() == 100) {
+      ROS_INFO("Mapping LM iterations per scan: %.2f, aggressive motion: %.2f "
+               "(%lu scans), rejected correspondences: %.1f%% corner %.1f%% "
+               "surf, initial guess from %s",
+               lmIterationStats.mean(false), lmIterationStats.mean(true),
+               lmIterationStats.scans[1],
+               100 * cornerRobustKernel.rejectedRatio(),
+               100 * surfRobustKernel.rejectedRatio(),
+               imuStateInitialized ? "IMU preintegration" : "odometry");
+      lmIterationStats.reset();
+      cornerRobustKernel.resetStats();
+      surfRobustKernel.resetStats();
+
+      if (_kdtree_build_compare && kdtreeBuildBenchmark.builds > 0) {
+        const KdTreeBuildBenchmark &b = kdtreeBuildBenchmark;
+        ROS_INFO("Map kd-tree build, %d tasks vs serial: %.3f / %.3f ms per "
+                 "scan (%lu points), speed-up %.2f, differing neighbours "
+                 "%lu / %lu",
+                 _kdtree_build_tasks, b.parallelTime * 1000 / b.builds,
+                 b.serialTime * 1000 / b.builds, b.points / b.builds,
+                 b.parallelTime > 0 ? b.serialTime / b.parallelTime : 0.0,
+                 b.mismatches, b.queries);
+      }
+      kdtreeBuildBenchmark.reset();
 
-    transformUpdate();
+      if (_knn_compare) {
+        knnBenchmark.report("Mapping", _knn_eps, _knn_max_leaves);
+      }
+      knnBenchmark.reset();
+    }
+  }
+}
+
+int MapOptimization::matchScanToMap() {
+  int iterCount = 0;
+  for (; iterCount < 10; iterCount++) {
+    laserCloudOri->clear();
+    coeffSel->clear();
+
+    cornerOptimization(iterCount);
+    surfOptimization(iterCount);
+
+    if (LMOptimization(iterCount) == true) break;
+  }
+  return iterCount;
+}
+
+void MapOptimization::setApproximateSearch(bool approximate) {
+  // the serial tree of ~kdtree_build_compare must find the same neighbours
+  for (auto *kdtree : {&kdtreeCornerFromMap, &kdtreeSurfFromMap,
+                       &_kdtree_build_reference}) {
+    kdtree->setEpsilon(approximate ? _knn_eps : 0);
+    kdtree->setMaxLeafChecks(approximate ? std::max(_knn_max_leaves, 0) : 0);
+  }
+}
+
+int MapOptimization::benchmarkApproximateSearch() {
+  using Clock = std::chrono::steady_clock;
+  float initial[6], exact[6];
+  std::copy(transformTobeMapped, transformTobeMapped + 6, initial);
+  // the statistics count the approximate pass only
+  const RobustKernel cornerKernel = cornerRobustKernel;
+  const RobustKernel surfKernel = surfRobustKernel;
+
+  setApproximateSearch(false);
+  auto start = Clock::now();
+  matchScanToMap();
+  const double exactTime =
+      std::chrono::duration<double>(Clock::now() - start).count();
+  std::copy(transformTobeMapped, transformTobeMapped + 6, exact);
+
+  std::copy(initial, initial + 6, transformTobeMapped);
+  cornerRobustKernel = cornerKernel;
+  surfRobustKernel = surfKernel;
+  setApproximateSearch(true);
+  start = Clock::now();
+  const int iterCount = matchScanToMap();
+  knnBenchmark.add(exactTime,
+                   std::chrono::duration<double>(Clock::now() - start).count(),
+                   exact, transformTobeMapped);
+  return iterCount;
+}
+
+void MapOptimization::benchmarkKdTreeBuild(double parallelTime) {
+  using Clock = std::chrono::steady_clock;
+  KdTreeBuildBenchmark &b = kdtreeBuildBenchmark;
+  b.builds++;
+  b.parallelTime += parallelTime;
+
+  std::vector<int> serialInd;
+  std::vector<float> serialSqDis;
+  for (bool corner : {true, false}) {
+    const auto &cloud =
+        corner ? laserCloudCornerFromMapDS : laserCloudSurfFromMapDS;
+    const auto start = Clock::now();
+    _kdtree_build_reference.setInputCloud(cloud);
+    b.serialTime += std::chrono::duration<double>(Clock::now() - start).count();
+    b.points += cloud->size();
+
+    // the same splits give the same neighbours, in the same order
+    auto &kdtree = corner ? kdtreeCornerFromMap : kdtreeSurfFromMap;
+    const size_t step = std::max<size_t>(1, cloud->size() / 16);
+    for (size_t i = 0; i < cloud->size(); i += step) {
+      kdtree.nearestKSearch(cloud->points[i], 5, pointSearchInd,
+                            pointSearchSqDis);
+      _kdtree_build_reference.nearestKSearch(cloud->points[i], 5, serialInd,
+                                             serialSqDis);
+      b.queries++;
+      if (serialInd != pointSearchInd) b.mismatches++;
+    }
   }
 }
 
@@ -1271,6 +1744,7 @@ void MapOptimization::saveKeyFramesAndFactor() {
   if (saveThisKeyFrame == false && !cloudKeyPoses3D->points.empty()) return;
 
   previousRobotPosPoint = currentRobotPosPoint;
+  const size_t thisKey = cloudKeyPoses3D->points.size();
   /**
    * update grsam graph
    */
@@ -1288,6 +1762,7 @@ void MapOptimization::saveKeyFramesAndFactor() {
                  Point3(transformTobeMapped[5], transformTobeMapped[3],
                         transformTobeMapped[4])));
     for (int i = 0; i < 6; ++i) transformLast[i] = transformTobeMapped[i];
+    if (imuPreintegrationEnableFlag) addImuFactor(thisKey);
   } else {
     gtsam::Pose3 poseFrom = Pose3(
         Rot3::RzRyRx(transformLast[2], transformLast[0], transformLast[1]),
@@ -1306,15 +1781,19 @@ void MapOptimization::saveKeyFramesAndFactor() {
                            transformAftMapped[1]),
               Point3(transformAftMapped[5], transformAftMapped[3],
                      transformAftMapped[4])));
+    if (imuPreintegrationEnableFlag) addImuFactor(thisKey);
+    addExternalOdometryFactor(thisKey);
   }
   /**
    * update iSAM
    */
-  isam->update(gtSAMgraph, initialEstimate);
-  isam->update();
-
-  gtSAMgraph.resize(0);
-  initialEstimate.clear();
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    isam->update(gtSAMgraph, initialEstimate);
+    isam->update();
+    isamCurrentEstimate = isam->calculateEstimate();
+    _isam_memory.set(isamBytes());
+  }
 
   /**
    * save key poses
@@ -1323,9 +1802,11 @@ void MapOptimization::saveKeyFramesAndFactor() {
   PointTypePose thisPose6D;
   Pose3 latestEstimate;
 
-  isamCurrentEstimate = isam->calculateEstimate();
-  latestEstimate =
-      isamCurrentEstimate.at<Pose3>(isamCurrentEstimate.size() - 1);
+  latestEstimate = isamCurrentEstimate.at<Pose3>(thisKey);
+
+  updateImuStateFromEstimate(thisKey);
+  timeLastKeyFrame = timeLaserOdometry + scanPeriod;
+  resetImuIntegration();
 
   thisPose3D.x = latestEstimate.translation().y();
   thisPose3D.y = latestEstimate.translation().z();
@@ -1371,41 +1852,136 @@ void MapOptimization::saveKeyFramesAndFactor() {
   pcl::copyPointCloud(*laserCloudSurfLastDS, *thisSurfKeyFrame);
   pcl::copyPointCloud(*laserCloudOutlierLastDS, *thisOutlierKeyFrame);
 
-  cornerCloudKeyFrames.push_back(thisCornerKeyFrame);
-  surfCloudKeyFrames.push_back(thisSurfKeyFrame);
-  outlierCloudKeyFrames.push_back(thisOutlierKeyFrame);
+  keyFrames.append(thisCornerKeyFrame, thisSurfKeyFrame, thisOutlierKeyFrame);
+  // before the snapshot: loop closures only refer to journaled key frames
+  _journal.appendKeyFrame(gtSAMgraph, initialEstimate, thisPose6D,
+                          thisCornerKeyFrame, thisSurfKeyFrame,
+                          thisOutlierKeyFrame);
+  publishTrajectorySnapshot(false);
+
+  gtSAMgraph.resize(0);
+  initialEstimate.clear();
 }
 
 void MapOptimization::correctPoses() {
-  if (aLoopIsClosed == true) {
+  if (aLoopIsClosed.exchange(false)) {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      isamCurrentEstimate = isam->calculateEstimate();
+      _isam_memory.set(isamBytes());
+    }
     recentCornerCloudKeyFrames.clear();
     recentSurfCloudKeyFrames.clear();
     recentOutlierCloudKeyFrames.clear();
-    // update key poses
-    int numPoses = isamCurrentEstimate.size();
-    for (int i = 0; i < numPoses; ++i) {
-      cloudKeyPoses3D->points[i].x =
-          isamCurrentEstimate.at<Pose3>(i).translation().y();
-      cloudKeyPoses3D->points[i].y =
-          isamCurrentEstimate.at<Pose3>(i).translation().z();
-      cloudKeyPoses3D->points[i].z =
-          isamCurrentEstimate.at<Pose3>(i).translation().x();
-
-      cloudKeyPoses6D->points[i].x = cloudKeyPoses3D->points[i].x;
-      cloudKeyPoses6D->points[i].y = cloudKeyPoses3D->points[i].y;
-      cloudKeyPoses6D->points[i].z = cloudKeyPoses3D->points[i].z;
-      cloudKeyPoses6D->points[i].roll =
-          isamCurrentEstimate.at<Pose3>(i).rotation().pitch();
-      cloudKeyPoses6D->points[i].pitch =
-          isamCurrentEstimate.at<Pose3>(i).rotation().yaw();
-      cloudKeyPoses6D->points[i].yaw =
-          isamCurrentEstimate.at<Pose3>(i).rotation().roll();
+    updateKeyPosesFromEstimate();
+    // the IMU prediction and the next velocity guess start from the corrected
+    // state of the latest key frame
+    if (!cloudKeyPoses3D->points.empty()) {
+      updateImuStateFromEstimate(cloudKeyPoses3D->points.size() - 1);
     }
+    publishTrajectorySnapshot(true);
+  }
+}
+
+void MapOptimization::updateImuStateFromEstimate(size_t key) {
+  if (!isamCurrentEstimate.exists(symbol_shorthand::V(key))) return;
+  imuStateLastKeyFrame =
+      NavState(isamCurrentEstimate.at<Pose3>(key),
+               isamCurrentEstimate.at<gtsam::Vector3>(symbol_shorthand::V(key)));
+  imuBiasLastKeyFrame =
+      isamCurrentEstimate.at<imuBias::ConstantBias>(symbol_shorthand::B(key));
+  imuStateInitialized = true;
+}
 
-    aLoopIsClosed = false;
+// The estimate also holds IMU velocity and bias states
+void MapOptimization::updateKeyPosesFromEstimate() {
+  int numPoses = cloudKeyPoses3D->points.size();
+  for (int i = 0; i < numPoses; ++i) {
+    cloudKeyPoses3D->points[i].x =
+        isamCurrentEstimate.at<Pose3>(i).translation().y();
+    cloudKeyPoses3D->points[i].y =
+        isamCurrentEstimate.at<Pose3>(i).translation().z();
+    cloudKeyPoses3D->points[i].z =
+        isamCurrentEstimate.at<Pose3>(i).translation().x();
+
+    cloudKeyPoses6D->points[i].x = cloudKeyPoses3D->points[i].x;
+    cloudKeyPoses6D->points[i].y = cloudKeyPoses3D->points[i].y;
+    cloudKeyPoses6D->points[i].z = cloudKeyPoses3D->points[i].z;
+    cloudKeyPoses6D->points[i].roll =
+        isamCurrentEstimate.at<Pose3>(i).rotation().pitch();
+    cloudKeyPoses6D->points[i].pitch =
+        isamCurrentEstimate.at<Pose3>(i).rotation().yaw();
+    cloudKeyPoses6D->points[i].yaw =
+        isamCurrentEstimate.at<Pose3>(i).rotation().roll();
   }
 }
 
+// Rebuilds the graph in a single iSAM2 update, linearized at the poses saved
+// with the key frames rather than at the initial guesses. The IMU states are
+// not carried over: the first key frame of this run starts a new IMU chain,
+// and the vehicle is assumed to restart where the journal ends.
+void MapOptimization::restoreFromJournal(JournalContents &contents) {
+  const auto startTime = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < contents.keyFrames.size(); ++i) {
+    if (contents.values.exists(i)) {
+      contents.values.update(
+          i, GenericValue<Pose3>(pclPointTogtsamPose3(contents.keyFrames[i].pose)));
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    isam->update(contents.graph, contents.values);
+    isam->update();
+    isamCurrentEstimate = isam->calculateEstimate();
+    _isam_memory.set(isamBytes());
+  }
+
+  for (JournalContents::KeyFrame &keyFrame : contents.keyFrames) {
+    PointType pose3D;
+    pose3D.intensity = keyFrame.pose.intensity;
+    cloudKeyPoses3D->push_back(pose3D);
+    cloudKeyPoses6D->push_back(keyFrame.pose);
+    keyFrames.append(keyFrame.corner, keyFrame.surf, keyFrame.outlier);
+  }
+  updateKeyPosesFromEstimate();
+
+  const PointTypePose &last = cloudKeyPoses6D->points.back();
+  transformAftMapped[0] = last.roll;
+  transformAftMapped[1] = last.pitch;
+  transformAftMapped[2] = last.yaw;
+  transformAftMapped[3] = last.x;
+  transformAftMapped[4] = last.y;
+  transformAftMapped[5] = last.z;
+  for (int i = 0; i < 6; ++i) {
+    transformLast[i] = transformAftMapped[i];
+    transformTobeMapped[i] = transformAftMapped[i];
+  }
+  previousRobotPosPoint.x = last.x;
+  previousRobotPosPoint.y = last.y;
+  previousRobotPosPoint.z = last.z;
+
+  publishTrajectorySnapshot(true);
+
+  ROS_INFO("Journal replayed: %lu key frames, %lu factors in %.2f s",
+           keyFrames.size(), contents.graph.size(),
+           std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         startTime).count());
+}
+
+void MapOptimization::publishTrajectorySnapshot(bool posesCorrected) {
+  std::shared_ptr<TrajectorySnapshot> trajectory(new TrajectorySnapshot);
+  trajectory->poses3D.reset(new pcl::PointCloud<PointType>(*cloudKeyPoses3D));
+  trajectory->poses6D.reset(
+      new pcl::PointCloud<PointTypePose>(*cloudKeyPoses6D));
+
+  const TrajectorySnapshotPtr previous = std::atomic_load(&_trajectory);
+  trajectory->version = previous ? previous->version + 1 : 0;
+  trajectory->correction =
+      previous ? previous->correction + (posesCorrected ? 1 : 0) : 0;
+  std::atomic_store(&_trajectory, TrajectorySnapshotPtr(trajectory));
+}
+
 void MapOptimization::clearCloud() {
   laserCloudCornerFromMap->clear();
   laserCloudSurfFromMap->clear();
@@ -1413,21 +1989,123 @@ void MapOptimization::clearCloud() {
   laserCloudSurfFromMapDS->clear();
 }
 
+// Estimate: the Bayes tree conditionals, plus the nonlinear factors and the
+// linearization point at their nominal size. Called with mtx held.
+size_t MapOptimization::isamBytes() const {
+  size_t bytes = 0;
+  for (const auto &node : isam->nodes()) {
+    const GaussianConditional::shared_ptr &conditional =
+        node.second->conditional();
+    // a clique is listed once per frontal variable
+    if (!conditional || node.first != conditional->front()) continue;
+    const VerticalBlockMatrix &matrix = conditional->matrixObject();
+    bytes += matrix.rows() * matrix.cols() * sizeof(double);
+  }
+  bytes += isam->getFactorsUnsafe().size() * sizeof(BetweenFactor<Pose3>);
+  bytes += isam->getLinearizationPoint().size() * sizeof(GenericValue<Pose3>);
+  return bytes;
+}
+
+void MapOptimization::accountMemory(const AssociationOut &association) {
+  _key_frame_memory.set(keyFrames.bytes());
+
+  size_t localMap = cloudBytes(laserCloudCornerFromMap) +
+                    cloudBytes(laserCloudSurfFromMap) +
+                    cloudBytes(laserCloudCornerFromMapDS) +
+                    cloudBytes(laserCloudSurfFromMapDS);
+  for (const auto *frames :
+       {&recentCornerCloudKeyFrames, &recentSurfCloudKeyFrames,
+        &recentOutlierCloudKeyFrames, &surroundingCornerCloudKeyFrames,
+        &surroundingSurfCloudKeyFrames, &surroundingOutlierCloudKeyFrames}) {
+    for (const auto &cloud : *frames) localMap += cloudBytes(cloud);
+  }
+  _local_map_memory.set(localMap);
+
+  _kdtree_memory.set(kdtreeCornerFromMap.usedMemory() +
+                     kdtreeSurfFromMap.usedMemory() +
+                     kdtreeSurroundingKeyPoses.usedMemory() +
+                     _kdtree_build_reference.usedMemory());
+
+  _channel_memory.set(cloudBytes(association.cloud_corner_last) +
+                      cloudBytes(association.cloud_surf_last) +
+                      cloudBytes(association.cloud_outlier_last));
+
+  _scratch_memory.set(
+      cloudBytes(laserCloudCornerLast) + cloudBytes(laserCloudSurfLast) +
+      cloudBytes(laserCloudOutlierLast) + cloudBytes(laserCloudCornerLastDS) +
+      cloudBytes(laserCloudSurfLastDS) + cloudBytes(laserCloudOutlierLastDS) +
+      cloudBytes(laserCloudSurfTotalLast) +
+      cloudBytes(laserCloudSurfTotalLastDS) + cloudBytes(laserCloudOri) +
+      cloudBytes(coeffSel) + cloudBytes(cloudKeyPoses3D) +
+      cloudBytes(cloudKeyPoses6D) + cloudBytes(surroundingKeyPoses) +
+      cloudBytes(surroundingKeyPosesDS));
+}
+
+// Over the memory ceiling, the oldest key frames are spilled to disk, a few per
+// scan. The most recent ones are left alone, they make the local map.
+void MapOptimization::releaseMemory() {
+  if (!_memory.overCeiling() || _spill_directory.empty()) return;
+
+  int spilled = 0;
+  while (_spill_next + surroundingKeyframeSearchNum < keyFrames.size() &&
+         spilled < memorySpillBatch) {
+    if (!keyFrames.spill(_spill_next, _spill_directory)) {
+      _spill_directory.clear();  // not writable, no point in retrying
+      return;
+    }
+    _spill_next++;
+    spilled++;
+  }
+  if (spilled > 0) {
+    ROS_INFO_THROTTLE(10, "%lu key frames spilled to [%s]",
+                      keyFrames.spilledCount(), _spill_directory.c_str());
+  }
+}
+
+
+void MapOptimization::applyTuningProfile() {
+  _tuning = _tuner.profile();
+  downSizeFilterCorner.setLeafSize(_tuning.mappingCornerLeafSize,
+                                   _tuning.mappingCornerLeafSize,
+                                   _tuning.mappingCornerLeafSize);
+  downSizeFilterSurf.setLeafSize(_tuning.mappingSurfLeafSize,
+                                 _tuning.mappingSurfLeafSize,
+                                 _tuning.mappingSurfLeafSize);
+  downSizeFilterOutlier.setLeafSize(_tuning.mappingSurfLeafSize,
+                                    _tuning.mappingSurfLeafSize,
+                                    _tuning.mappingSurfLeafSize);
+}
 
 void MapOptimization::run() {
   size_t cycle_count = 0;
+  // keeps the clouds of the previous scan, handed back to FeatureAssociation
+  // with the next receive
+  AssociationOut association;
 
   while (ros::ok()) {
-    AssociationOut association;
+    _allocations.endScan();
     _input_channel.receive(association);
     if( !ros::ok() ) break;
+    _allocations.beginScan();
 
     {
-      std::lock_guard<std::mutex> lock(mtx);
+      const auto startTime = std::chrono::steady_clock::now();
 
-      laserCloudCornerLast = association.cloud_corner_last;
-      laserCloudSurfLast = association.cloud_surf_last;
-      laserCloudOutlierLast = association.cloud_outlier_last;
+      if (association.stationary) {
+        // parked: no mapping, the last map pose is republished
+        timeLaserOdometry = association.laser_odometry.header.stamp.toSec();
+        timeLastProcessing = timeLaserOdometry;
+        publishTF();
+        continue;
+      }
+
+      if (_tuner.enabled()) {
+        applyTuningProfile();
+      }
+
+      laserCloudCornerLast.swap(association.cloud_corner_last);
+      laserCloudSurfLast.swap(association.cloud_surf_last);
+      laserCloudOutlierLast.swap(association.cloud_outlier_last);
 
       timeLaserOdometry = association.laser_odometry.header.stamp.toSec();
       timeLastProcessing = timeLaserOdometry;
@@ -1436,6 +2114,10 @@ void MapOptimization::run() {
 
       transformAssociateToMap();
 
+      if (imuPreintegrationEnableFlag) {
+        predictTransformFromImu();
+      }
+
       extractSurroundingKeyFrames();
 
       downsampleCurrentScan();
@@ -1450,6 +2132,18 @@ void MapOptimization::run() {
 
       publishKeyPosesAndFrames();
 
+      const double latency = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - startTime).count();
+      // comparison runs do the work twice, their latency would mislead the tuner
+      if (!_knn_compare && !_kdtree_build_compare) {
+        _tuner.report(AutoTuner::MAPPING, latency, laserCloudOri->points.size());
+      }
+      _soak.record(SoakMonitor::MAPPING, latency);
+
+      accountMemory(association);
+      releaseMemory();
+      _memory.update();
+
       clearCloud();
     }
     cycle_count++;
@@ -0,0 +1,288 @@
+#include "mapTilePublisher.h"
+#include "packed_cloud.h"
+
+namespace {
+
+// a key frame that moved more than this (m or rad) means the poses were corrected
+const float poseTolerance = 1e-3;
+
+int levelAt(float distance) {
+  int level = 0;
+  for (float limit = mapTileLevelDistance;
+       distance >= limit && level < mapTileLevels - 1; limit *= 2) {
+    level++;
+  }
+  return level;
+}
+
+bool poseMoved(const PointTypePose &a, const PointTypePose &b) {
+  return std::abs(a.x - b.x) > poseTolerance ||
+         std::abs(a.y - b.y) > poseTolerance ||
+         std::abs(a.z - b.z) > poseTolerance ||
+         std::abs(a.roll - b.roll) > poseTolerance ||
+         std::abs(a.pitch - b.pitch) > poseTolerance ||
+         std::abs(a.yaw - b.yaw) > poseTolerance;
+}
+
+}  // namespace
+
+MapTilePublisher::MapTilePublisher()
+    : _budget_rate(0), _budget(0), _subscribers(0), _bytes(0) {}
+
+void MapTilePublisher::advertise(ros::NodeHandle &nh, double bytesPerSecond) {
+  _budget_rate = bytesPerSecond;
+  if (!enabled()) return;
+  _publisher = nh.advertise<cloud_msgs::MapTile>("/map_tiles", 100);
+  _budget_time = std::chrono::steady_clock::now();
+}
+
+void MapTilePublisher::update(const TrajectorySnapshot &trajectory,
+                              const KeyFrameStore &keyFrames) {
+  if (!enabled() || trajectory.size() == 0) return;
+
+  if (trajectory.size() < _integrated.size()) {
+    rebuild(trajectory, keyFrames);
+  } else {
+    rebinMoved(trajectory, keyFrames);
+    for (size_t i = _integrated.size(); i < trajectory.size(); i++) {
+      integrate(i, keyFrames[i], trajectory.poses6D->points[i], nullptr);
+    }
+    downsampleTouched();
+  }
+
+  // tiles left empty are sent once to clear them
+  for (auto it = _tiles.begin(); it != _tiles.end();) {
+    const Tile &tile = it->second;
+    it = (tile.cloud->empty() && tile.sentLevel < 0) ? _tiles.erase(it)
+                                                     : std::next(it);
+  }
+
+  const uint32_t subscribers = _publisher.getNumSubscribers();
+  if (subscribers > _subscribers) {
+    // the new viewer has none of the tiles
+    for (auto it = _tiles.begin(); it != _tiles.end();) {
+      it->second.sentLevel = -1;
+      it = it->second.cloud->empty() ? _tiles.erase(it) : std::next(it);
+    }
+  }
+  _subscribers = subscribers;
+
+  // the unused budget is lost, an overdraft is paid back first
+  const auto now = std::chrono::steady_clock::now();
+  _budget = std::min(_budget, 0.0) +
+            _budget_rate *
+                std::chrono::duration<double>(now - _budget_time).count();
+  _budget_time = now;
+
+  if (subscribers > 0) {
+    const PointTypePose &latestPose = trajectory.poses6D->points.back();
+    std::vector<std::pair<float, TileIndex>> due;
+    for (const auto &entry : _tiles) {
+      const float d = distance(entry.first, latestPose);
+      if (d > globalMapVisualizationSearchRadius) continue;
+      const Tile &tile = entry.second;
+      if (tile.changed || tile.sentLevel < 0 || levelAt(d) < tile.sentLevel) {
+        due.emplace_back(d, entry.first);
+      }
+    }
+    std::sort(due.begin(), due.end());
+
+    for (size_t i = 0; i < due.size() && _budget > 0; i++) {
+      auto it = _tiles.find(due[i].second);
+      _budget -= publish(it->first, it->second, levelAt(due[i].first),
+                         latestPose.time);
+      if (it->second.cloud->empty()) _tiles.erase(it);
+    }
+  }
+
+  _bytes = cloudBytes(_integrated) + vectorBytes(_touched) +
+           vectorBytes(_key_frame_tiles);
+  for (const auto &tiles : _key_frame_tiles) _bytes += vectorBytes(tiles);
+  for (const auto &entry : _tiles) {
+    _bytes += sizeof(entry) + cloudBytes(entry.second.cloud) +
+              vectorBytes(entry.second.keyFrames);
+  }
+}
+
+void MapTilePublisher::rebuild(const TrajectorySnapshot &trajectory,
+                               const KeyFrameStore &keyFrames) {
+  for (auto &entry : _tiles) {
+    entry.second.cloud->clear();
+    entry.second.changed = true;
+    entry.second.keyFrames.clear();
+  }
+  _integrated.clear();
+  _key_frame_tiles.clear();
+  for (size_t i = 0; i < trajectory.size(); i++) {
+    integrate(i, keyFrames[i], trajectory.poses6D->points[i], nullptr);
+  }
+  downsampleTouched();
+}
+
+void MapTilePublisher::rebinMoved(const TrajectorySnapshot &trajectory,
+                                  const KeyFrameStore &keyFrames) {
+  // the tiles of the key frames that moved are cleared, then every key frame
+  // binned into them is binned again: the moved ones anywhere, the others
+  // only into the cleared tiles, so that spilled key frames away from the
+  // correction are not reloaded
+  std::vector<bool> moved(_integrated.size(), false);
+  std::set<size_t> rebinned;
+  std::set<TileIndex> cleared;
+  for (size_t i = 0; i < _integrated.size(); i++) {
+    if (!poseMoved(_integrated.points[i], trajectory.poses6D->points[i])) {
+      continue;
+    }
+    moved[i] = true;
+    rebinned.insert(i);
+    cleared.insert(_key_frame_tiles[i].begin(), _key_frame_tiles[i].end());
+    _key_frame_tiles[i].clear();
+  }
+  if (rebinned.empty()) return;
+
+  for (const TileIndex &index : cleared) {
+    auto it = _tiles.find(index);
+    if (it == _tiles.end()) continue;
+    Tile &tile = it->second;
+    rebinned.insert(tile.keyFrames.begin(), tile.keyFrames.end());
+    tile.cloud->clear();
+    tile.changed = true;
+    tile.keyFrames.clear();
+  }
+
+  for (size_t i : rebinned) {
+    integrate(i, keyFrames[i], trajectory.poses6D->points[i],
+              moved[i] ? nullptr : &cleared);
+  }
+}
+
+void MapTilePublisher::integrate(size_t index, const KeyFrame &keyFrame,
+                                 const PointTypePose &pose,
+                                 const std::set<TileIndex> *only) {
+  if (index == _integrated.size()) {
+    _integrated.push_back(pose);
+    _key_frame_tiles.emplace_back();
+  } else {
+    _integrated.points[index] = pose;
+  }
+
+  std::vector<TileIndex> &binned = _key_frame_tiles[index];
+  bin(*keyFrame.corner(), pose, only, binned);
+  bin(*keyFrame.surf(), pose, only, binned);
+  bin(*keyFrame.outlier(), pose, only, binned);
+  std::sort(binned.begin(), binned.end());
+  binned.erase(std::unique(binned.begin(), binned.end()), binned.end());
+
+  for (const TileIndex &tileIndex : binned) {
+    auto it = _tiles.find(tileIndex);
+    if (it == _tiles.end()) continue;
+    std::vector<size_t> &tileKeyFrames = it->second.keyFrames;
+    if (std::find(tileKeyFrames.begin(), tileKeyFrames.end(), index) ==
+        tileKeyFrames.end()) {
+      tileKeyFrames.push_back(index);
+    }
+  }
+}
+
+void MapTilePublisher::bin(const pcl::PointCloud<PointType> &cloud,
+                           const PointTypePose &pose,
+                           const std::set<TileIndex> *only,
+                           std::vector<TileIndex> &binned) {
+  const float cRoll = cos(pose.roll), sRoll = sin(pose.roll);
+  const float cPitch = cos(pose.pitch), sPitch = sin(pose.pitch);
+  const float cYaw = cos(pose.yaw), sYaw = sin(pose.yaw);
+
+  Tile *tile = nullptr;
+  bool skipped = false;  // the tile of the previous point is not in only
+  TileIndex tileIndex;
+  for (const PointType &pointFrom : cloud.points) {
+    const float x1 = cYaw * pointFrom.x - sYaw * pointFrom.y;
+    const float y1 = sYaw * pointFrom.x + cYaw * pointFrom.y;
+    const float z1 = pointFrom.z;
+
+    const float x2 = x1;
+    const float y2 = cRoll * y1 - sRoll * z1;
+    const float z2 = sRoll * y1 + cRoll * z1;
+
+    PointType pointTo;
+    pointTo.x = cPitch * x2 + sPitch * z2 + pose.x;
+    pointTo.y = y2 + pose.y;
+    pointTo.z = -sPitch * x2 + cPitch * z2 + pose.z;
+    pointTo.intensity = pointFrom.intensity;
+
+    const TileIndex index(int(std::floor(pointTo.x / mapTileSize)),
+                          int(std::floor(pointTo.z / mapTileSize)));
+    // consecutive points are mostly in the same tile
+    if ((!tile && !skipped) || index != tileIndex) {
+      tileIndex = index;
+      skipped = only && only->count(index) == 0;
+      tile = nullptr;
+      if (!skipped) {
+        auto it = _tiles.find(index);
+        if (it == _tiles.end()) {
+          Tile created;
+          created.cloud.reset(new pcl::PointCloud<PointType>());
+          created.changed = true;
+          created.sentLevel = -1;
+          it = _tiles.emplace(index, created).first;
+        }
+        tile = &it->second;
+        _touched.push_back(index);
+        binned.push_back(index);
+      }
+    }
+    if (skipped) continue;
+    tile->cloud->push_back(pointTo);
+  }
+}
+
+void MapTilePublisher::downsampleTouched() {
+  std::sort(_touched.begin(), _touched.end());
+  _touched.erase(std::unique(_touched.begin(), _touched.end()), _touched.end());
+
+  _filter.setLeafSize(mapTileResolution, mapTileResolution, mapTileResolution);
+  for (const TileIndex &index : _touched) {
+    Tile &tile = _tiles[index];
+    pcl::PointCloud<PointType>::Ptr filtered(new pcl::PointCloud<PointType>());
+    _filter.setInputCloud(tile.cloud);
+    _filter.filter(*filtered);
+    tile.cloud = filtered;
+    tile.changed = true;
+  }
+  _touched.clear();
+}
+
+float MapTilePublisher::distance(const TileIndex &index,
+                                 const PointTypePose &pose) const {
+  // horizontal distance to the tile center
+  const float dx = (index.first + 0.5f) * mapTileSize - pose.x;
+  const float dz = (index.second + 0.5f) * mapTileSize - pose.z;
+  return std::sqrt(dx * dx + dz * dz);
+}
+
+size_t MapTilePublisher::publish(const TileIndex &index, Tile &tile, int level,
+                                 double time) {
+  cloud_msgs::MapTile msg;
+  msg.header.stamp = ros::Time().fromSec(time);
+  msg.header.frame_id = "/camera_init";
+  msg.x = index.first;
+  msg.z = index.second;
+  msg.size = mapTileSize;
+  msg.level = level;
+  msg.resolution = mapTileResolution * (1 << level);
+  msg.points.header = msg.header;
+
+  if (level == 0) {
+    toPackedCloud(*tile.cloud, msg.points);
+  } else {
+    pcl::PointCloud<PointType> coarse;
+    _filter.setLeafSize(msg.resolution, msg.resolution, msg.resolution);
+    _filter.setInputCloud(tile.cloud);
+    _filter.filter(coarse);
+    toPackedCloud(coarse, msg.points);
+  }
+  _publisher.publish(msg);
+
+  tile.changed = false;
+  tile.sentLevel = level;
+  return ros::serialization::serializationLength(msg);
+}
@@ -0,0 +1,76 @@
+#ifndef MAPTILEPUBLISHER_H
+#define MAPTILEPUBLISHER_H
+
+#include "utility.h"
+#include "keyframe_store.h"
+#include "memory_accounting.h"
+#include "cloud_msgs/MapTile.h"
+#include <chrono>
+#include <map>
+#include <set>
+
+// Level of detail map for remote viewers, published as tiles (/map_tiles).
+// The key frame points are binned into square tiles of the horizontal plane and
+// kept downsampled at mapTileResolution. A tile is sent at a level chosen from
+// its distance to the latest key frame, the voxel edge doubling at each level
+// on a grid aligned to the origin, as in an octree: fine near the vehicle,
+// coarse far away. Only the tiles that changed since they were last sent, or
+// that need a finer level than the one sent, are published again, nearest
+// first, within a budget of bytes per second.
+// When the poses are corrected, only the tiles the moved key frames were binned
+// into are rebuilt, from the key frames sharing them.
+class MapTilePublisher {
+ public:
+  MapTilePublisher();
+
+  // 0 bytes per second leaves the publisher disabled
+  void advertise(ros::NodeHandle &nh, double bytesPerSecond);
+
+  bool enabled() const { return _budget_rate > 0; }
+
+  // Global map thread: adds the key frames of the trajectory not binned yet,
+  // then publishes the tiles due within the budget
+  void update(const TrajectorySnapshot &trajectory,
+              const KeyFrameStore &keyFrames);
+
+  // Global map thread
+  size_t bytes() const { return _bytes; }
+
+ private:
+  typedef std::pair<int, int> TileIndex;  // x, z
+
+  struct Tile {
+    pcl::PointCloud<PointType>::Ptr cloud;  // level 0
+    bool changed;   // since it was last sent
+    int sentLevel;  // -1 if it was never sent
+    std::vector<size_t> keyFrames;  // binned into the tile
+  };
+
+  void rebuild(const TrajectorySnapshot &trajectory,
+               const KeyFrameStore &keyFrames);
+  void rebinMoved(const TrajectorySnapshot &trajectory,
+                  const KeyFrameStore &keyFrames);
+  // only: the tiles the points may be binned into, nullptr for all
+  void integrate(size_t index, const KeyFrame &keyFrame,
+                 const PointTypePose &pose, const std::set<TileIndex> *only);
+  void bin(const pcl::PointCloud<PointType> &cloud, const PointTypePose &pose,
+           const std::set<TileIndex> *only, std::vector<TileIndex> &binned);
+  void downsampleTouched();
+  float distance(const TileIndex &index, const PointTypePose &pose) const;
+  size_t publish(const TileIndex &index, Tile &tile, int level, double time);
+
+  ros::Publisher _publisher;
+  double _budget_rate;  // bytes per second
+  double _budget;       // may go negative after a large tile
+  std::chrono::steady_clock::time_point _budget_time;
+  uint32_t _subscribers;
+
+  std::map<TileIndex, Tile> _tiles;
+  std::vector<TileIndex> _touched;        // by the key frames being binned
+  pcl::PointCloud<PointTypePose> _integrated;  // poses the tiles were built with
+  std::vector<std::vector<TileIndex>> _key_frame_tiles;  // by key frame
+  pcl::VoxelGrid<PointType> _filter;
+  size_t _bytes;
+};
+
+#endif  // MAPTILEPUBLISHER_H
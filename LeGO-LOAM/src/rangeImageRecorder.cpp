@@ -0,0 +1,346 @@
+#include "rangeImageRecorder.h"
+#include <cstring>
+#include <zlib.h>
+
+namespace {
+
+const char RANGE_IMAGE_MAGIC[8] = {'L', 'E', 'G', 'O', 'R', 'I', 'M', '1'};
+const size_t PLANE_COUNT = 6;
+const size_t MAX_QUEUED_SCANS = 32;
+
+template <typename T>
+void append(std::vector<uint8_t> &out, const T &value) {
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+bool read(const uint8_t *&in, const uint8_t *end, T &value) {
+  if (size_t(end - in) < sizeof(T)) return false;
+  std::memcpy(&value, in, sizeof(T));
+  in += sizeof(T);
+  return true;
+}
+
+float wrapAngle(float angle) {
+  while (angle > M_PI) angle -= 2 * M_PI;
+  while (angle <= -M_PI) angle += 2 * M_PI;
+  return angle;
+}
+
+// Azimuth, as atan2(x, y), of the center of a range image column: the
+// inverse of the column projection of ImageProjection
+float columnAzimuth(size_t column, size_t columns) {
+  return M_PI_2 + (columns * 0.5f - float(column)) * (2 * M_PI / columns);
+}
+
+template <typename T>
+T quantize(float value, float minimum, float maximum) {
+  return T(std::max(minimum, std::min(maximum, std::round(value))));
+}
+
+}  // namespace
+
+RangeImageRecorder::RangeImageRecorder()
+    : _file(nullptr),
+      _rows(0),
+      _columns(0),
+      _queued_scans(0),
+      _dropped(0),
+      _stop(false),
+      _scans(0),
+      _imu_samples(0),
+      _bytes(0) {}
+
+RangeImageRecorder::~RangeImageRecorder() {
+  if (!isOpen()) return;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _cv.notify_all();
+  _thread.join();
+  fclose(_file);
+
+  ROS_INFO("Range image log: %lu scans, %lu IMU samples, %.1f kB per scan, "
+           "%lu scans dropped",
+           _scans, _imu_samples, _bytes / 1024.0 / std::max<size_t>(1, _scans),
+           _dropped);
+}
+
+bool RangeImageRecorder::open(const std::string &path, size_t rows,
+                              size_t columns) {
+  _file = fopen(path.c_str(), "wb");
+  if (!_file) return false;
+  _rows = rows;
+  _columns = columns;
+
+  const uint32_t size[2] = {uint32_t(rows), uint32_t(columns)};
+  const float resolution = rangeImageRangeResolution;
+  fwrite(RANGE_IMAGE_MAGIC, sizeof(RANGE_IMAGE_MAGIC), 1, _file);
+  fwrite(size, sizeof(size), 1, _file);
+  fwrite(&resolution, sizeof(resolution), 1, _file);
+  _bytes = sizeof(RANGE_IMAGE_MAGIC) + sizeof(size) + sizeof(resolution);
+
+  _thread = std::thread(&RangeImageRecorder::writerThread, this);
+  return true;
+}
+
+void RangeImageRecorder::recordScan(
+    double time, const Eigen::MatrixXf &range, const Eigen::MatrixXf &intensity,
+    const pcl::PointCloud<PointType> &fullCloud) {
+  if (!isOpen()) return;
+
+  std::unique_ptr<ScanJob> scan;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_queued_scans >= MAX_QUEUED_SCANS) {
+      const size_t dropped = ++_dropped;
+      ROS_WARN_THROTTLE(10, "Range image log lagging, %lu scans dropped",
+                        dropped);
+      return;
+    }
+    if (!_free_scans.empty()) {
+      scan = std::move(_free_scans.back());
+      _free_scans.pop_back();
+    }
+  }
+  if (!scan) scan.reset(new ScanJob());
+
+  // the buffers of a recycled job are reused
+  scan->time = time;
+  scan->range = range;
+  scan->intensity = intensity;
+  scan->points.assign(fullCloud.points.begin(), fullCloud.points.end());
+
+  Job job;
+  job.type = SCAN;
+  job.scan = std::move(scan);
+  push(std::move(job));
+}
+
+void RangeImageRecorder::recordImu(const ImuSample &imu) {
+  if (!isOpen()) return;
+  Job job;
+  job.type = IMU;
+  job.imu = imu;
+  push(std::move(job));
+}
+
+void RangeImageRecorder::push(Job &&job) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (job.type == SCAN) _queued_scans++;
+    _queue.push_back(std::move(job));
+  }
+  _cv.notify_one();
+}
+
+void RangeImageRecorder::writerThread() {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cv.wait(lock, [&]() { return _stop || !_queue.empty(); });
+      // the queue is drained before stopping
+      if (_queue.empty()) break;
+      job = std::move(_queue.front());
+      _queue.pop_front();
+    }
+
+    if (job.type == IMU) {
+      const ImuSample &imu = job.imu;
+      _payload.clear();
+      append(_payload, imu.time);
+      const float values[9] = {imu.roll,      imu.pitch,     imu.yaw,
+                               imu.acc.x(),   imu.acc.y(),   imu.acc.z(),
+                               imu.gyro.x(),  imu.gyro.y(),  imu.gyro.z()};
+      append(_payload, values);
+      append(_payload, uint8_t(imu.orientationValid));
+      writeRecord(IMU, _payload);
+      _imu_samples++;
+      continue;
+    }
+
+    encodeScan(*job.scan);
+    writeRecord(SCAN, _payload);
+    fflush(_file);
+    _scans++;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queued_scans--;
+    _free_scans.push_back(std::move(job.scan));
+  }
+}
+
+void RangeImageRecorder::encodeScan(const ScanJob &scan) {
+  const size_t pixels = _rows * _columns;
+
+  // elevation of each row: the mean over its returns
+  _row_elevation.assign(_rows, 0);
+  for (size_t row = 0; row < _rows; ++row) {
+    int count = 0;
+    for (size_t col = 0; col < _columns; ++col) {
+      const float range = scan.range(row, col);
+      if (range == FLT_MAX) continue;
+      const PointType &point = scan.points[col + row * _columns];
+      _row_elevation[row] += std::asin(point.z / range);
+      count++;
+    }
+    if (count > 0) _row_elevation[row] /= count;
+  }
+
+  // direction of each point from the center of its pixel
+  _offsets.assign(2 * pixels, 0);
+  float maxAzimuth = 0, maxElevation = 0;
+  for (size_t row = 0; row < _rows; ++row) {
+    for (size_t col = 0; col < _columns; ++col) {
+      const float range = scan.range(row, col);
+      if (range == FLT_MAX) continue;
+      const size_t index = col + row * _columns;
+      const PointType &point = scan.points[index];
+      const float azimuth = wrapAngle(std::atan2(point.x, point.y) -
+                                      columnAzimuth(col, _columns));
+      const float elevation =
+          std::asin(point.z / range) - _row_elevation[row];
+      _offsets[index] = azimuth;
+      _offsets[pixels + index] = elevation;
+      maxAzimuth = std::max(maxAzimuth, std::abs(azimuth));
+      maxElevation = std::max(maxElevation, std::abs(elevation));
+    }
+  }
+  const float azimuthStep = std::max(maxAzimuth / 127, 1e-7f);
+  const float elevationStep = std::max(maxElevation / 127, 1e-7f);
+
+  _planes.assign(PLANE_COUNT * pixels, 0);
+  for (size_t row = 0; row < _rows; ++row) {
+    uint16_t previousRange = 0, previousIntensity = 0;
+    int8_t previousAzimuth = 0, previousElevation = 0;
+    for (size_t col = 0; col < _columns; ++col) {
+      const size_t index = col + row * _columns;
+      uint16_t range = 0, intensity = 0;
+      int8_t azimuth = 0, elevation = 0;
+      if (scan.range(row, col) != FLT_MAX) {
+        range = quantize<uint16_t>(
+            scan.range(row, col) / rangeImageRangeResolution, 1, 65535);
+        intensity = quantize<uint16_t>(
+            scan.intensity(row, col) * rangeImageIntensityScale, 0, 65535);
+        azimuth = quantize<int8_t>(_offsets[index] / azimuthStep, -127, 127);
+        elevation = quantize<int8_t>(_offsets[pixels + index] / elevationStep,
+                                     -127, 127);
+      }
+      const uint16_t rangeDelta = range - previousRange;
+      const uint16_t intensityDelta = intensity - previousIntensity;
+      _planes[index] = uint8_t(rangeDelta);
+      _planes[pixels + index] = uint8_t(rangeDelta >> 8);
+      _planes[2 * pixels + index] = uint8_t(intensityDelta);
+      _planes[3 * pixels + index] = uint8_t(intensityDelta >> 8);
+      _planes[4 * pixels + index] = uint8_t(azimuth - previousAzimuth);
+      _planes[5 * pixels + index] = uint8_t(elevation - previousElevation);
+      previousRange = range;
+      previousIntensity = intensity;
+      previousAzimuth = azimuth;
+      previousElevation = elevation;
+    }
+  }
+
+  _payload.clear();
+  append(_payload, scan.time);
+  append(_payload, azimuthStep);
+  append(_payload, elevationStep);
+  for (float elevation : _row_elevation) append(_payload, elevation);
+
+  const size_t header = _payload.size();
+  uLongf compressedSize = compressBound(_planes.size());
+  _payload.resize(header + compressedSize);
+  if (compress2(_payload.data() + header, &compressedSize, _planes.data(),
+                _planes.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+    compressedSize = 0;
+    ROS_ERROR("Unable to compress the range image of %f", scan.time);
+  }
+  _payload.resize(header + compressedSize);
+}
+
+void RangeImageRecorder::writeRecord(RecordType type,
+                                     const std::vector<uint8_t> &payload) {
+  const uint32_t header[2] = {uint32_t(type), uint32_t(payload.size())};
+  fwrite(header, sizeof(header), 1, _file);
+  fwrite(payload.data(), payload.size(), 1, _file);
+  _bytes += sizeof(header) + payload.size();
+}
+
+bool RangeImageRecorder::decodeScan(const uint8_t *payload, size_t size,
+                                    size_t rows, size_t columns,
+                                    float rangeResolution, double &time,
+                                    pcl::PointCloud<PointType> &cloud,
+                                    std::vector<uint8_t> &planes) {
+  const uint8_t *in = payload;
+  const uint8_t *end = payload + size;
+  float azimuthStep, elevationStep;
+  if (!read(in, end, time) || !read(in, end, azimuthStep) ||
+      !read(in, end, elevationStep) ||
+      size_t(end - in) < rows * sizeof(float)) {
+    return false;
+  }
+  const uint8_t *rowElevation = in;
+  in += rows * sizeof(float);
+
+  const size_t pixels = rows * columns;
+  planes.resize(PLANE_COUNT * pixels);
+  uLongf length = planes.size();
+  if (uncompress(planes.data(), &length, in, end - in) != Z_OK ||
+      length != planes.size()) {
+    return false;
+  }
+
+  cloud.points.clear();
+  for (size_t row = 0; row < rows; ++row) {
+    float elevationRow;
+    std::memcpy(&elevationRow, rowElevation + row * sizeof(float),
+                sizeof(float));
+    uint16_t range = 0, intensity = 0;
+    int8_t azimuth = 0, elevation = 0;
+    for (size_t col = 0; col < columns; ++col) {
+      const size_t index = col + row * columns;
+      range += uint16_t(planes[index] | planes[pixels + index] << 8);
+      intensity +=
+          uint16_t(planes[2 * pixels + index] | planes[3 * pixels + index] << 8);
+      azimuth = int8_t(uint8_t(azimuth + planes[4 * pixels + index]));
+      elevation = int8_t(uint8_t(elevation + planes[5 * pixels + index]));
+      if (range == 0) continue;
+
+      const float r = range * rangeResolution;
+      const float a = columnAzimuth(col, columns) + azimuth * azimuthStep;
+      const float e = elevationRow + elevation * elevationStep;
+      PointType point;
+      point.x = r * std::cos(e) * std::sin(a);
+      point.y = r * std::cos(e) * std::cos(a);
+      point.z = r * std::sin(e);
+      point.intensity = intensity / rangeImageIntensityScale;
+      cloud.points.push_back(point);
+    }
+  }
+  cloud.width = cloud.points.size();
+  cloud.height = 1;
+  cloud.is_dense = true;
+  return true;
+}
+
+bool RangeImageRecorder::decodeImu(const uint8_t *payload, size_t size,
+                                   ImuSample &imu) {
+  const uint8_t *in = payload;
+  const uint8_t *end = payload + size;
+  float values[9];
+  uint8_t valid;
+  if (!read(in, end, imu.time) || !read(in, end, values) ||
+      !read(in, end, valid)) {
+    return false;
+  }
+  imu.roll = values[0];
+  imu.pitch = values[1];
+  imu.yaw = values[2];
+  imu.acc = Vector3(values[3], values[4], values[5]);
+  imu.gyro = Vector3(values[6], values[7], values[8]);
+  imu.orientationValid = valid != 0;
+  return true;
+}
@@ -0,0 +1,93 @@
+#ifndef RANGEIMAGERECORDER_H
+#define RANGEIMAGERECORDER_H
+
+#include "utility.h"
+#include <condition_variable>
+#include <memory>
+
+// Compact log of the pipeline input, for replay by DatasetReader: the range
+// image of every scan as ImageProjection projected it, and the IMU samples.
+// The file starts with the 8 bytes "LEGORIM1", uint32 rows, uint32 columns,
+// float32 range resolution (m), followed by records of
+//   { uint32 type, uint32 payload size, payload }
+// SCAN: float64 time, float32 azimuth step, float32 elevation step, float32
+//   elevation of each row (rad), then the zlib stream of 6 planes of
+//   rows * columns bytes: uint16 range / resolution (0: no return) and uint16
+//   intensity * rangeImageIntensityScale, split in low and high bytes, int8
+//   offsets of the point azimuth from the column center and of its elevation
+//   from the row elevation, in steps. Each value is stored as the difference
+//   to the previous column, which deflate compresses best.
+// IMU: float64 time, float32 roll, pitch, yaw, acc x, y, z, gyro x, y, z,
+//   uint8 orientation valid
+// A point is rebuilt within half a range resolution and half a step of its
+// direction. Scans are encoded and written by a background thread; when it
+// lags behind, scans are dropped rather than delaying the projection.
+class RangeImageRecorder {
+ public:
+  RangeImageRecorder();
+  ~RangeImageRecorder();
+
+  bool open(const std::string &path, size_t rows, size_t columns);
+  bool isOpen() const { return _file != nullptr; }
+
+  // Projection thread, once per scan: range is FLT_MAX where there is no
+  // return, the points of fullCloud are indexed by column + row * columns
+  void recordScan(double time, const Eigen::MatrixXf &range,
+                  const Eigen::MatrixXf &intensity,
+                  const pcl::PointCloud<PointType> &fullCloud);
+
+  // IMU thread
+  void recordImu(const ImuSample &imu);
+
+  enum RecordType { SCAN = 1, IMU = 2 };
+
+  // Points of a SCAN payload, false if it is corrupt
+  static bool decodeScan(const uint8_t *payload, size_t size, size_t rows,
+                         size_t columns, float rangeResolution, double &time,
+                         pcl::PointCloud<PointType> &cloud,
+                         std::vector<uint8_t> &planes);
+  static bool decodeImu(const uint8_t *payload, size_t size, ImuSample &imu);
+
+ private:
+  struct ScanJob {
+    double time;
+    Eigen::MatrixXf range;
+    Eigen::MatrixXf intensity;
+    pcl::PointCloud<PointType>::VectorType points;
+  };
+
+  struct Job {
+    RecordType type;
+    ImuSample imu;
+    std::unique_ptr<ScanJob> scan;
+  };
+
+  void push(Job &&job);
+  void writerThread();
+  void encodeScan(const ScanJob &scan);
+  void writeRecord(RecordType type, const std::vector<uint8_t> &payload);
+
+  FILE *_file;
+  size_t _rows;
+  size_t _columns;
+
+  std::thread _thread;
+  std::mutex _mutex;
+  std::condition_variable _cv;
+  std::deque<Job> _queue;
+  std::vector<std::unique_ptr<ScanJob>> _free_scans;  // for reuse
+  size_t _queued_scans;
+  size_t _dropped;
+  bool _stop;
+
+  // writer thread only
+  std::vector<float> _row_elevation;
+  std::vector<float> _offsets;  // azimuth then elevation, per pixel
+  std::vector<uint8_t> _planes;
+  std::vector<uint8_t> _payload;
+  size_t _scans;
+  size_t _imu_samples;
+  size_t _bytes;
+};
+
+#endif  // RANGEIMAGERECORDER_H
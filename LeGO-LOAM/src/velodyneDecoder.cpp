@@ -0,0 +1,261 @@
+#include "velodyneDecoder.h"
+#include <cstring>
+
+namespace {
+
+const int BLOCKS_PER_PACKET = 12;
+const int BLOCK_SIZE = 100;
+const int RAW_SCAN_SIZE = 3;
+const uint16_t UPPER_BANK = 0xeeff;
+const int ROTATION_MAX_UNITS = 36000;
+const float DISTANCE_RESOLUTION = 0.002f;
+const float MAX_RANGE = 130.0f;
+
+// VLP-16: two firing sequences of 16 lasers per block
+const double VLP16_DSR_TOFFSET = 2.304e-6;
+const double VLP16_FIRING_TOFFSET = 55.296e-6;
+const double VLP16_BLOCK_TDURATION = 110.592e-6;
+
+// HDL-32E: one firing sequence of 32 lasers per block
+const double HDL32_DSR_TOFFSET = 1.152e-6;
+const double HDL32_BLOCK_TDURATION = 46.08e-6;
+
+const double VLP16_VERTICAL_ANGLES[16] = {-15, 1,  -13, 3,  -11, 5,  -9, 7,
+                                          -7,  9,  -5,  11, -3,  13, -1, 15};
+
+const double HDL32_VERTICAL_ANGLES[32] = {
+    -30.67, -9.33,  -29.33, -8.00, -28.00, -6.67, -26.67, -5.33,
+    -25.33, -4.00,  -24.00, -2.67, -22.67, -1.33, -21.33, 0.00,
+    -20.00, 1.33,   -18.67, 2.67,  -17.33, 4.00,  -16.00, 5.33,
+    -14.67, 6.67,   -13.33, 8.00,  -12.00, 9.33,  -10.67, 10.67};
+
+inline uint16_t readUint16(const uint8_t *data) {
+  return uint16_t(data[0]) | (uint16_t(data[1]) << 8);
+}
+
+}  // namespace
+
+VelodyneDecoder::VelodyneDecoder(Model model, size_t horizontal_scan)
+    : _model(model), _horizontal_scan(horizontal_scan) {
+  std::vector<double> vertical;
+  if (model == VLP16) {
+    vertical.assign(VLP16_VERTICAL_ANGLES, VLP16_VERTICAL_ANGLES + 16);
+  } else {
+    vertical.assign(HDL32_VERTICAL_ANGLES, HDL32_VERTICAL_ANGLES + 32);
+  }
+  setCalibration(vertical, std::vector<double>(vertical.size(), 0.0));
+
+  _azimuth_sin.resize(ROTATION_MAX_UNITS);
+  _azimuth_cos.resize(ROTATION_MAX_UNITS);
+  _azimuth_column.resize(ROTATION_MAX_UNITS);
+  for (int i = 0; i < ROTATION_MAX_UNITS; ++i) {
+    const double azimuth = i * 0.01 * DEG_TO_RAD;
+    _azimuth_sin[i] = std::sin(azimuth);
+    _azimuth_cos[i] = std::cos(azimuth);
+    // same column as ImageProjection::projectPointCloud for x = cos, y = -sin
+    int column = -round(azimuth / (2 * M_PI / _horizontal_scan)) +
+                 int(_horizontal_scan / 2);
+    if (column < 0) column += _horizontal_scan;
+    if (column >= int(_horizontal_scan)) column -= _horizontal_scan;
+    _azimuth_column[i] = column;
+  }
+}
+
+bool VelodyneDecoder::setCalibration(
+    const std::vector<double> &vertical_angles,
+    const std::vector<double> &rotation_corrections) {
+  const size_t expected = (_model == VLP16) ? 16 : 32;
+  if (vertical_angles.size() != expected ||
+      rotation_corrections.size() != expected) {
+    return false;
+  }
+
+  _vertical_sin.resize(expected);
+  _vertical_cos.resize(expected);
+  _rotation_correction.resize(expected);
+  for (size_t i = 0; i < expected; ++i) {
+    _vertical_sin[i] = std::sin(vertical_angles[i] * DEG_TO_RAD);
+    _vertical_cos[i] = std::cos(vertical_angles[i] * DEG_TO_RAD);
+    _rotation_correction[i] = int(round(rotation_corrections[i] * 100));
+  }
+
+  // the range image rows are ordered from the lowest to the highest laser
+  std::vector<size_t> order(expected);
+  for (size_t i = 0; i < expected; ++i) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return vertical_angles[a] < vertical_angles[b];
+  });
+  _laser_row.resize(expected);
+  for (size_t rank = 0; rank < expected; ++rank) {
+    _laser_row[order[rank]] = rank;
+  }
+  return true;
+}
+
+uint16_t VelodyneDecoder::packetAzimuth(
+    const velodyne_msgs::VelodynePacket &packet) {
+  return readUint16(&packet.data[2]);
+}
+
+void VelodyneDecoder::addReturn(int laser, int azimuth, const uint8_t *data,
+                                double time,
+                                std::vector<VelodyneReturn> &returns) const {
+  const float distance = readUint16(data) * DISTANCE_RESOLUTION;
+  if (distance < 0.1f || distance > MAX_RANGE) return;
+
+  azimuth = (azimuth - _rotation_correction[laser]) % ROTATION_MAX_UNITS;
+  if (azimuth < 0) azimuth += ROTATION_MAX_UNITS;
+
+  const float xy = distance * _vertical_cos[laser];
+
+  VelodyneReturn ret;
+  ret.row = _laser_row[laser];
+  ret.column = _azimuth_column[azimuth];
+  ret.range = distance;
+  ret.time = time;
+  ret.point.x = xy * _azimuth_cos[azimuth];
+  ret.point.y = -xy * _azimuth_sin[azimuth];
+  ret.point.z = distance * _vertical_sin[laser];
+  ret.point.intensity = data[2];
+  returns.push_back(ret);
+}
+
+void VelodyneDecoder::decodePacket(const velodyne_msgs::VelodynePacket &packet,
+                                   std::vector<VelodyneReturn> &returns) const {
+  const uint8_t *raw = &packet.data[0];
+  const double blockDuration =
+      (_model == VLP16) ? VLP16_BLOCK_TDURATION : HDL32_BLOCK_TDURATION;
+  const double packetStart =
+      packet.stamp.toSec() - BLOCKS_PER_PACKET * blockDuration;
+
+  int azimuthDiff = 0;
+  for (int block = 0; block < BLOCKS_PER_PACKET; ++block) {
+    const uint8_t *blockData = raw + block * BLOCK_SIZE;
+    if (readUint16(blockData) != UPPER_BANK) break;
+
+    const int azimuth = readUint16(blockData + 2);
+    if (block < BLOCKS_PER_PACKET - 1) {
+      const int next = readUint16(blockData + BLOCK_SIZE + 2);
+      azimuthDiff = (ROTATION_MAX_UNITS + next - azimuth) % ROTATION_MAX_UNITS;
+    }
+    const double blockStart = packetStart + block * blockDuration;
+    const uint8_t *data = blockData + 4;
+
+    if (_model == VLP16) {
+      for (int firing = 0; firing < 2; ++firing) {
+        for (int laser = 0; laser < 16; ++laser, data += RAW_SCAN_SIZE) {
+          const double offset =
+              laser * VLP16_DSR_TOFFSET + firing * VLP16_FIRING_TOFFSET;
+          const int corrected =
+              azimuth + int(round(azimuthDiff * offset / VLP16_BLOCK_TDURATION));
+          addReturn(laser, corrected, data, blockStart + offset, returns);
+        }
+      }
+    } else {
+      for (int laser = 0; laser < 32; ++laser, data += RAW_SCAN_SIZE) {
+        const double offset = laser * HDL32_DSR_TOFFSET;
+        const int corrected =
+            azimuth + int(round(azimuthDiff * offset / HDL32_BLOCK_TDURATION));
+        addReturn(laser, corrected, data, blockStart + offset, returns);
+      }
+    }
+  }
+}
+
+//--------------------------------------------------------------------------
+
+namespace {
+
+const uint32_t PCAP_MAGIC = 0xa1b2c3d4;
+const uint32_t PCAP_MAGIC_NANOSECONDS = 0xa1b23c4d;
+const size_t UDP_HEADER_OFFSET = 14 + 20;  // Ethernet + IPv4 without options
+const size_t UDP_PAYLOAD_OFFSET = UDP_HEADER_OFFSET + 8;
+const size_t VELODYNE_PACKET_SIZE = 1206;
+
+inline uint32_t swap32(uint32_t v) {
+  return ((v & 0xff) << 24) | ((v & 0xff00) << 8) | ((v >> 8) & 0xff00) |
+         (v >> 24);
+}
+
+}  // namespace
+
+bool VelodynePcapReader::open(const std::string &path) {
+  _file.open(path.c_str(), std::ios::binary);
+  if (!_file) return false;
+
+  uint8_t header[24];
+  if (!_file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+    return false;
+  }
+  uint32_t magic;
+  std::memcpy(&magic, header, 4);
+  _swapped = false;
+  if (magic == swap32(PCAP_MAGIC) || magic == swap32(PCAP_MAGIC_NANOSECONDS)) {
+    _swapped = true;
+    magic = swap32(magic);
+  }
+  if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NANOSECONDS) return false;
+  _nanoseconds = (magic == PCAP_MAGIC_NANOSECONDS);
+
+  uint32_t linkType;
+  std::memcpy(&linkType, header + 20, 4);
+  if (_swapped) linkType = swap32(linkType);
+  _has_pending = false;
+  return linkType == 1;  // Ethernet
+}
+
+bool VelodynePcapReader::nextPacket(velodyne_msgs::VelodynePacket &packet) {
+  std::vector<uint8_t> frame;
+  while (_file) {
+    uint32_t record[4];  // seconds, sub-seconds, captured length, length
+    if (!_file.read(reinterpret_cast<char *>(record), sizeof(record))) {
+      return false;
+    }
+    if (_swapped) {
+      for (int i = 0; i < 4; ++i) record[i] = swap32(record[i]);
+    }
+    frame.resize(record[2]);
+    if (!_file.read(reinterpret_cast<char *>(frame.data()), frame.size())) {
+      return false;
+    }
+
+    // keep only the data packets, position packets are smaller
+    if (frame.size() < UDP_PAYLOAD_OFFSET + VELODYNE_PACKET_SIZE) continue;
+    const size_t udpLength =
+        (size_t(frame[UDP_HEADER_OFFSET + 4]) << 8) | frame[UDP_HEADER_OFFSET + 5];
+    if (udpLength != VELODYNE_PACKET_SIZE + 8) continue;
+
+    packet.stamp.sec = record[0];
+    packet.stamp.nsec = _nanoseconds ? record[1] : record[1] * 1000;
+    std::copy(frame.begin() + UDP_PAYLOAD_OFFSET,
+              frame.begin() + UDP_PAYLOAD_OFFSET + VELODYNE_PACKET_SIZE,
+              packet.data.begin());
+    return true;
+  }
+  return false;
+}
+
+bool VelodynePcapReader::nextScan(velodyne_msgs::VelodyneScan &scan) {
+  scan.packets.clear();
+  if (_has_pending) {
+    scan.packets.push_back(_pending);
+    _has_pending = false;
+  }
+
+  velodyne_msgs::VelodynePacket packet;
+  while (nextPacket(packet)) {
+    if (!scan.packets.empty() &&
+        VelodyneDecoder::packetAzimuth(packet) <
+            VelodyneDecoder::packetAzimuth(scan.packets.back())) {
+      _pending = packet;
+      _has_pending = true;
+      break;
+    }
+    scan.packets.push_back(packet);
+  }
+  if (scan.packets.empty()) return false;
+
+  scan.header.stamp = scan.packets.back().stamp;
+  scan.header.frame_id = "velodyne";
+  return true;
+}
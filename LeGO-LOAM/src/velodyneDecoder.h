@@ -0,0 +1,77 @@
+#ifndef VELODYNEDECODER_H
+#define VELODYNEDECODER_H
+
+#include "utility.h"
+#include <velodyne_msgs/VelodyneScan.h>
+
+// One return of a raw Velodyne packet, already placed in the range image
+struct VelodyneReturn {
+  uint16_t row;      // ring, ordered by increasing vertical angle
+  uint16_t column;
+  float range;
+  double time;       // exact firing time
+  PointType point;
+};
+
+// Decodes raw VLP-16 / HDL-32E data packets (velodyne_msgs/VelodynePacket)
+// without going through the PointCloud2 conversion of the driver.
+// Per laser calibration is limited to the vertical angle and the rotational
+// correction, which is all these two sensors need.
+class VelodyneDecoder {
+ public:
+  enum Model { VLP16, HDL32E };
+
+  VelodyneDecoder(Model model, size_t horizontal_scan);
+
+  // Calibration tables, in degrees, one entry per laser (firing order)
+  bool setCalibration(const std::vector<double> &vertical_angles,
+                      const std::vector<double> &rotation_corrections);
+
+  size_t lasers() const { return _vertical_sin.size(); }
+
+  // Azimuth of the first block, in hundredths of degree
+  static uint16_t packetAzimuth(const velodyne_msgs::VelodynePacket &packet);
+
+  // Appends all the valid returns of the packet.
+  // The packet stamp is taken as the time of its last firing.
+  void decodePacket(const velodyne_msgs::VelodynePacket &packet,
+                    std::vector<VelodyneReturn> &returns) const;
+
+ private:
+  void addReturn(int laser, int azimuth, const uint8_t *data, double time,
+                 std::vector<VelodyneReturn> &returns) const;
+
+  Model _model;
+  size_t _horizontal_scan;
+
+  std::vector<float> _vertical_sin;
+  std::vector<float> _vertical_cos;
+  std::vector<int> _rotation_correction;  // hundredths of degree
+  std::vector<uint16_t> _laser_row;
+
+  // indexed by azimuth in hundredths of degree
+  std::vector<float> _azimuth_sin;
+  std::vector<float> _azimuth_cos;
+  std::vector<uint16_t> _azimuth_column;
+};
+
+// Minimal reader of Velodyne pcap captures (Ethernet / IPv4 / UDP), returning
+// the data packets and grouping them into full rotations.
+class VelodynePcapReader {
+ public:
+  bool open(const std::string &path);
+
+  bool nextPacket(velodyne_msgs::VelodynePacket &packet);
+
+  // Packets of one rotation, split where the azimuth wraps around
+  bool nextScan(velodyne_msgs::VelodyneScan &scan);
+
+ private:
+  std::ifstream _file;
+  bool _swapped;
+  bool _nanoseconds;
+  bool _has_pending;
+  velodyne_msgs::VelodynePacket _pending;
+};
+
+#endif  // VELODYNEDECODER_H